@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <immintrin.h>
+
+// Allocator that aligns storage to Alignment bytes.
+// C++14 operator new ignores alignas beyond the fundamental alignment,
+// so vectors of cache-line aligned records need this to keep each record
+// on its own lines.
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        void* p = _mm_malloc(n * sizeof(T), Alignment);
+        if (p == NULL)
+        {
+            std::abort();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t) noexcept
+    {
+        _mm_free(p);
+    }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator==(
+    const AlignedAllocator<T, Alignment>&,
+    const AlignedAllocator<U, Alignment>&) noexcept
+{
+    return true;
+}
+
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator!=(
+    const AlignedAllocator<T, Alignment>&,
+    const AlignedAllocator<U, Alignment>&) noexcept
+{
+    return false;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Counts heap allocations made through operator new.
+// Building with CULLING_COUNT_ALLOCATIONS replaces the global operator new
+// with a counting wrapper; otherwise the count is always zero.
+// Used to check that steady-state culling ticks never touch the heap,
+// as malloc jitter shows up directly in frame times.
+// Never define CULLING_COUNT_ALLOCATIONS in the shipped extension.
+long long CountAllocations();
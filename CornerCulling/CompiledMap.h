@@ -0,0 +1,300 @@
+#pragma once
+#include "GeometricPrimitives.h"
+#include "FastBVH.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Precompiled culling map, written next to culling_<map>.txt as
+// culling_<map>.bin by the culling_compile_map tool.
+// A CompiledMapHeader is followed by four sections, each starting on a
+// 64-byte boundary:
+//   planes      OccluderCount CuboidPlanes, in BVH primitive order
+//   bounds      OccluderCount OccluderBounds, in the same order
+//   nodes       NodeCount FastBVH::Node<float>, the flattened binary BVH
+//   wide nodes  WideNodeCount FastBVH::WideNode<Width>
+// Records keep their in-memory layout, so a mapped file is used in place.
+// The version, width and record sizes reject files from other builds,
+// and SourceHash rejects files compiled from an older text map.
+constexpr uint32_t COMPILED_MAP_VERSION = 3;
+constexpr uint32_t COMPILED_MAP_ALIGNMENT = 64;
+const char COMPILED_MAP_MAGIC[8] = "CULLMAP";
+
+// Axis-aligned bounds of an occluder.
+struct OccluderBounds
+{
+    vec3 Min;
+    vec3 Max;
+};
+
+struct CompiledMapHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    // Branching factor of the wide nodes.
+    uint32_t Width;
+    uint32_t PlaneSize;
+    uint32_t NodeSize;
+    uint32_t WideNodeSize;
+    uint32_t OccluderCount;
+    uint32_t NodeCount;
+    uint32_t WideNodeCount;
+    // Byte offsets of each section from the start of the file.
+    uint32_t PlanesOffset;
+    uint32_t BoundsOffset;
+    uint32_t NodesOffset;
+    uint32_t WideNodesOffset;
+    uint32_t FileSize;
+    uint32_t Padding;
+    // Hash of the text map that the file was compiled from.
+    uint64_t SourceHash;
+};
+
+// Occluder tables of a map, pointing either into a mapped compiled map
+// or into tables built from the text map.
+template <int Width>
+struct CompiledMapView
+{
+    const CuboidPlanes* Planes = NULL;
+    const OccluderBounds* Bounds = NULL;
+    uint32_t OccluderCount = 0;
+    const FastBVH::Node<float>* Nodes = NULL;
+    uint32_t NodeCount = 0;
+    // NULL when the file was compiled for another width,
+    // in which case the nodes must be collapsed again.
+    const FastBVH::WideNode<Width>* WideNodes = NULL;
+    uint32_t WideNodeCount = 0;
+};
+
+constexpr uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+// Continues a 64-bit FNV-1a hash over size bytes of data.
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Computes the 64-bit FNV-1a hash of a file's contents.
+// Returns false if the file cannot be read.
+inline bool HashFile(const char* fileName, uint64_t& hash)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    hash = FNV_OFFSET_BASIS;
+    unsigned char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        hash = HashBytes(buffer, count, hash);
+    }
+    fclose(file);
+    return true;
+}
+
+namespace CompiledMapImpl
+{
+    inline uint32_t AlignOffset(uint32_t offset)
+    {
+        return (offset + COMPILED_MAP_ALIGNMENT - 1) & ~(COMPILED_MAP_ALIGNMENT - 1);
+    }
+
+    // Writes size bytes of data at offset, zero filling any gap before it.
+    inline bool WriteSection(FILE* file, long& position, uint32_t offset, const void* data, size_t size)
+    {
+        static const char zeros[COMPILED_MAP_ALIGNMENT] = {0};
+        while (position < long(offset))
+        {
+            size_t gap = std::min(size_t(offset - position), sizeof(zeros));
+            if (fwrite(zeros, 1, gap, file) != gap)
+            {
+                return false;
+            }
+            position += long(gap);
+        }
+        if (size > 0 && fwrite(data, 1, size, file) != size)
+        {
+            return false;
+        }
+        position += long(size);
+        return true;
+    }
+}
+
+// Writes a compiled map to fileName. Returns false on any write error.
+template <int Width>
+bool WriteCompiledMap(const char* fileName, uint64_t sourceHash, const CompiledMapView<Width>& map)
+{
+    using namespace CompiledMapImpl;
+    CompiledMapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, COMPILED_MAP_MAGIC, sizeof(header.Magic));
+    header.Version = COMPILED_MAP_VERSION;
+    header.Width = Width;
+    header.PlaneSize = sizeof(CuboidPlanes);
+    header.NodeSize = sizeof(FastBVH::Node<float>);
+    header.WideNodeSize = sizeof(FastBVH::WideNode<Width>);
+    header.OccluderCount = map.OccluderCount;
+    header.NodeCount = map.NodeCount;
+    header.WideNodeCount = map.WideNodeCount;
+    header.PlanesOffset = AlignOffset(sizeof(header));
+    header.BoundsOffset = AlignOffset(header.PlanesOffset + map.OccluderCount * header.PlaneSize);
+    header.NodesOffset = AlignOffset(header.BoundsOffset + map.OccluderCount * sizeof(OccluderBounds));
+    header.WideNodesOffset = AlignOffset(header.NodesOffset + map.NodeCount * header.NodeSize);
+    header.FileSize = header.WideNodesOffset + map.WideNodeCount * header.WideNodeSize;
+    header.SourceHash = sourceHash;
+
+    FILE* file = fopen(fileName, "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+    long position = 0;
+    bool ok =
+        WriteSection(file, position, 0, &header, sizeof(header))
+        && WriteSection(file, position, header.PlanesOffset,
+            map.Planes, map.OccluderCount * sizeof(CuboidPlanes))
+        && WriteSection(file, position, header.BoundsOffset,
+            map.Bounds, map.OccluderCount * sizeof(OccluderBounds))
+        && WriteSection(file, position, header.NodesOffset,
+            map.Nodes, map.NodeCount * sizeof(FastBVH::Node<float>))
+        && WriteSection(file, position, header.WideNodesOffset,
+            map.WideNodes, map.WideNodeCount * sizeof(FastBVH::WideNode<Width>));
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
+
+// Checks that a flattened binary BVH only references nodes after each
+// node and primitives within occluderCount, so collapsing it terminates
+// and stays in bounds.
+inline bool ValidBinaryNodes(const FastBVH::Node<float>* nodes, uint32_t nodeCount, uint32_t occluderCount)
+{
+    for (uint32_t i = 0; i < nodeCount; i++)
+    {
+        const FastBVH::Node<float>& node = nodes[i];
+        if (node.isLeaf())
+        {
+            // Collapsing takes a zero count to mark an inner child.
+            if (node.primitive_count == 0
+                || uint64_t(node.start) + node.primitive_count > occluderCount)
+            {
+                return false;
+            }
+        }
+        else if (node.right_offset < 2 || uint64_t(i) + node.right_offset >= nodeCount)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks that a wide BVH only references nodes after each node and
+// primitives within occluderCount, and that no path through it pushes
+// more entries than the traversal stack holds.
+template <int Width>
+bool ValidWideNodes(const FastBVH::WideNode<Width>* nodes, uint32_t nodeCount, uint32_t occluderCount)
+{
+    // Stack entries below each node while it is visited. Children come
+    // after their parents, so every parent is final before its children.
+    std::vector<uint32_t> depths(nodeCount, 0);
+    for (uint32_t i = 0; i < nodeCount; i++)
+    {
+        const FastBVH::WideNode<Width>& node = nodes[i];
+        if (node.child_count == 0
+            || node.child_count > uint32_t(Width)
+            || depths[i] + node.child_count > uint32_t(FastBVH::TraverserImpl::stack_size))
+        {
+            return false;
+        }
+        for (uint32_t c = 0; c < node.child_count; c++)
+        {
+            if (node.count[c] > 0)
+            {
+                if (uint64_t(node.child[c]) + node.count[c] > occluderCount)
+                {
+                    return false;
+                }
+            }
+            else if (node.child[c] <= i || node.child[c] >= nodeCount)
+            {
+                return false;
+            }
+            else
+            {
+                // Siblings still on the stack while this child is visited.
+                depths[node.child[c]] = std::max(
+                    depths[node.child[c]], depths[i] + node.child_count - 1);
+            }
+        }
+    }
+    return true;
+}
+
+// Points map at the sections of a mapped compiled map.
+// sourceHash is the hash of the current text map, or NULL to accept the
+// file without one. Returns false, leaving map untouched, if the file is
+// malformed, from another build or compiled from different text, or if
+// its nodes reference anything out of bounds.
+template <int Width>
+bool ReadCompiledMap(const MappedFile& file, const uint64_t* sourceHash, CompiledMapView<Width>& map)
+{
+    if (file.GetSize() < sizeof(CompiledMapHeader))
+    {
+        return false;
+    }
+    const char* base = static_cast<const char*>(file.GetData());
+    CompiledMapHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.Magic, COMPILED_MAP_MAGIC, sizeof(header.Magic)) != 0
+        || header.Version != COMPILED_MAP_VERSION
+        || header.PlaneSize != sizeof(CuboidPlanes)
+        || header.NodeSize != sizeof(FastBVH::Node<float>)
+        || header.FileSize != file.GetSize()
+        || (sourceHash != NULL && header.SourceHash != *sourceHash))
+    {
+        return false;
+    }
+    // Check every section against the file size in 64 bits,
+    // so that corrupt counts cannot overflow past the end.
+    auto fits = [&](uint32_t offset, uint64_t count, uint64_t size)
+    {
+        return offset % COMPILED_MAP_ALIGNMENT == 0
+            && offset + count * size <= header.FileSize;
+    };
+    const bool sameWidth =
+        header.Width == uint32_t(Width)
+        && header.WideNodeSize == sizeof(FastBVH::WideNode<Width>);
+    if (!fits(header.PlanesOffset, header.OccluderCount, sizeof(CuboidPlanes))
+        || !fits(header.BoundsOffset, header.OccluderCount, sizeof(OccluderBounds))
+        || !fits(header.NodesOffset, header.NodeCount, sizeof(FastBVH::Node<float>))
+        || !fits(header.WideNodesOffset, header.WideNodeCount, header.WideNodeSize))
+    {
+        return false;
+    }
+    const auto* nodes = reinterpret_cast<const FastBVH::Node<float>*>(base + header.NodesOffset);
+    const auto* wideNodes = reinterpret_cast<const FastBVH::WideNode<Width>*>(base + header.WideNodesOffset);
+    if (!ValidBinaryNodes(nodes, header.NodeCount, header.OccluderCount)
+        || (sameWidth && !ValidWideNodes(wideNodes, header.WideNodeCount, header.OccluderCount)))
+    {
+        return false;
+    }
+    map.Planes = reinterpret_cast<const CuboidPlanes*>(base + header.PlanesOffset);
+    map.Bounds = reinterpret_cast<const OccluderBounds*>(base + header.BoundsOffset);
+    map.OccluderCount = header.OccluderCount;
+    map.Nodes = nodes;
+    map.NodeCount = header.NodeCount;
+    map.WideNodes = sameWidth ? wideNodes : NULL;
+    map.WideNodeCount = sameWidth ? header.WideNodeCount : 0;
+    return true;
+}
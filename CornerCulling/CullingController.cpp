@@ -2,227 +2,1428 @@
 #include <chrono> 
 #include <iostream>
 #include "CullingIO.h"
+#include "AllocationCounter.h"
 
-CullingController::CullingController() {}
+using CullingClock = std::chrono::steady_clock;
+
+static long long ElapsedNanoseconds(CullingClock::time_point Start, CullingClock::time_point Stop)
+{
+    return (long long)std::chrono::duration_cast
+        <std::chrono::nanoseconds>(Stop - Start).count();
+}
+
+CullingController::CullingController()
+{
+    // Pick the IsBlocking kernel before any worker thread can race to it.
+    ActiveCuboidBlockingKernel();
+    BundleQueue.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    ScheduledBundles.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    BundleOrder.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    BundlePriorities.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    Outcomes.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    CuboidOutcomes.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    BatchCulled.reserve(MAX_CHARACTERS * MAX_CHARACTERS / BUDGET_BATCH + 1);
+    ReverseBundles.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+    RasterViewers.reserve(MAX_CHARACTERS + 1);
+    RasterOccluded.reserve(MAX_CHARACTERS * MAX_CHARACTERS);
+}
+
+CullingController::~CullingController()
+{
+    StopAsyncCulling();
+    SaveOcclusionHints();
+}
 
 void CullingController::BeginPlay(char* mapName)
 {
+    // The culling thread reads the tables that are about to be replaced.
+    StopAsyncCulling();
+    SaveOcclusionHints();
+    HintsActive = false;
     MapName = mapName;
-    Cuboids.clear();
+    CullingPeriod = std::max(1, cullingPeriod);
+    if (!sweptHulls && CullingPeriod > DEFAULT_CULLING_PERIOD)
+    {
+        printf(
+            "Culling period %d reveals enemies late without swept hulls, using %d\n",
+            CullingPeriod,
+            DEFAULT_CULLING_PERIOD);
+        CullingPeriod = DEFAULT_CULLING_PERIOD;
+    }
+    VisibilityTimerMax = CullingPeriod * 3 + (asyncCulling ? 1 : 0);
+    // Asynchronous results are a tick older when they are used.
+    SweepDistance = sweptHulls
+        ? MAX_PLAYER_SPEED * (CullingPeriod + (asyncCulling ? 1 : 0)) / std::max(1, tickRate)
+        : 0;
+    ThreadPool.Resize(workerThreads);
     memset(
         CuboidCaches,
         0,
-        MAX_CHARACTERS * MAX_CHARACTERS * CUBOID_CACHE_SIZE * sizeof(Cuboid*));
+        MAX_CHARACTERS * MAX_CHARACTERS * CUBOID_CACHE_SIZE * sizeof(CuboidPlanes*));
+    memset(HotOccluders, 0, sizeof(HotOccluders));
+    memset(Deferred, 0, sizeof(Deferred));
+    memset(NextCullTicks, 0, sizeof(NextCullTicks));
+    for (auto& Row : Proofs)
+    {
+        for (OcclusionProof& Proof : Row)
+        {
+            Proof.Blocker = NULL;
+            Proof.Backoff = 0;
+            Proof.Penalty = 0;
+        }
+    }
+
+    // Drop the previous map's tables before anything points at new ones.
+    CuboidTraverser.reset();
+    CuboidWideBVH.reset();
+    CuboidBVH.reset();
+    Cuboids.clear();
+    Occluders.clear();
+    OccluderAABBs.clear();
+    CompiledMapFile.Close();
+    Map = CompiledMapView<BVH_WIDTH>();
+    Metrics.Reset();
+
+    char TextFileName[256];
+    char CompiledFileName[256];
+    MapFileName(TextFileName, mapDirectory, mapName, ".txt");
+    MapFileName(CompiledFileName, mapDirectory, mapName, ".bin");
+    HasMapSource = HashFile(TextFileName, MapSourceHash);
+
+    if (!useCompiledMaps || !LoadCompiledMap(CompiledFileName))
+    {
+        LoadTextMap(TextFileName);
+    }
+
+    if (Map.OccluderCount > 0)
+    {
+        CuboidTraverser = std::make_unique
+            <Traverser<float, decltype(Intersector), BVH_WIDTH>>
+            (Map.WideNodes, Map.WideNodeCount, Intersector, Map.Planes);
+    }
+
+    OccluderHash = HashBytes(Map.Planes, Map.OccluderCount * sizeof(CuboidPlanes));
+    if (cullingEngine == CULLING_ENGINE_RASTER)
+    {
+        // Cubes of the previous map must be rebuilt.
+        Rasters.assign(MAX_CHARACTERS + 1, OcclusionRaster());
+    }
+    else
+    {
+        Rasters.clear();
+        Rasters.shrink_to_fit();
+    }
+    Pvs.Clear();
+    if (usePvs && Map.OccluderCount > 0)
+    {
+        LoadPvs();
+    }
+    Portals.Clear();
+    if (usePortals)
+    {
+        char FileName[256];
+        MapFileName(FileName, mapDirectory, mapName, ".portals");
+        if (Portals.Load(FileName))
+        {
+            printf(
+                "Culling portals: %d cells, %d portals from %s\n",
+                Portals.GetCellCount(),
+                Portals.GetPortalCount(),
+                FileName);
+        }
+    }
+
+    if (occlusionHints && Map.OccluderCount > 0)
+    {
+        MapFileName(HintsFileName, mapDirectory, mapName, ".hints");
+        if (Hints.Load(HintsFileName, OccluderHash, Map.OccluderCount))
+        {
+            printf("Culling hints loaded from %s\n", HintsFileName);
+        }
+        HintsActive = true;
+    }
+
+    if (asyncCulling)
+    {
+        StartAsyncCulling();
+    }
+
+    // TODO: Add occluding spheres, ma
+}
+
+void CullingController::LoadTextMap(const char* fileName)
+{
+    // Add occluding cuboids.
+    for (auto c: FileToCuboids(fileName))
+    {
+        Cuboids.emplace_back(c);
+    }
+
+    // Build the cuboid BVH.
+    if (Cuboids.size() > 0)
+    {
+        FastBVH::BuildStrategy<float, 2> Builder(bvhLeafSize);
+        CuboidBoxConverter Converter;
+        CuboidBVH = std::make_unique
+            <FastBVH::BVH<float, Cuboid>>
+            (Builder(Cuboids, Converter));
+        BVHReport = Builder.report();
+        printf(
+            "Culling BVH: %u cuboids, %u nodes, %u leaves, depth %u, SAH cost %.2f\n",
+            unsigned(Cuboids.size()),
+            BVHReport.node_count,
+            BVHReport.leaf_count,
+            BVHReport.max_depth,
+            BVHReport.sah_cost);
+        // The builder reorders Cuboids, so the tables are filled after.
+        Occluders.reserve(Cuboids.size());
+        OccluderAABBs.reserve(Cuboids.size());
+        for (const Cuboid& C : Cuboids)
+        {
+            Occluders.emplace_back(C);
+            OccluderAABBs.push_back(OccluderBounds{ C.AABBMin, C.AABBMax });
+        }
+        CuboidWideBVH = std::make_unique
+            <FastBVH::WideBVH<BVH_WIDTH>>
+            (*CuboidBVH.get());
+
+        const auto Nodes = CuboidBVH->getNodes();
+        Map.Planes = Occluders.data();
+        Map.Bounds = OccluderAABBs.data();
+        Map.OccluderCount = uint32_t(Cuboids.size());
+        Map.Nodes = Nodes.begin();
+        Map.NodeCount = uint32_t(Nodes.size());
+        Map.WideNodes = CuboidWideBVH->getNodes();
+        Map.WideNodeCount = uint32_t(CuboidWideBVH->size());
+    }
+}
+
+bool CullingController::LoadCompiledMap(const char* fileName)
+{
+    if (!CompiledMapFile.Open(fileName))
+    {
+        return false;
+    }
+    // Without a text map there is nothing for the compiled map to be
+    // stale against, so it is used as is.
+    if (!ReadCompiledMap(CompiledMapFile, HasMapSource ? &MapSourceHash : NULL, Map))
+    {
+        printf("%s is stale or invalid, loading the text map\n", fileName);
+        CompiledMapFile.Close();
+        return false;
+    }
+    // A compiled map for another BVH_WIDTH only stores usable binary
+    // nodes, so collapse those instead of rebuilding from text.
+    if (Map.WideNodes == NULL)
+    {
+        CuboidWideBVH = std::make_unique
+            <FastBVH::WideBVH<BVH_WIDTH>>
+            (FastBVH::ConstIterable<FastBVH::Node<float>>(Map.Nodes, Map.NodeCount));
+        if (!ValidWideNodes(
+                CuboidWideBVH->getNodes(), uint32_t(CuboidWideBVH->size()), Map.OccluderCount))
+        {
+            printf("%s is too deep to traverse, loading the text map\n", fileName);
+            CuboidWideBVH.reset();
+            Map = CompiledMapView<BVH_WIDTH>();
+            CompiledMapFile.Close();
+            return false;
+        }
+        Map.WideNodes = CuboidWideBVH->getNodes();
+        Map.WideNodeCount = uint32_t(CuboidWideBVH->size());
+    }
+    printf(
+        "Culling map: %u cuboids, %u nodes from %s\n",
+        Map.OccluderCount,
+        Map.NodeCount,
+        fileName);
+    return true;
+}
+
+void CullingController::GetMapBounds(vec3& Min, vec3& Max) const
+{
+    Min = Max = vec3(0);
+    for (uint32_t i = 0; i < Map.OccluderCount; i++)
+    {
+        Min = i == 0 ? Map.Bounds[i].Min : glm::min(Min, Map.Bounds[i].Min);
+        Max = i == 0 ? Map.Bounds[i].Max : glm::max(Max, Map.Bounds[i].Max);
+    }
+}
+
+void CullingController::LoadPvs()
+{
+    char FileName[256];
+    MapFileName(FileName, mapDirectory, MapName, ".pvs");
+    if (!Pvs.Load(FileName, OccluderHash, Map.OccluderCount))
+    {
+        return;
+    }
+    const float Reach = GetPeekReach();
+    if (Pvs.GetMargin() < Reach)
+    {
+        printf(
+            "%s covers peeks of %.0f units, but culling needs %.0f, ignoring it\n",
+            FileName,
+            Pvs.GetMargin(),
+            Reach);
+        Pvs.Clear();
+        return;
+    }
+    printf("Culling PVS: %d cells from %s\n", Pvs.GetCellCount(), FileName);
+}
+
+float CullingController::GetPeekReach() const
+{
+    // Peeks reach at most this far from the eye, and swept hulls grow
+    // by SweepDistance, which is included.
+    return std::max(
+        MAX_PLAYER_SPEED * maxLookahead / 1000 + SweepDistance,
+        20 + SweepDistance);
+}
+
+bool CullingController::SaveOcclusionHints()
+{
+    if (!HintsActive)
+    {
+        return true;
+    }
+    if (!Hints.Save(HintsFileName, OccluderHash, Map.OccluderCount))
+    {
+        printf("Could not write culling hints to %s\n", HintsFileName);
+        return false;
+    }
+    return true;
+}
+
+bool CullingController::SaveCompiledMap()
+{
+    if (!HasMapSource || Map.OccluderCount == 0)
+    {
+        return false;
+    }
+    char FileName[256];
+    MapFileName(FileName, mapDirectory, MapName, ".bin");
+    return WriteCompiledMap(FileName, MapSourceHash, Map);
+}
+
+void CullingController::Tick()
+{
+    long long AllocationsBefore = CountAllocations();
+    if (AsyncThread.joinable())
+    {
+        AsyncInputs.WriteBuffer().Tick = ++AsyncGameTicks;
+        AsyncInputs.Publish();
+        // Pairs with the fence in AsyncCullLoop: either the culling thread
+        // sees these inputs before it sleeps, or this sees it sleeping.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (AsyncWaiting.load())
+        {
+            std::lock_guard<std::mutex> Guard(AsyncMutex);
+            AsyncWake.notify_one();
+        }
+        // Keep the previous visibility if no cull has finished since.
+        AsyncResults.Update();
+    }
+    else
+    {
+        TotalTicks++;
+        Cull();
+    }
+    TickAllocations = CountAllocations() - AllocationsBefore;
+}
+
+void CullingController::StartAsyncCulling()
+{
+    VisibilityFrame AllVisible;
+    memset(AllVisible.Visible, 1, sizeof(AllVisible.Visible));
+    AsyncResults.Fill(AllVisible);
+    AsyncInputs.Fill(TickInputs());
+    AsyncGameTicks = 0;
+    AsyncCulledTick = 0;
+    for (int i = 0; i <= MAX_CHARACTERS; i++)
+    {
+        AsyncTeams[i] = Characters[i].Team;
+    }
+    AsyncStopping.store(false);
+    AsyncThread = std::thread(&CullingController::AsyncCullLoop, this);
+}
+
+void CullingController::StopAsyncCulling()
+{
+    if (!AsyncThread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> Guard(AsyncMutex);
+        AsyncStopping.store(true);
+        AsyncWake.notify_one();
+    }
+    AsyncThread.join();
+}
+
+void CullingController::AsyncCullLoop()
+{
+    while (true)
+    {
+        if (!AsyncInputs.HasFresh())
+        {
+            std::unique_lock<std::mutex> Lock(AsyncMutex);
+            AsyncWaiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            AsyncWake.wait(
+                Lock,
+                [this] { return AsyncInputs.HasFresh() || AsyncStopping.load(); });
+            AsyncWaiting.store(false);
+        }
+        if (AsyncStopping.load())
+        {
+            return;
+        }
+        // Skips straight to the newest inputs if culling fell behind.
+        AsyncInputs.Update();
+        const TickInputs& Inputs = AsyncInputs.ReadBuffer();
+        SetCharacters(
+            Inputs.Teams, Inputs.Eyes, Inputs.Bases,
+            Inputs.Yaws, Inputs.Pitches, Inputs.Speeds);
+        const int InputTick = Inputs.Tick;
+        LastTickStats.SkippedTicks = std::max(0, InputTick - AsyncCulledTick - 1);
+        AsyncCulledTick = InputTick;
+        if (LastTickStats.SkippedTicks > 0)
+        {
+            // Pairs backed off by ScheduleNextCull were allowed a number of
+            // culls that now spans more game ticks.
+            memset(NextCullTicks, 0, sizeof(NextCullTicks));
+        }
+        TotalTicks++;
+        Cull();
+
+        VisibilityFrame& Frame = AsyncResults.WriteBuffer();
+        for (int i = 0; i < MAX_CHARACTERS; i++)
+        {
+            for (int j = 0; j < MAX_CHARACTERS; j++)
+            {
+                Frame.Visible[i][j] = VisibilityTimers[i][j] > 0 || Deferred[i][j];
+            }
+        }
+        Frame.Tick = InputTick;
+        AsyncResults.Publish();
+    }
+}
+
+void CullingController::Cull()
+{
+    CullingTickStats& Stats = LastTickStats;
+    for (int k = 0; k < CUBOID_CACHE_SIZE; k++)
+    {
+        Stats.CacheHits[k] = 0;
+    }
+    Stats.NodesVisited = 0;
+    Stats.BlockingTests = 0;
+    Stats.ProofReuses = 0;
+    Stats.HintHits = 0;
+    Stats.HotHits = 0;
+    Stats.PvsRejects = 0;
+    Stats.PortalRejects = 0;
+    Stats.RasterBuilds = 0;
+    Stats.BundlesCulledByCache = 0;
+    Stats.BundlesDeferred = 0;
+    Stats.StageNanoseconds[CACHE_STAGE] = 0;
+    Stats.StageNanoseconds[CUBOID_STAGE] = 0;
+
+    const auto T0 = CullingClock::now();
+    PopulateBundles();
+    Stats.BundlesQueued = int(BundleQueue.size());
+    if (cullBudgetMicroseconds > 0)
+    {
+        PrioritizeBundles();
+    }
+    const auto T1 = CullingClock::now();
+    Stats.StageNanoseconds[POPULATE_STAGE] = ElapsedNanoseconds(T0, T1);
+    if (cullBudgetMicroseconds > 0)
+    {
+        CullWithinBudget(T0 + std::chrono::microseconds(cullBudgetMicroseconds));
+    }
+    else
+    {
+        CullQueuedBundles();
+    }
+    Stats.BundlesRevealed = int(BundleQueue.size());
+    Stats.BundlesCulledByCuboids = Stats.BundlesQueued - Stats.BundlesCulledByCache
+        - Stats.BundlesRevealed - Stats.BundlesDeferred;
+    const auto T2 = CullingClock::now();
+    UpdateVisibility();
+    const auto T3 = CullingClock::now();
+
+    Stats.StageNanoseconds[VISIBILITY_STAGE] = ElapsedNanoseconds(T2, T3);
+    Metrics.RecordTick(Stats);
+}
+
+void CullingController::CullQueuedBundles()
+{
+    CullingTickStats& Stats = LastTickStats;
+    const auto T0 = CullingClock::now();
+    if (cullingEngine == CULLING_ENGINE_RASTER)
+    {
+        CullWithRaster();
+        Stats.StageNanoseconds[CUBOID_STAGE] += ElapsedNanoseconds(T0, CullingClock::now());
+        return;
+    }
+    const int Queued = int(BundleQueue.size());
+    CullWithCache();
+    Stats.BundlesCulledByCache += Queued - int(BundleQueue.size());
+    const auto T1 = CullingClock::now();
+    //CullWithSpheres();
+    CullWithCuboids();
+    const auto T2 = CullingClock::now();
+    Stats.StageNanoseconds[CACHE_STAGE] += ElapsedNanoseconds(T0, T1);
+    Stats.StageNanoseconds[CUBOID_STAGE] += ElapsedNanoseconds(T1, T2);
+}
+
+void CullingController::CullWithinBudget(std::chrono::steady_clock::time_point Deadline)
+{
+    CullingTickStats& Stats = LastTickStats;
+    const auto T0 = CullingClock::now();
+    // Batches cull the scheduled bundles in place, in BundleOrder, so that
+    // bundles that are deferred are never copied or paired up.
+    const int Scheduled = int(BundleOrder.size());
+    const bool Raster = cullingEngine == CULLING_ENGINE_RASTER;
+    if (Raster)
+    {
+        RebuildRasters(ScheduledBundles);
+        RasterOccluded.resize(Scheduled);
+    }
+    else
+    {
+        Outcomes.resize(Scheduled);
+        CuboidOutcomes.resize(Scheduled);
+    }
+    const int Batches = (Scheduled + BUDGET_BATCH - 1) / BUDGET_BATCH;
+    BatchCulled.assign(Batches, 0);
+    NextBatch.store(0, std::memory_order_relaxed);
+    BatchCacheNanoseconds.store(0, std::memory_order_relaxed);
+    BatchCuboidNanoseconds.store(0, std::memory_order_relaxed);
+    if (Batches > 0 && CullingClock::now() >= Deadline)
+    {
+        // Always cull the first batch, so that carried over pairs cannot
+        // starve, but without waking the workers for it.
+        CullBatch(0);
+        BatchCulled[0] = 1;
+    }
+    else
+    {
+        ThreadPool.ParallelFor(
+            Batches,
+            1,
+            [this, Deadline](int Begin, int End)
+            {
+                for (int n = Begin; n < End; n++)
+                {
+                    // Batches are claimed in order, so once one misses the
+                    // deadline every later one does too.
+                    const int Batch = NextBatch.fetch_add(1, std::memory_order_relaxed);
+                    if (Batch == 0 || CullingClock::now() < Deadline)
+                    {
+                        CullBatch(Batch);
+                        BatchCulled[Batch] = 1;
+                    }
+                }
+            });
+    }
+
+    BundleQueue.clear();
+    for (int q = 0; q < Scheduled; q++)
+    {
+        const Bundle& B = ScheduledBundles[BundleOrder[q]];
+        if (!BatchCulled[q / BUDGET_BATCH])
+        {
+            // Reveal the rest until a later tick gets to them.
+            Deferred[B.PlayerI][B.EnemyI] = true;
+            Stats.BundlesDeferred++;
+            continue;
+        }
+        bool Blocked;
+        if (Raster)
+        {
+            Blocked = RasterOccluded[q];
+        }
+        else
+        {
+            Stats.NodesVisited += CuboidOutcomes[q].NodesVisited;
+            Stats.BlockingTests += Outcomes[q].BlockingTests + CuboidOutcomes[q].BlockingTests;
+            Blocked = true;
+            if (Outcomes[q].Blocker != NULL)
+            {
+                ApplyCacheOutcome(B, Outcomes[q]);
+                Stats.BundlesCulledByCache++;
+            }
+            else if (CuboidOutcomes[q].Blocker != NULL)
+            {
+                ApplyCuboidOutcome(B, CuboidOutcomes[q]);
+            }
+            else
+            {
+                Blocked = false;
+            }
+        }
+        if (!Blocked)
+        {
+            BundleQueue.push_back(B);
+        }
+    }
+
+    // Split the pass between the stages by the time workers spent in each.
+    const long long Pass = ElapsedNanoseconds(T0, CullingClock::now());
+    const long long CacheWork = BatchCacheNanoseconds.load(std::memory_order_relaxed);
+    const long long CuboidWork = BatchCuboidNanoseconds.load(std::memory_order_relaxed);
+    const long long CacheShare = (CacheWork + CuboidWork > 0)
+        ? (long long)(double(Pass) * CacheWork / (CacheWork + CuboidWork))
+        : 0;
+    Stats.StageNanoseconds[CACHE_STAGE] += CacheShare;
+    Stats.StageNanoseconds[CUBOID_STAGE] += Pass - CacheShare;
+}
+
+void CullingController::CullBatch(int Batch)
+{
+    const int Begin = Batch * BUDGET_BATCH;
+    const int End = std::min(Begin + BUDGET_BATCH, int(BundleOrder.size()));
+    auto BundleAt = [this](int q) -> Bundle& { return ScheduledBundles[BundleOrder[q]]; };
+    const auto T0 = CullingClock::now();
+    for (int q = Begin; q < End; q++)
+    {
+        SetPossiblePeeks(BundleAt(q));
+    }
+    if (cullingEngine == CULLING_ENGINE_RASTER)
+    {
+        for (int q = Begin; q < End; q++)
+        {
+            RasterOccluded[q] = Map.OccluderCount > 0 && IsRasterOccluded(BundleAt(q));
+        }
+        BatchCuboidNanoseconds.fetch_add(
+            ElapsedNanoseconds(T0, CullingClock::now()), std::memory_order_relaxed);
+        return;
+    }
+    for (int q = Begin; q < End; q++)
+    {
+        Outcomes[q] = CheckCache(BundleAt(q));
+        CuboidOutcomes[q] = BundleOutcome { NULL, -1, 0, 0, 0, false };
+    }
+    const auto T1 = CullingClock::now();
+    for (int q = Begin; q < End && Map.OccluderCount > 0; q++)
+    {
+        if (Outcomes[q].Blocker != NULL)
+        {
+            continue;
+        }
+        // Pairs are only traversed together within a batch, as the other
+        // direction of a pair may be in a batch that is never culled.
+        const Bundle& B = BundleAt(q);
+        const int r = QueueIndices[B.EnemyI][B.PlayerI];
+        if (r < Begin
+            || r >= End
+            || BundleAt(r).PlayerI != B.EnemyI
+            || BundleAt(r).EnemyI != B.PlayerI
+            || Outcomes[r].Blocker != NULL)
+        {
+            CuboidOutcomes[q] = CheckCuboids(B);
+        }
+        else if (q < r)
+        {
+            CheckCuboidPair(B, BundleAt(r), CuboidOutcomes[q], CuboidOutcomes[r]);
+        }
+    }
+    const auto T2 = CullingClock::now();
+    BatchCacheNanoseconds.fetch_add(ElapsedNanoseconds(T0, T1), std::memory_order_relaxed);
+    BatchCuboidNanoseconds.fetch_add(ElapsedNanoseconds(T1, T2), std::memory_order_relaxed);
+}
+
+void CullingController::PrioritizeBundles()
+{
+    // Priorities: carried over pairs first, then visible pairs by how soon
+    // their timers expire, then hidden pairs by how recently they were
+    // visible, as those are the likeliest to change.
+    // Counting sort keeps queue order between equal priorities, so the
+    // order is deterministic, and costs little more than the queue itself.
+    int Counts[NUM_BUNDLE_PRIORITIES + 1] = {0};
+    BundlePriorities.clear();
+    for (const Bundle& B : BundleQueue)
+    {
+        int Priority;
+        if (Deferred[B.PlayerI][B.EnemyI])
+        {
+            Priority = 0;
+            Deferred[B.PlayerI][B.EnemyI] = false;
+        }
+        else if (VisibilityTimers[B.PlayerI][B.EnemyI] > 0)
+        {
+            Priority = VisibilityTimers[B.PlayerI][B.EnemyI];
+        }
+        else
+        {
+            const int Age = TotalTicks - LastRevealed[B.PlayerI][B.EnemyI];
+            Priority = VisibilityTimerMax + 1 + Age;
+        }
+        Priority = std::min(Priority, NUM_BUNDLE_PRIORITIES - 1);
+        BundlePriorities.push_back(uint8_t(Priority));
+        Counts[Priority + 1]++;
+    }
+    for (int p = 1; p <= NUM_BUNDLE_PRIORITIES; p++)
+    {
+        Counts[p] += Counts[p - 1];
+    }
+    BundleOrder.resize(BundleQueue.size());
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        const int q = Counts[BundlePriorities[b]]++;
+        BundleOrder[q] = b;
+        // Lets batches find the other direction of each pair.
+        QueueIndices[BundleQueue[b].PlayerI][BundleQueue[b].EnemyI] = q;
+    }
+    ScheduledBundles.swap(BundleQueue);
+}
+
+void CullingController::PopulateBundles()
+{
+    BundleQueue.clear();
+    const bool UsePvs = Pvs.IsLoaded();
+    if (UsePvs)
+    {
+        for (auto i = 0U; i < Characters.size(); i++)
+        {
+            EyeCells[i] = Pvs.CellOf(Characters[i].Eye);
+        }
+    }
+    const bool UsePortals = Portals.IsLoaded();
+    if (UsePortals)
+    {
+        const float Reach = GetPeekReach();
+        const vec3 Below(
+            PVS_HULL_EXTENT_HORIZONTAL + Reach,
+            PVS_HULL_EXTENT_HORIZONTAL + Reach,
+            PVS_HULL_EXTENT_DOWN + Reach);
+        const vec3 Above(
+            PVS_HULL_EXTENT_HORIZONTAL + Reach,
+            PVS_HULL_EXTENT_HORIZONTAL + Reach,
+            PVS_HULL_EXTENT_UP + Reach);
+        for (auto i = 0U; i < Characters.size(); i++)
+        {
+            const vec3& Eye = Characters[i].Eye;
+            PortalCellCounts[i] = Portals.CellsOf(Eye, Eye - Below, Eye + Above, PortalCells[i]);
+        }
+    }
+    for (auto i = 0U; i < Characters.size(); i++)
+    {
+        if (!IsAlive[i])
+        {
+            // Pairs with a dead character start over when it respawns.
+            for (auto j = 0U; j < Characters.size(); j++)
+            {
+                NextCullTicks[i][j] = NextCullTicks[j][i] = 0;
+                LastRevealed[i][j] = LastRevealed[j][i] = TotalTicks;
+            }
+            continue;
+        }
+        // Amount of lookahead to account for latency (milliseconds).
+        const int lookahead = std::min(GetLatency(i), maxLookahead);
+        // Maximum player speed in units/millisecond.
+        float speed = 0.001f * std::min(
+            Characters[i].Speed + 0.5f * lookahead,
+            MAX_PLAYER_SPEED);
+        PeekDisplacements[i] = lookahead * speed + SweepDistance;
+        for (auto j = 0U; j < Characters.size(); j++)
+        {
+            // Staggers culling across each CullingPeriod, except for pairs
+            // that the budget carried over. Both directions of a pair
+            // share a stagger, so that the cuboid stage can check them
+            // together. Not i + j, which has the same parity for every
+            // enemy when teams alternate.
+            const bool Staggered = ((std::min(i, j) + TotalTicks) % CullingPeriod) != 0;
+            const bool Due = !Staggered
+                && VisibilityTimers[i][j] <= CullingPeriod
+                && TotalTicks >= NextCullTicks[i][j];
+            if ((Deferred[i][j] || Due)
+                && IsAlive[j]
+                && !sameTeam(i, j))
+            {
+                // Hidden like a culled pair, so its visibility runs out.
+                if (UsePvs && !Pvs.MayBeVisible(EyeCells[i], EyeCells[j]))
+                {
+                    Deferred[i][j] = false;
+                    LastTickStats.PvsRejects++;
+                    continue;
+                }
+                if (UsePortals
+                    && !Portals.MayBeVisible(
+                        PortalCells[i], PortalCellCounts[i],
+                        PortalCells[j], PortalCellCounts[j]))
+                {
+                    Deferred[i][j] = false;
+                    LastTickStats.PortalRejects++;
+                    continue;
+                }
+                BundleQueue.emplace_back(i, j);
+                // With a time budget, only bundles that get culled need peeks.
+                if (cullBudgetMicroseconds <= 0)
+                {
+                    SetPossiblePeeks(BundleQueue.back());
+                }
+            }
+        }
+    }
+    //std::cout << BundleQueue.size() << "\n";
+}
+
+void CullingController::SetPossiblePeeks(Bundle& B) const
+{
+    const float MaxVerticalDisplacement = 20 + SweepDistance;
+    GetPossiblePeeks(
+        Characters[B.PlayerI].Eye,
+        Characters[B.EnemyI].Eye,
+        PeekDisplacements[B.PlayerI],
+        MaxVerticalDisplacement,
+        B.PossiblePeeks);
+}
+
+// TODO:
+//   Integrate with server latency estimation tools.
+int CullingController::GetLatency(int i)
+{
+    return 200;
+}
+
+void CullingController::GetPossiblePeeks(
+    const vec3& PlayerCameraLocation,
+    const vec3& EnemyLocation,
+    float MaxDeltaHorizontal,
+    float MaxDeltaVertical,
+    vec3 (&Corners)[NUM_PEEKS])
+{
+    vec3 PlayerToEnemy = glm::normalize(EnemyLocation - PlayerCameraLocation);
+    // Displacement parallel to the XY plane and perpendicular to PlayerToEnemy.
+    vec3 Horizontal =
+        MaxDeltaHorizontal * vec3(-PlayerToEnemy.y, PlayerToEnemy.x, 0);
+    vec3 Vertical = vec3(0, 0, MaxDeltaVertical);
+    Corners[0] = PlayerCameraLocation + Horizontal + Vertical;
+    Corners[1] = PlayerCameraLocation - Horizontal + Vertical;
+    Corners[2] = PlayerCameraLocation - Horizontal - Vertical;
+    Corners[3] = PlayerCameraLocation + Horizontal - Vertical;
+}
+
+void CullingController::CullWithCache()
+{
+    Outcomes.resize(BundleQueue.size());
+    ThreadPool.ParallelFor(
+        int(BundleQueue.size()),
+        BUNDLE_GRAIN,
+        [this](int Begin, int End)
+        {
+            for (int b = Begin; b < End; b++)
+            {
+                Outcomes[b] = CheckCache(BundleQueue[b]);
+            }
+        });
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        LastTickStats.BlockingTests += Outcomes[b].BlockingTests;
+        if (Outcomes[b].Blocker != NULL)
+        {
+            ApplyCacheOutcome(BundleQueue[b], Outcomes[b]);
+        }
+    }
+    CompactBundleQueue();
+}
+
+void CullingController::ApplyCacheOutcome(const Bundle& B, const BundleOutcome& Outcome)
+{
+    int Slot = Outcome.CacheSlot;
+    if (Slot < 0)
+    {
+        Slot = CacheBlocker(B, Outcome.Blocker);
+        if (Outcome.Hinted)
+        {
+            RecordHint(B, Outcome.Blocker);
+            LastTickStats.HintHits++;
+        }
+        else
+        {
+            LastTickStats.HotHits++;
+        }
+        if (hotOccluders)
+        {
+            TouchHotOccluder(B.PlayerI, Outcome.Blocker);
+        }
+    }
+    else
+    {
+        CacheTimers[B.PlayerI][B.EnemyI][Slot] = TotalTicks;
+        LastTickStats.CacheHits[Slot]++;
+    }
+    // A reused proof keeps its original positions, so that
+    // movement is always measured from where it was proven.
+    if (Outcome.ReusedProof)
+    {
+        Proofs[B.PlayerI][B.EnemyI].Reuses++;
+        LastTickStats.ProofReuses++;
+    }
+    else if (reuseProofs)
+    {
+        UpdateProof(B, Outcome.Blocker, Slot, Outcome.Margin);
+    }
+    ScheduleNextCull(B, Outcome.Margin);
+}
+
+BundleOutcome CullingController::CheckCache(const Bundle& B) const
+{
+    const float Slack = reuseProofs ? ProofSlack(B) : 0;
+    if (Slack > 0)
+    {
+        const OcclusionProof& Proof = Proofs[B.PlayerI][B.EnemyI];
+        return BundleOutcome { Proof.Blocker, Proof.CacheSlot, 0, 0, Slack, true };
+    }
+    int Tests = 0;
+    for (int k = 0; k < CUBOID_CACHE_SIZE; k++)
+    {
+        const CuboidPlanes* CuboidP = CuboidCaches[B.PlayerI][B.EnemyI][k];
+        // Note: does not check if pointer are valid--deleted cuboids
+        if (CuboidP != NULL)
+        {
+            Tests++;
+            if (
+                IsBlocking(
+                    B.PossiblePeeks,
+                    Characters[B.EnemyI],
+                    CuboidP))
+            {
+                return BundleOutcome { CuboidP, k, 0, Tests, ProofMargin(B, CuboidP), false };
+            }
+        }
+    }
+    const CuboidPlanes* const* Cache = CuboidCaches[B.PlayerI][B.EnemyI];
+    auto InCache = [Cache](const CuboidPlanes* CuboidP)
+    {
+        return std::find(Cache, Cache + CUBOID_CACHE_SIZE, CuboidP) != Cache + CUBOID_CACHE_SIZE;
+    };
+    // Then the player's hot occluders that the pair's cache lacks.
+    for (int h = 0; hotOccluders && h < HOT_OCCLUDER_COUNT; h++)
+    {
+        const CuboidPlanes* CuboidP = HotOccluders[B.PlayerI][h];
+        if (CuboidP != NULL && !InCache(CuboidP))
+        {
+            Tests++;
+            if (
+                IsBlocking(
+                    B.PossiblePeeks,
+                    Characters[B.EnemyI],
+                    CuboidP))
+            {
+                return BundleOutcome {
+                    CuboidP, -1, 0, Tests, ProofMargin(B, CuboidP), false, false };
+            }
+        }
+    }
+    // Then the occluder hinted for the cells of the pair.
+    if (HintsActive)
+    {
+        const int Occluder = Hints.Lookup(
+            OcclusionHints::KeyOf(Characters[B.PlayerI].Eye, Characters[B.EnemyI].Eye));
+        const CuboidPlanes* CuboidP = (Occluder < 0) ? NULL : Map.Planes + Occluder;
+        if (CuboidP != NULL && !InCache(CuboidP))
+        {
+            Tests++;
+            if (
+                IsBlocking(
+                    B.PossiblePeeks,
+                    Characters[B.EnemyI],
+                    CuboidP))
+            {
+                return BundleOutcome {
+                    CuboidP, -1, 0, Tests, ProofMargin(B, CuboidP), false, true };
+            }
+        }
+    }
+    return BundleOutcome { NULL, -1, 0, Tests, 0, false };
+}
 
-    // Add occluding cuboids.
-    for (auto c: FileToCuboids(mapName))
+void CullingController::RecordHint(const Bundle& B, const CuboidPlanes* Blocker)
+{
+    if (HintsActive)
     {
-        Cuboids.emplace_back(c);
+        Hints.Record(
+            OcclusionHints::KeyOf(Characters[B.PlayerI].Eye, Characters[B.EnemyI].Eye),
+            uint32_t(Blocker - Map.Planes));
     }
+}
 
-    // Build the cuboid BVH.
-    if (Cuboids.size() > 0)
+void CullingController::TouchHotOccluder(int i, const CuboidPlanes* Blocker)
+{
+    const CuboidPlanes** Hot = HotOccluders[i];
+    int h = int(std::find(Hot, Hot + HOT_OCCLUDER_COUNT, Blocker) - Hot);
+    if (h == HOT_OCCLUDER_COUNT)
     {
-        FastBVH::BuildStrategy<float, 1> Builder;
-        CuboidBoxConverter Converter;
-        CuboidBVH = std::make_unique
-            <FastBVH::BVH<float, Cuboid>>
-            (Builder(Cuboids, Converter));
-        CuboidTraverser = std::make_unique
-            <Traverser<float, decltype(Intersector)>>
-            (*CuboidBVH.get(), Intersector);
+        h = ArgMin(HotTimers[i], HOT_OCCLUDER_COUNT);
+        Hot[h] = Blocker;
     }
+    HotTimers[i][h] = TotalTicks;
+}
 
-    // TODO: Add occluding spheres, ma
+int CullingController::CacheBlocker(const Bundle& B, const CuboidPlanes* Blocker)
+{
+    int MinI = ArgMin(
+        CacheTimers[B.PlayerI][B.EnemyI],
+        CUBOID_CACHE_SIZE);
+    CuboidCaches[B.PlayerI][B.EnemyI][MinI] = Blocker;
+    CacheTimers[B.PlayerI][B.EnemyI][MinI] = TotalTicks;
+    return MinI;
 }
 
-void CullingController::Tick()
+float CullingController::ProofSlack(const Bundle& B) const
 {
-    TotalTicks++;
-    Cull();
+    const OcclusionProof& Proof = Proofs[B.PlayerI][B.EnemyI];
+    // The cache slot may have been given to another cuboid since.
+    if (
+        Proof.Blocker == NULL
+        || Proof.Margin <= 0
+        || CuboidCaches[B.PlayerI][B.EnemyI][Proof.CacheSlot] != Proof.Blocker)
+    {
+        return 0;
+    }
+    const float MaxDistance2 = Proof.Margin * Proof.Margin;
+    float Moved2 = 0;
+    for (int i = 0; i < NUM_PEEKS; i++)
+    {
+        const vec3 Moved = B.PossiblePeeks[i] - Proof.Peeks[i];
+        Moved2 = std::max(Moved2, glm::dot(Moved, Moved));
+    }
+    const CharacterBounds& Enemy = Characters[B.EnemyI];
+    for (int v = 0; v < CHARACTER_HALF_V; v++)
+    {
+        const vec3 TopMoved = Enemy.TopVertices[v] - Proof.Vertices[v];
+        const vec3 BottomMoved = Enemy.BottomVertices[v] - Proof.Vertices[CHARACTER_HALF_V + v];
+        Moved2 = std::max(
+            Moved2,
+            std::max(glm::dot(TopMoved, TopMoved), glm::dot(BottomMoved, BottomMoved)));
+    }
+    if (Moved2 >= MaxDistance2)
+    {
+        return 0;
+    }
+    return Proof.Margin - std::sqrt(Moved2);
 }
 
-void CullingController::BenchmarkCull()
+float CullingController::ProofMargin(const Bundle& B, const CuboidPlanes* Blocker) const
 {
-    auto Start = std::chrono::high_resolution_clock::now();
-    Cull();
-    auto Stop = std::chrono::high_resolution_clock::now();
-    int Delta = int(std::chrono::duration_cast<std::chrono::microseconds>(Stop - Start).count());
-    TotalTime += Delta;
-    RollingTotalTime += Delta;
-    RollingMaxTime = std::max(RollingMaxTime, Delta);
-    if ((TotalTicks % RollingWindowLength) == 0)
+    if (!reuseProofs || Proofs[B.PlayerI][B.EnemyI].Backoff > 0)
     {
-        RollingAverageTime = RollingTotalTime / RollingWindowLength;
-        std::cout << "Average time to cull (microseconds): " << int(TotalTime / TotalTicks) << "\n";
-        std::cout << "Rolling average time to cull (microseconds): " << RollingAverageTime << "\n";
-        std::cout << "Rolling max time to cull (microseconds): " << RollingMaxTime << "\n";
-        RollingTotalTime = 0;
-        RollingMaxTime = 0;
+        return 0;
     }
+    return BlockingMargin(B.PossiblePeeks, Characters[B.EnemyI], Blocker);
 }
 
-void CullingController::Cull()
+void CullingController::UpdateProof(
+    const Bundle& B,
+    const CuboidPlanes* Blocker,
+    int CacheSlot,
+    float Margin)
 {
-    PopulateBundles();
-    CullWithCache();
-    //CullWithSpheres();
-    CullWithCuboids();
-    UpdateVisibility();
+    OcclusionProof& Proof = Proofs[B.PlayerI][B.EnemyI];
+    if (Proof.Backoff > 0)
+    {
+        // The old proof is left in place, as it is still sound.
+        Proof.Backoff--;
+        return;
+    }
+    if (Proof.Blocker != NULL && Proof.Reuses == 0)
+    {
+        Proof.Penalty = std::min(2 * Proof.Penalty + 1, MAX_PROOF_BACKOFF);
+        Proof.Backoff = Proof.Penalty;
+    }
+    else
+    {
+        Proof.Penalty = 0;
+    }
+    Proof.Blocker = Blocker;
+    Proof.CacheSlot = CacheSlot;
+    Proof.Margin = Margin;
+    Proof.Reuses = 0;
+    std::copy(B.PossiblePeeks, B.PossiblePeeks + NUM_PEEKS, Proof.Peeks);
+    const CharacterBounds& Enemy = Characters[B.EnemyI];
+    std::copy(Enemy.TopVertices, Enemy.TopVertices + CHARACTER_HALF_V, Proof.Vertices);
+    std::copy(
+        Enemy.BottomVertices,
+        Enemy.BottomVertices + CHARACTER_HALF_V,
+        Proof.Vertices + CHARACTER_HALF_V);
 }
 
-void CullingController::PopulateBundles()
+void CullingController::CullWithSpheres()
 {
-    BundleQueue.clear();
-    for (auto i = 0U; i < Characters.size(); i++)
+    auto Kept = 0U;
+    for (auto b = 0U; b < BundleQueue.size(); b++)
     {
-        // Staggers culling across each CullingPeriod
-        if (!IsAlive[i] || (((i + TotalTicks) % CullingPeriod) != 0))
+        const Bundle& B = BundleQueue[b];
+        bool Blocked = false;
+        for (const Sphere& S : Spheres)
         {
-            continue;
+            if (
+                IsBlocking(
+                    B.PossiblePeeks,
+                    Characters[B.EnemyI],
+                    S))
+            {
+                Blocked = true;
+                break;
+            }
         }
-        // Amount of lookahead to account for latency (milliseconds).
-        const int lookahead = std::min(GetLatency(i), maxLookahead);
-        // Maximum player speed in units/millisecond.
-        float speed = 0.001f * std::min(
-            Characters[i].Speed + 0.5f * lookahead,
-            MAX_PLAYER_SPEED);
-        float MaxHorizontalDisplacement = lookahead * speed;
-        float MaxVerticalDisplacement = 20;
-        for (auto j = 0U; j < Characters.size(); j++)
+        if (!Blocked)
         {
-            if (VisibilityTimers[i][j] <= CullingPeriod
-                && IsAlive[j]
-                && !sameTeam(i, j))
+            BundleQueue[Kept++] = B;
+        }
+    }
+    BundleQueue.resize(Kept);
+}
+
+void CullingController::CullWithCuboids()
+{
+    if (Map.OccluderCount == 0)
+    {
+        return;
+    }
+    // Pair up bundles with their reverse, so that each pair queued in
+    // both directions traverses the BVH once.
+    FindReverseBundles();
+    Outcomes.resize(BundleQueue.size());
+    ThreadPool.ParallelFor(
+        int(BundleQueue.size()),
+        BUNDLE_GRAIN,
+        [this](int Begin, int End)
+        {
+            for (int b = Begin; b < End; b++)
             {
-                BundleQueue.emplace_back(
-                    Bundle(
-                        i,
-                        j,
-                        GetPossiblePeeks(
-                            Characters[i].Eye,
-                            Characters[j].Eye,
-                            MaxHorizontalDisplacement,
-                            MaxVerticalDisplacement)));
+                const int r = ReverseBundles[b];
+                if (r < 0)
+                {
+                    Outcomes[b] = CheckCuboids(BundleQueue[b]);
+                }
+                // The first of the two bundles checks both.
+                else if (b < r)
+                {
+                    CheckCuboidPair(BundleQueue[b], BundleQueue[r], Outcomes[b], Outcomes[r]);
+                }
             }
+        });
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        LastTickStats.NodesVisited += Outcomes[b].NodesVisited;
+        LastTickStats.BlockingTests += Outcomes[b].BlockingTests;
+        if (Outcomes[b].Blocker != NULL)
+        {
+            ApplyCuboidOutcome(BundleQueue[b], Outcomes[b]);
         }
     }
-    //std::cout << BundleQueue.size() << "\n";
+    CompactBundleQueue();
 }
 
-// TODO:
-//   Integrate with server latency estimation tools.
-int CullingController::GetLatency(int i)
+void CullingController::FindReverseBundles()
 {
-    return 200;
+    ReverseBundles.resize(BundleQueue.size());
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        QueueIndices[BundleQueue[b].PlayerI][BundleQueue[b].EnemyI] = int(b);
+    }
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        const Bundle& B = BundleQueue[b];
+        const int r = QueueIndices[B.EnemyI][B.PlayerI];
+        ReverseBundles[b] =
+            (r < int(BundleQueue.size())
+             && BundleQueue[r].PlayerI == B.EnemyI
+             && BundleQueue[r].EnemyI == B.PlayerI)
+            ? r
+            : -1;
+    }
 }
 
-std::vector<vec3> CullingController::GetPossiblePeeks(
-    const vec3& PlayerCameraLocation,
-    const vec3& EnemyLocation,
-    float MaxDeltaHorizontal,
-    float MaxDeltaVertical)
+void CullingController::ApplyCuboidOutcome(const Bundle& B, const BundleOutcome& Outcome)
 {
-    std::vector<vec3> Corners;
-    vec3 PlayerToEnemy = glm::normalize(EnemyLocation - PlayerCameraLocation);
-    // Displacement parallel to the XY plane and perpendicular to PlayerToEnemy.
-    vec3 Horizontal =
-        MaxDeltaHorizontal * vec3(-PlayerToEnemy.y, PlayerToEnemy.x, 0);
-    vec3 Vertical = vec3(0, 0, MaxDeltaVertical);
-    Corners.emplace_back(PlayerCameraLocation + Horizontal + Vertical);
-    Corners.emplace_back(PlayerCameraLocation - Horizontal + Vertical);
-    Corners.emplace_back(PlayerCameraLocation - Horizontal - Vertical);
-    Corners.emplace_back(PlayerCameraLocation + Horizontal - Vertical);
-    return Corners;
+    const int MinI = CacheBlocker(B, Outcome.Blocker);
+    RecordHint(B, Outcome.Blocker);
+    if (hotOccluders)
+    {
+        TouchHotOccluder(B.PlayerI, Outcome.Blocker);
+    }
+    if (reuseProofs)
+    {
+        UpdateProof(B, Outcome.Blocker, MinI, Outcome.Margin);
+    }
+    ScheduleNextCull(B, Outcome.Margin);
 }
 
-void CullingController::CullWithCache()
+void CullingController::CullWithRaster()
 {
-    std::vector<Bundle> Remaining;
-    for (Bundle B : BundleQueue)
+    if (Map.OccluderCount == 0)
     {
-        bool Blocked = false;
-        for (int k = 0; k < CUBOID_CACHE_SIZE; k++)
+        return;
+    }
+    RebuildRasters(BundleQueue);
+    RasterOccluded.resize(BundleQueue.size());
+    ThreadPool.ParallelFor(
+        int(BundleQueue.size()),
+        BUNDLE_GRAIN,
+        [this](int Begin, int End)
         {
-        // Note: does not check if pointer are valid--deleted cuboids
-            if (CuboidCaches[B.PlayerI][B.EnemyI][k] != NULL)
+            for (int b = Begin; b < End; b++)
             {
-                if (
-                    IsBlocking(
-                        B.PossiblePeeks,
-                        Characters[B.EnemyI],
-                        CuboidCaches[B.PlayerI][B.EnemyI][k]))
-                {
-                    Blocked = true;
-                    CacheTimers[B.PlayerI][B.EnemyI][k] = TotalTicks;
-                    break;
-                }
+                RasterOccluded[b] = IsRasterOccluded(BundleQueue[b]);
             }
-        }
-        if (!Blocked)
+        });
+    auto Kept = 0U;
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        if (!RasterOccluded[b])
         {
-            Remaining.emplace_back(B);
+            BundleQueue[Kept++] = BundleQueue[b];
         }
     }
-    BundleQueue = Remaining;
+    BundleQueue.resize(Kept);
 }
 
-void CullingController::CullWithSpheres()
+void CullingController::RebuildRasters(const std::vector<Bundle>& Bundles)
 {
-    std::vector<Bundle> Remaining;
-    for (Bundle B : BundleQueue)
+    if (Map.OccluderCount == 0)
     {
-        bool Blocked = false;
-        for (Sphere S : Spheres)
+        return;
+    }
+    // Cubes are built to cover players moving for a period, so that each
+    // player's cube is rebuilt about once per period, and not at all
+    // while they hold still.
+    const float Slack = MAX_PLAYER_SPEED * CullingPeriod / std::max(1, tickRate);
+    const float VerticalPeek = 20 + SweepDistance;
+    // Depth along each face's axis of the farthest living enemy from
+    // each player's eye, as only occluders nearer than that can hide
+    // enemies. Measured over every enemy rather than the bundles queued,
+    // so that the cube lasts while the enemies queued vary between ticks.
+    float Extents[MAX_CHARACTERS + 1][RASTER_FACES];
+    bool Listed[MAX_CHARACTERS + 1] = {false};
+    RasterViewers.clear();
+    for (const Bundle& B : Bundles)
+    {
+        const int i = B.PlayerI;
+        if (Listed[i])
         {
-            if (
-                IsBlocking(
-                    B.PossiblePeeks,
-                    Characters[B.EnemyI],
-                    S))
+            continue;
+        }
+        Listed[i] = true;
+        const vec3& Eye = Characters[i].Eye;
+        vec3 Farthest = vec3(-std::numeric_limits<float>::infinity());
+        vec3 Nearest = -Farthest;
+        for (auto j = 0U; j < Characters.size(); j++)
+        {
+            if (!IsAlive[j] || sameTeam(i, j))
             {
-                Blocked = true;
-                break;
+                continue;
+            }
+            for (int v = 0; v < CHARACTER_HALF_V; v++)
+            {
+                Farthest = glm::max(Farthest, Characters[j].TopVertices[v]);
+                Farthest = glm::max(Farthest, Characters[j].BottomVertices[v]);
+                Nearest = glm::min(Nearest, Characters[j].TopVertices[v]);
+                Nearest = glm::min(Nearest, Characters[j].BottomVertices[v]);
             }
         }
-        if (!Blocked)
+        for (int f = 0; f < RASTER_FACES; f++)
+        {
+            Extents[i][f] = (f & 1) ? Eye[f / 2] - Nearest[f / 2] : Farthest[f / 2] - Eye[f / 2];
+        }
+        const float Reach = glm::length(glm::vec2(PeekDisplacements[i], VerticalPeek));
+        if (!Rasters[i].Covers(Eye, Reach, Extents[i]))
         {
-            Remaining.emplace_back(B);
+            RasterViewers.push_back(i);
         }
     }
-    BundleQueue = Remaining;
+    ThreadPool.ParallelFor(
+        int(RasterViewers.size()),
+        1,
+        [this, Slack, VerticalPeek, &Extents](int Begin, int End)
+        {
+            for (int v = Begin; v < End; v++)
+            {
+                const int i = RasterViewers[v];
+                const float Radius =
+                    glm::length(glm::vec2(PeekDisplacements[i], VerticalPeek)) + Slack;
+                // Leaves enemies as much room to move as the viewer before
+                // the cube needs rebuilding.
+                float Ranges[RASTER_FACES];
+                for (int f = 0; f < RASTER_FACES; f++)
+                {
+                    Ranges[f] = Extents[i][f] + 2 * Radius;
+                }
+                Rasters[i].Build(
+                    Characters[i].Eye,
+                    Radius,
+                    Ranges,
+                    Map.Planes,
+                    Map.Bounds,
+                    Map.OccluderCount);
+            }
+        });
+    LastTickStats.RasterBuilds += int(RasterViewers.size());
 }
 
-void CullingController::CullWithCuboids()
+bool CullingController::IsRasterOccluded(const Bundle& B) const
+{
+    const CharacterBounds& Enemy = Characters[B.EnemyI];
+    vec3 Vertices[2 * CHARACTER_HALF_V];
+    std::copy(Enemy.TopVertices, Enemy.TopVertices + CHARACTER_HALF_V, Vertices);
+    std::copy(
+        Enemy.BottomVertices,
+        Enemy.BottomVertices + CHARACTER_HALF_V,
+        Vertices + CHARACTER_HALF_V);
+    return Rasters[B.PlayerI].IsOccluded(Vertices, 2 * CHARACTER_HALF_V);
+}
+
+void CullingController::ScheduleNextCull(const Bundle& B, float Margin)
 {
-    if (Cuboids.size() == 0)
+    const int MaxTicks = maxCullInterval * tickRate / 1000;
+    if (MaxTicks <= CullingPeriod || Margin <= 0)
     {
         return;
     }
-    std::vector<Bundle> Remaining;
-    for (Bundle B : BundleQueue)
+    // The enemy's vertices move no further than the characters, but peeks
+    // also stretch as the player's peek displacement changes, and turn
+    // with the line between the players. A unit vector moves by at most
+    // twice its vector's movement over the vector's length.
+    const float Distance = glm::length(Characters[B.PlayerI].Eye - Characters[B.EnemyI].Eye);
+    const float MaxDisplacement = MAX_PLAYER_SPEED * maxLookahead / 1000 + SweepDistance;
+    const float Displacement = PeekDisplacements[B.PlayerI];
+    const float Stretch = std::max(MaxDisplacement - Displacement, Displacement - SweepDistance);
+    // Stay on the pair's stagger, and count the tick that asynchronous
+    // results are used late.
+    int Interval = MaxTicks - MaxTicks % CullingPeriod;
+    for (; Interval > CullingPeriod; Interval -= CullingPeriod)
     {
-        // Traverse the BVH to search for a cuboid that intersects the bundle.
-        const Cuboid* CuboidP = CuboidTraverser.get()->traverse(
-            OptSegment(
-                Characters[B.PlayerI].Eye,
-                Characters[B.EnemyI].Eye),
-            B.PossiblePeeks,
-            Characters[B.EnemyI]);
-        if (CuboidP != NULL)
+        const float Moved =
+            MAX_PLAYER_SPEED * (Interval + (asyncCulling ? 1 : 0)) / std::max(1, tickRate);
+        const float PeekMoved = Moved + Stretch + MaxDisplacement * 4 * Moved / Distance;
+        if (PeekMoved < Margin)
         {
-            int MinI = ArgMin(
-                CacheTimers[B.PlayerI][B.EnemyI],
-                CUBOID_CACHE_SIZE);
-            CuboidCaches[B.PlayerI][B.EnemyI][MinI] = CuboidP;
-            CacheTimers[B.PlayerI][B.EnemyI][MinI] = TotalTicks;
+            break;
         }
-        else
+    }
+    NextCullTicks[B.PlayerI][B.EnemyI] = TotalTicks + Interval;
+}
+
+void CullingController::CompactBundleQueue()
+{
+    auto Kept = 0U;
+    for (auto b = 0U; b < BundleQueue.size(); b++)
+    {
+        if (Outcomes[b].Blocker == NULL)
+        {
+            BundleQueue[Kept++] = BundleQueue[b];
+        }
+    }
+    BundleQueue.resize(Kept);
+}
+
+BundleOutcome CullingController::CheckCuboids(const Bundle& B) const
+{
+    // Traverse the BVH to search for a cuboid that intersects the bundle.
+    // The traverser is read-only, so workers can share it.
+    FastBVH::TraversalStats Stats;
+    const CuboidPlanes* CuboidP = CuboidTraverser->traverse(
+        OptSegment(
+            Characters[B.PlayerI].Eye,
+            Characters[B.EnemyI].Eye),
+        B.PossiblePeeks,
+        Characters[B.EnemyI],
+        Stats);
+    const float Margin = (CuboidP == NULL) ? 0 : ProofMargin(B, CuboidP);
+    return BundleOutcome {
+        CuboidP, -1, int(Stats.nodes), int(Stats.blocking_tests), Margin, false };
+}
+
+void CullingController::CheckCuboidPair(
+    const Bundle& B,
+    const Bundle& Reverse,
+    BundleOutcome& Outcome,
+    BundleOutcome& ReverseOutcome) const
+{
+    // Each direction keeps its own intersection test, as a cuboid around
+    // one end of the segment blocks only the other end's view.
+    const OptSegment Segments[2] = {
+        OptSegment(Characters[B.PlayerI].Eye, Characters[B.EnemyI].Eye),
+        OptSegment(Characters[B.EnemyI].Eye, Characters[B.PlayerI].Eye) };
+    const Bundle* Bundles[2] = { &B, &Reverse };
+    const CuboidPlanes* Blockers[2] = { NULL, NULL };
+    int Tests[2] = { 0, 0 };
+    // Collects the candidates once, nearest to B's player first, so that
+    // each direction can walk them from its own player's end.
+    const CuboidPlanes* Candidates[MAX_PAIR_CANDIDATES];
+    int CandidateCount = 0;
+    FastBVH::TraversalStats Stats;
+    const bool Overflowed = CuboidTraverser->forEachCandidate(
+        Segments[0],
+        [&](const CuboidPlanes& C)
+        {
+            if (CandidateCount == MAX_PAIR_CANDIDATES)
+            {
+                return true;
+            }
+            Candidates[CandidateCount++] = &C;
+            return false;
+        },
+        Stats);
+    if (Overflowed)
+    {
+        Outcome = CheckCuboids(B);
+        Outcome.NodesVisited += int(Stats.nodes);
+        ReverseOutcome = CheckCuboids(Reverse);
+        return;
+    }
+    const auto& Intersect = CuboidTraverser->getIntersector();
+    auto Blocks = [&](int d, const CuboidPlanes* C)
+    {
+        if (!Intersect(*C, Segments[d]))
+        {
+            return false;
+        }
+        Tests[d]++;
+        const Bundle& D = *Bundles[d];
+        return IsBlocking(D.PossiblePeeks, Characters[D.EnemyI], C);
+    };
+    // The candidates are in the order that CheckCuboids(B) visits them.
+    for (int k = 0; k < CandidateCount && Blockers[0] == NULL; k++)
+    {
+        if (Blocks(0, Candidates[k]))
+        {
+            Blockers[0] = Candidates[k];
+        }
+    }
+    // Reversed, they are only roughly in the order that CheckCuboids(Reverse)
+    // visits them, so a second blocker leaves the choice to it, to cache
+    // the same blocker.
+    bool Ambiguous = false;
+    for (int k = CandidateCount - 1; k >= 0 && !Ambiguous; k--)
+    {
+        if (Blocks(1, Candidates[k]))
         {
-            Remaining.emplace_back(B);
+            Ambiguous = Blockers[1] != NULL;
+            Blockers[1] = Candidates[k];
         }
     }
-    BundleQueue = Remaining;
+    if (Ambiguous)
+    {
+        ReverseOutcome = CheckCuboids(Reverse);
+        ReverseOutcome.BlockingTests += Tests[1];
+    }
+    else
+    {
+        ReverseOutcome = BundleOutcome {
+            Blockers[1], -1, 0, Tests[1],
+            (Blockers[1] == NULL) ? 0 : ProofMargin(Reverse, Blockers[1]), false };
+    }
+    // Nodes are counted once, against the first bundle.
+    Outcome = BundleOutcome {
+        Blockers[0], -1, int(Stats.nodes), Tests[0],
+        (Blockers[0] == NULL) ? 0 : ProofMargin(B, Blockers[0]), false };
 }
 
 // Increments visibility timers of bundles that were not culled,
@@ -231,9 +1432,10 @@ void CullingController::UpdateVisibility()
 {
     // There are bundles remaining from the culling pipeline.
     // They represent unblocked sightlines to enemies that should be revealed.
-    for (Bundle B : BundleQueue)
+    for (const Bundle& B : BundleQueue)
     {
         VisibilityTimers[B.PlayerI][B.EnemyI] = VisibilityTimerMax;
+        LastRevealed[B.PlayerI][B.EnemyI] = TotalTicks;
     }
     BundleQueue.clear();
     // Reveal
@@ -254,13 +1456,29 @@ void CullingController::UpdateVisibility()
 
 bool CullingController::IsVisible(int i, int j)
 {
+    if (AsyncThread.joinable())
+    {
+        // Characters belongs to the culling thread, so check teams
+        // against the latest inputs instead.
+        if (i < 0 || j < 0 || i > MAX_CHARACTERS || j > MAX_CHARACTERS)
+        {
+            return false;
+        }
+        // Results are normally a tick old. Older ones may hide enemies who
+        // have come into view since, so reveal everyone until culling
+        // catches up.
+        const VisibilityFrame& Frame = AsyncResults.ReadBuffer();
+        return AsyncTeams[i] == AsyncTeams[j]
+            || AsyncGameTicks - Frame.Tick > 1
+            || Frame.Visible[i][j];
+    }
     if (sameTeam(i, j))
     {
         return true;
     }
     else
     {
-        return VisibilityTimers[i][j] > 0;
+        return VisibilityTimers[i][j] > 0 || Deferred[i][j];
     }
 }
 
@@ -283,6 +1501,38 @@ void CullingController::UpdateCharacters(
     float* Yaws,
     float* Pitches,
     float* Speeds)
+{
+    if (!AsyncThread.joinable())
+    {
+        SetCharacters(Teams, EyesFlat, BasesFlat, Yaws, Pitches, Speeds);
+        return;
+    }
+    // Stage the inputs for Tick to publish. Building the bounds is left
+    // to the culling thread.
+    TickInputs& Inputs = AsyncInputs.WriteBuffer();
+    std::copy(Teams, Teams + MAX_CHARACTERS + 1, Inputs.Teams);
+    std::copy(EyesFlat, EyesFlat + (MAX_CHARACTERS + 1) * 3, Inputs.Eyes);
+    std::copy(BasesFlat, BasesFlat + (MAX_CHARACTERS + 1) * 3, Inputs.Bases);
+    std::copy(Yaws, Yaws + MAX_CHARACTERS + 1, Inputs.Yaws);
+    std::copy(Pitches, Pitches + MAX_CHARACTERS + 1, Inputs.Pitches);
+    std::copy(Speeds, Speeds + MAX_CHARACTERS + 1, Inputs.Speeds);
+    for (int i = 0; i <= MAX_CHARACTERS; i++)
+    {
+        // Like Characters, keep the last team of dead characters.
+        if (Teams[i] > 1)
+        {
+            AsyncTeams[i] = Teams[i];
+        }
+    }
+}
+
+void CullingController::SetCharacters(
+    const int* Teams,
+    const float* EyesFlat,
+    const float* BasesFlat,
+    const float* Yaws,
+    const float* Pitches,
+    const float* Speeds)
 {
     for (auto i = 0U; i < Characters.size(); i++)
     {
@@ -296,6 +1546,235 @@ void CullingController::UpdateCharacters(
                 Yaws[i],
                 Pitches[i],
                 Speeds[i]);
+            if (SweepDistance > 0)
+            {
+                Characters[i].Sweep(SweepDistance);
+            }
         }
     }
 }
+
+void CullingMetrics::RecordTick(const CullingTickStats& Stats)
+{
+    long long Total = 0;
+    for (int s = 0; s < NUM_CULLING_STAGES; s++)
+    {
+        StageTimes[s].Record(uint64_t(Stats.StageNanoseconds[s]));
+        Total += Stats.StageNanoseconds[s];
+    }
+    TickTimes.Record(uint64_t(Total));
+    Ticks.fetch_add(1, std::memory_order_relaxed);
+    BundlesQueued.fetch_add(Stats.BundlesQueued, std::memory_order_relaxed);
+    for (int k = 0; k < CUBOID_CACHE_SIZE; k++)
+    {
+        CacheHits[k].fetch_add(Stats.CacheHits[k], std::memory_order_relaxed);
+    }
+    BundlesCulledByCuboids.fetch_add(Stats.BundlesCulledByCuboids, std::memory_order_relaxed);
+    NodesVisited.fetch_add(Stats.NodesVisited, std::memory_order_relaxed);
+    BlockingTests.fetch_add(Stats.BlockingTests, std::memory_order_relaxed);
+    Reveals.fetch_add(Stats.BundlesRevealed, std::memory_order_relaxed);
+    BundlesDeferred.fetch_add(Stats.BundlesDeferred, std::memory_order_relaxed);
+    ProofReuses.fetch_add(Stats.ProofReuses, std::memory_order_relaxed);
+    HintHits.fetch_add(Stats.HintHits, std::memory_order_relaxed);
+    PvsRejects.fetch_add(Stats.PvsRejects, std::memory_order_relaxed);
+    PortalRejects.fetch_add(Stats.PortalRejects, std::memory_order_relaxed);
+    RasterBuilds.fetch_add(Stats.RasterBuilds, std::memory_order_relaxed);
+    SkippedTicks.fetch_add(Stats.SkippedTicks, std::memory_order_relaxed);
+    HotHits.fetch_add(Stats.HotHits, std::memory_order_relaxed);
+}
+
+void CullingMetrics::Reset()
+{
+    TickTimes.Reset();
+    for (auto& Stage : StageTimes)
+    {
+        Stage.Reset();
+    }
+    Ticks.store(0);
+    BundlesQueued.store(0);
+    for (auto& Hits : CacheHits)
+    {
+        Hits.store(0);
+    }
+    BundlesCulledByCuboids.store(0);
+    NodesVisited.store(0);
+    BlockingTests.store(0);
+    Reveals.store(0);
+    BundlesDeferred.store(0);
+    ProofReuses.store(0);
+    HintHits.store(0);
+    PvsRejects.store(0);
+    PortalRejects.store(0);
+    RasterBuilds.store(0);
+    SkippedTicks.store(0);
+    HotHits.store(0);
+}
+
+int CullingMetrics::Snapshot(float* Stats, int Count) const
+{
+    float Values[NUM_CULLING_STATS];
+    const LatencyHistogram* Histograms[NUM_CULLING_STAGES + 1] =
+        { &TickTimes, &StageTimes[0], &StageTimes[1], &StageTimes[2], &StageTimes[3] };
+    const double N = double(std::max(1LL, Ticks.load()));
+    const double Queued = double(std::max(1LL, BundlesQueued.load()));
+
+    Values[STAT_TICKS] = float(Ticks.load());
+    for (int h = 0; h <= NUM_CULLING_STAGES; h++)
+    {
+        const LatencyHistogram& H = *Histograms[h];
+        float* Times = &Values[STAT_TIMES + h * STAT_TIME_VALUES];
+        Times[0] = float(H.Mean() / 1000);
+        Times[1] = float(H.Percentile(50) / 1000.0);
+        Times[2] = float(H.Percentile(99) / 1000.0);
+        Times[3] = float(H.Percentile(99.9) / 1000.0);
+        Times[4] = float(H.Max() / 1000.0);
+    }
+    Values[STAT_BUNDLES_PER_TICK] = float(BundlesQueued.load() / N);
+    long long Hits = HotHits.load() + HintHits.load();
+    for (int k = 0; k < CUBOID_CACHE_SIZE; k++)
+    {
+        Hits += CacheHits[k].load();
+        Values[STAT_SLOT_HIT_RATES + k] = float(100 * CacheHits[k].load() / Queued);
+    }
+    Values[STAT_CACHE_HIT_RATE] = float(100 * Hits / Queued);
+    Values[STAT_CUBOID_CULL_RATE] = float(100 * BundlesCulledByCuboids.load() / Queued);
+    Values[STAT_REVEAL_RATE] = float(100 * Reveals.load() / Queued);
+    Values[STAT_NODES_PER_TICK] = float(NodesVisited.load() / N);
+    Values[STAT_BLOCKING_TESTS_PER_TICK] = float(BlockingTests.load() / N);
+    Values[STAT_REVEALS_PER_TICK] = float(Reveals.load() / N);
+    Values[STAT_DEFER_RATE] = float(100 * BundlesDeferred.load() / Queued);
+    Values[STAT_PROOF_REUSE_RATE] = float(100 * ProofReuses.load() / Queued);
+    Values[STAT_HINT_HIT_RATE] = float(100 * HintHits.load() / Queued);
+    Values[STAT_PVS_REJECTS_PER_TICK] = float(PvsRejects.load() / N);
+    Values[STAT_PORTAL_REJECTS_PER_TICK] = float(PortalRejects.load() / N);
+    Values[STAT_RASTER_BUILDS_PER_TICK] = float(RasterBuilds.load() / N);
+    Values[STAT_SKIPPED_TICKS_PER_TICK] = float(SkippedTicks.load() / N);
+    Values[STAT_HOT_HIT_RATE] = float(100 * HotHits.load() / Queued);
+
+    Count = std::max(0, std::min(Count, int(NUM_CULLING_STATS)));
+    std::copy(Values, Values + Count, Stats);
+    return Count;
+}
+
+void CullingMetrics::Format(char* Buffer, size_t Size) const
+{
+    if (Size == 0)
+    {
+        return;
+    }
+    float Stats[NUM_CULLING_STATS];
+    Snapshot(Stats, NUM_CULLING_STATS);
+    const char* Names[NUM_CULLING_STAGES + 1] = { "tick", "populate", "cache", "cuboids", "visibility" };
+    size_t Used = 0;
+    auto Append = [&](const char* Format, auto... Args)
+    {
+        if (Used < Size)
+        {
+            int Written = snprintf(Buffer + Used, Size - Used, Format, Args...);
+            Used += Written > 0 ? size_t(Written) : 0;
+        }
+    };
+
+    Append("Culling: %lld ticks (us: mean p50 p99 p99.9 max)\n", Ticks.load());
+    for (int h = 0; h <= NUM_CULLING_STAGES; h++)
+    {
+        const float* Times = &Stats[STAT_TIMES + h * STAT_TIME_VALUES];
+        Append(
+            "  %-10s %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+            Names[h], Times[0], Times[1], Times[2], Times[3], Times[4]);
+    }
+    Append(
+        "  bundles/tick %.1f, cache hit rate %.1f%% "
+        "(%.1f%% by reused proofs; hot %.1f%%, hints %.1f%%, ",
+        Stats[STAT_BUNDLES_PER_TICK],
+        Stats[STAT_CACHE_HIT_RATE],
+        Stats[STAT_PROOF_REUSE_RATE],
+        Stats[STAT_HOT_HIT_RATE],
+        Stats[STAT_HINT_HIT_RATE]);
+    for (int k = 0; k < CUBOID_CACHE_SIZE; k++)
+    {
+        Append(k == 0 ? "slot %d %.1f%%" : ", slot %d %.1f%%", k, Stats[STAT_SLOT_HIT_RATES + k]);
+    }
+    Append(
+        "), culled by cuboids %.1f%%, revealed %.1f%%, deferred %.1f%%\n",
+        Stats[STAT_CUBOID_CULL_RATE],
+        Stats[STAT_REVEAL_RATE],
+        Stats[STAT_DEFER_RATE]);
+    Append(
+        "  per tick: %.1f BVH nodes, %.1f IsBlocking calls, %.1f reveals, "
+        "%.1f PVS rejects, %.1f portal rejects, %.1f raster builds, "
+        "%.2f skipped ticks\n",
+        Stats[STAT_NODES_PER_TICK],
+        Stats[STAT_BLOCKING_TESTS_PER_TICK],
+        Stats[STAT_REVEALS_PER_TICK],
+        Stats[STAT_PVS_REJECTS_PER_TICK],
+        Stats[STAT_PORTAL_REJECTS_PER_TICK],
+        Stats[STAT_RASTER_BUILDS_PER_TICK],
+        Stats[STAT_SKIPPED_TICKS_PER_TICK]);
+    Buffer[std::min(Used, Size - 1)] = '\0';
+}
+
+#ifdef CULLING_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<long long> AllocationCount{0};
+
+long long CountAllocations()
+{
+    return AllocationCount.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t Size)
+{
+    AllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* P = std::malloc(Size ? Size : 1);
+    if (P == NULL)
+    {
+        std::abort();
+    }
+    return P;
+}
+
+void* operator new[](std::size_t Size)
+{
+    return operator new(Size);
+}
+
+// Where GCC inlines this into code that deletes what new returned, it warns
+// that free does not pair with new, not seeing that new used malloc.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* P) noexcept
+{
+    std::free(P);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+// The other forms go through the replaced operator delete, so that every
+// pointer from the replaced operator new is freed by its pair.
+void operator delete[](void* P) noexcept
+{
+    operator delete(P);
+}
+
+void operator delete(void* P, std::size_t) noexcept
+{
+    operator delete(P);
+}
+
+void operator delete[](void* P, std::size_t) noexcept
+{
+    operator delete(P);
+}
+#else
+long long CountAllocations()
+{
+    return 0;
+}
+#endif
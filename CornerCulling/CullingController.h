@@ -5,6 +5,20 @@
 #pragma once
 #include "GeometricPrimitives.h"
 #include "FastBVH.h"
+#include "CullingThreadPool.h"
+#include "CompiledMap.h"
+#include "MappedFile.h"
+#include "OcclusionHints.h"
+#include "PotentiallyVisibleSet.h"
+#include "PortalGraph.h"
+#include "OcclusionRaster.h"
+#include "LatencyHistogram.h"
+#include "TripleBuffer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <glm/vec3.hpp>
@@ -12,74 +26,524 @@ using glm::vec3;
 
 // Maximum speed of a player in units/second.
 constexpr float MAX_PLAYER_SPEED = 250;
-// Number of peeks in each Bundle.
-constexpr int NUM_PEEKS = 4;
 // Maximum number of characters in a game.
 // Must equal 65 to align with SourceMod plugin.
 constexpr int MAX_CHARACTERS = 65;
+// Ticks between culls of each pair by default, and the longest period
+// that does not need sweptHulls.
+constexpr int DEFAULT_CULLING_PERIOD = 2;
 // Number of cuboids in each entry of the cuboid cache array.
 constexpr int CUBOID_CACHE_SIZE = 3;
+// Number of occluders in each player's cache of occluders that recently
+// blocked them from any enemy.
+constexpr int HOT_OCCLUDER_COUNT = 4;
+// Branching factor of the collapsed cuboid BVH that culling traverses.
+// 4 uses SSE slab tests, 8 uses AVX.
+constexpr int BVH_WIDTH = 8;
+// Number of bundles each worker thread claims at a time.
+constexpr int BUNDLE_GRAIN = 16;
+// Most BVH candidates that a pair's shared traversal collects before
+// falling back to a traversal per direction.
+constexpr int MAX_PAIR_CANDIDATES = 64;
+// Number of bundles culled between checks of the tick's time budget.
+constexpr int BUDGET_BATCH = 64;
+// Number of priorities that the time budget orders bundles by.
+// Hidden pairs not revealed for longer share the lowest priority.
+constexpr int NUM_BUNDLE_PRIORITIES = 256;
+// Most blocked culls that a pair skips making occlusion proofs for
+// after its proofs stop being reused.
+constexpr int MAX_PROOF_BACKOFF = 8;
+
+// Result of culling a single bundle in a culling stage.
+// Stages compute outcomes in parallel, then apply them to the caches
+// serially and in queue order, so results do not depend on thread count.
+struct BundleOutcome
+{
+    // Cuboid that blocks the bundle, or NULL if the bundle is still visible.
+    const CuboidPlanes* Blocker;
+    // Index of the cache entry that blocked the bundle, or -1 if the
+    // blocker was found in the player's hot occluders, the occlusion
+    // hints or the BVH.
+    int CacheSlot;
+    // Inner BVH nodes tested while searching for the blocker.
+    int NodesVisited;
+    // Occluders given to IsBlocking while searching for the blocker.
+    int BlockingTests;
+    // How far the bundle may move before the blocker must be tested again,
+    // or zero if no proof was made.
+    float Margin;
+    // Whether the blocker was found by reusing the pair's OcclusionProof.
+    bool ReusedProof;
+    // Whether the blocker was hinted for the cells of the pair.
+    bool Hinted;
+};
+
+// Where a cuboid was last found to block a pair, so that the pair can
+// skip testing it again until its peeks or enemy vertices move further
+// than Margin from where they were.
+struct OcclusionProof
+{
+    // Blocking cuboid, or NULL if the pair has no proof.
+    const CuboidPlanes* Blocker = NULL;
+    // Slot of the pair's cuboid cache that holds Blocker.
+    int CacheSlot = 0;
+    float Margin = 0;
+    // Times the proof has been reused.
+    int Reuses = 0;
+    // Proofs are costlier to make than a cache test, so a pair whose proofs
+    // go unused skips making them for Backoff blocked culls, doubling
+    // Penalty, the length of the next backoff, each time.
+    int Backoff = 0;
+    int Penalty = 0;
+    vec3 Peeks[NUM_PEEKS];
+    // Enemy's top vertices, then bottom vertices.
+    vec3 Vertices[2 * CHARACTER_HALF_V];
+};
+
+// Inputs of one CullingController::UpdateCharacters call,
+// laid out like the arrays that the extension passes.
+struct TickInputs
+{
+    int Teams[MAX_CHARACTERS + 1] = {0};
+    float Eyes[(MAX_CHARACTERS + 2) * 3] = {0};
+    float Bases[(MAX_CHARACTERS + 2) * 3] = {0};
+    float Yaws[MAX_CHARACTERS + 1] = {0};
+    float Pitches[MAX_CHARACTERS + 1] = {0};
+    float Speeds[MAX_CHARACTERS + 1] = {0};
+    // Game tick of the inputs, counted from StartAsyncCulling.
+    int Tick = 0;
+};
+
+// Visibility that an asynchronous cull hands back to the game thread.
+// Pair [i][j] is nonzero if player i may see enemy j.
+struct VisibilityFrame
+{
+    uint8_t Visible[MAX_CHARACTERS + 1][MAX_CHARACTERS + 1];
+    // Game tick of the inputs that were culled.
+    int Tick = 0;
+};
+
+// Stages of the culling pipeline, in the order Cull runs them.
+enum CullingStage
+{
+    POPULATE_STAGE,
+    CACHE_STAGE,
+    CUBOID_STAGE,
+    VISIBILITY_STAGE,
+    NUM_CULLING_STAGES
+};
+
+// Ways to find the bundles that occluders block.
+enum CullingEngine
+{
+    // Cached occluders, then a BVH search for one occluder that blocks
+    // each bundle.
+    CULLING_ENGINE_BVH,
+    // A depth cube around each player, which occluders can block enemies
+    // in together. Runs in place of the cache and cuboid stages.
+    CULLING_ENGINE_RASTER,
+    NUM_CULLING_ENGINES
+};
+
+// Work done by the most recent cull, for benchmarks and diagnostics.
+struct CullingTickStats
+{
+    // Wall time spent in each stage, in nanoseconds.
+    long long StageNanoseconds[NUM_CULLING_STAGES] = {0};
+    // Bundles queued by PopulateBundles.
+    int BundlesQueued = 0;
+    // Bundles blocked by a cached occluder.
+    int BundlesCulledByCache = 0;
+    // Bundles blocked by an occluder found in the BVH,
+    // or by the raster engine.
+    int BundlesCulledByCuboids = 0;
+    // Bundles left unblocked, which reveal their enemy.
+    int BundlesRevealed = 0;
+    // Bundles left for a later tick when the time budget ran out.
+    int BundlesDeferred = 0;
+    // Bundles blocked by each slot of the cuboid caches.
+    int CacheHits[CUBOID_CACHE_SIZE] = {0};
+    // Inner BVH nodes tested by the cuboid stage.
+    int NodesVisited = 0;
+    // Calls to IsBlocking across the cache and cuboid stages.
+    int BlockingTests = 0;
+    // Bundles found blocked by reusing an OcclusionProof.
+    int ProofReuses = 0;
+    // Bundles blocked by the occluder hinted for their cells.
+    int HintHits = 0;
+    // Bundles blocked by one of the player's hot occluders.
+    int HotHits = 0;
+    // Pairs not queued as the PVS shows that their cells cannot see each other.
+    int PvsRejects = 0;
+    // Pairs not queued as no portals join the cells they reach.
+    int PortalRejects = 0;
+    // Depth cubes the raster engine rebuilt.
+    int RasterBuilds = 0;
+    // Game ticks whose inputs asynchronous culling skipped to catch up.
+    int SkippedTicks = 0;
+};
+
+// Number of values describing each latency histogram in a metrics
+// snapshot: mean, p50, p99, p99.9 and max, in microseconds.
+constexpr int STAT_TIME_VALUES = 5;
+
+// Indices of the values in a metrics snapshot.
+// Mirrored by the CullingStat enum in culling.inc, so only append.
+enum CullingStatIndex
+{
+    STAT_TICKS,
+    // Times of the whole tick, then of each CullingStage in order.
+    STAT_TIMES,
+    STAT_BUNDLES_PER_TICK = STAT_TIMES + (NUM_CULLING_STAGES + 1) * STAT_TIME_VALUES,
+    // Rates are percentages of queued bundles.
+    STAT_CACHE_HIT_RATE,
+    // Hit rate of each cache slot.
+    STAT_SLOT_HIT_RATES,
+    STAT_CUBOID_CULL_RATE = STAT_SLOT_HIT_RATES + CUBOID_CACHE_SIZE,
+    STAT_REVEAL_RATE,
+    STAT_NODES_PER_TICK,
+    STAT_BLOCKING_TESTS_PER_TICK,
+    STAT_REVEALS_PER_TICK,
+    STAT_DEFER_RATE,
+    STAT_PROOF_REUSE_RATE,
+    // Part of the cache hit rate from occlusion hints.
+    STAT_HINT_HIT_RATE,
+    STAT_PVS_REJECTS_PER_TICK,
+    STAT_PORTAL_REJECTS_PER_TICK,
+    STAT_RASTER_BUILDS_PER_TICK,
+    STAT_SKIPPED_TICKS_PER_TICK,
+    // Part of the cache hit rate from players' hot occluders.
+    STAT_HOT_HIT_RATE,
+    NUM_CULLING_STATS
+};
+
+/**
+ *  Always-on culling instrumentation: latency histograms of each tick
+ *  and stage, and running totals of the work culling did.
+ *  Each cull records into it once: the game thread culls, unless culling
+ *  is asynchronous, when the culling thread does. Any thread may read it
+ *  at any time without stopping culling. A reset from the game thread
+ *  while culling asynchronously may land partway through recording a
+ *  cull, splitting it between the old and new windows.
+ */
+class CullingMetrics
+{
+public:
+    // Wall time of each whole cull.
+    LatencyHistogram TickTimes;
+    // Wall time of each stage of each cull.
+    LatencyHistogram StageTimes[NUM_CULLING_STAGES];
+    std::atomic<long long> Ticks{0};
+    std::atomic<long long> BundlesQueued{0};
+    std::atomic<long long> CacheHits[CUBOID_CACHE_SIZE];
+    std::atomic<long long> BundlesCulledByCuboids{0};
+    std::atomic<long long> NodesVisited{0};
+    std::atomic<long long> BlockingTests{0};
+    std::atomic<long long> Reveals{0};
+    std::atomic<long long> BundlesDeferred{0};
+    std::atomic<long long> ProofReuses{0};
+    std::atomic<long long> HintHits{0};
+    std::atomic<long long> PvsRejects{0};
+    std::atomic<long long> PortalRejects{0};
+    std::atomic<long long> RasterBuilds{0};
+    std::atomic<long long> SkippedTicks{0};
+    std::atomic<long long> HotHits{0};
+
+    CullingMetrics() { Reset(); }
+    // Adds a cull to the histograms and totals.
+    void RecordTick(const CullingTickStats& Stats);
+    // Clears everything, starting a new measurement window.
+    void Reset();
+    // Writes up to Count values, indexed by CullingStatIndex, to Stats.
+    // Returns how many were written.
+    int Snapshot(float* Stats, int Count) const;
+    // Writes a human-readable summary to Buffer, always null terminated.
+    void Format(char* Buffer, size_t Size) const;
+};
 
 /**
  *  Controls all occlusion culling logic.
  */
 class CullingController
 {
-    // Bounding volumes of all characters.
-    std::vector<CharacterBounds> Characters =
-        std::vector<CharacterBounds>(MAX_CHARACTERS + 1);
+    // Bounding volumes of all characters, aligned for their SIMD hulls.
+    std::vector<CharacterBounds, AlignedAllocator<CharacterBounds, 16>> Characters =
+        std::vector<CharacterBounds, AlignedAllocator<CharacterBounds, 16>>(
+            MAX_CHARACTERS + 1);
     std::vector<bool> IsAlive = std::vector<bool>(MAX_CHARACTERS + 1);
     // Cache of pointers to cuboids that recently blocked LOS from
     // player i to enemy j. Accessed by CuboidCaches[i][j].
-    const Cuboid* CuboidCaches[MAX_CHARACTERS][MAX_CHARACTERS][CUBOID_CACHE_SIZE]
+    const CuboidPlanes* CuboidCaches[MAX_CHARACTERS][MAX_CHARACTERS][CUBOID_CACHE_SIZE]
         = {{{0}}};
+    // Latest proof that a cached cuboid blocks each pair.
+    OcclusionProof Proofs[MAX_CHARACTERS][MAX_CHARACTERS];
     // Timers that track the last time a cuboid in the cache blocked LOS.
     int CacheTimers[MAX_CHARACTERS][MAX_CHARACTERS][CUBOID_CACHE_SIZE] = {{{0}}};
-    // All occluding cuboids in the map.
+    // Cuboids that recently blocked player i from an enemy whose pair cache
+    // lacked them, tried after the pair's own cache if hotOccluders is set.
+    // Blockers already cached for a pair are not added, as that pair
+    // finds them itself, and skipping them keeps most culls off the LRU.
+    // Accessed by HotOccluders[i].
+    const CuboidPlanes* HotOccluders[MAX_CHARACTERS + 1][HOT_OCCLUDER_COUNT] = {{0}};
+    // Last tick each hot occluder blocked an enemy.
+    int HotTimers[MAX_CHARACTERS + 1][HOT_OCCLUDER_COUNT] = {{0}};
+    // Occluders that blocked pairs of grid cells, kept across maps in
+    // culling_<map>.hints. Only used while HintsActive.
+    OcclusionHints Hints;
+    // Whether Hints belong to the current map. Set by BeginPlay
+    // if occlusionHints is set and the map has occluders.
+    bool HintsActive = false;
+    // Hash of the current map's occluder table, which Hints and Pvs
+    // were computed for.
+    uint64_t OccluderHash = 0;
+    // Cell-to-cell visibility of the current map, if BeginPlay found
+    // an up-to-date culling_<map>.pvs with a wide enough margin.
+    PotentiallyVisibleSet Pvs;
+    // PVS cell of each character's eye, from PopulateBundles.
+    int EyeCells[MAX_CHARACTERS + 1] = {0};
+    // Cells and portals of the current map, if BeginPlay found
+    // a valid culling_<map>.portals.
+    PortalGraph Portals;
+    // Portal cells that each character's reach overlaps,
+    // from PopulateBundles.
+    int PortalCells[MAX_CHARACTERS + 1][MAX_CHARACTER_PORTAL_CELLS] = {{0}};
+    // Number of PortalCells of each character, or -1 if unknown.
+    int PortalCellCounts[MAX_CHARACTERS + 1] = {0};
+    // File that Hints were loaded from. Kept, as MapName may point to a
+    // string that already names the next map when BeginPlay saves them.
+    char HintsFileName[256] = "";
+    // All occluding cuboids in the map, in BVH primitive order.
+    // Empty when the map was loaded from a compiled map.
     std::vector<Cuboid> Cuboids;
+    // Planes of each cuboid, indexed like Cuboids.
+    OccluderTable Occluders;
+    // Bounds of each cuboid, indexed like Cuboids.
+    std::vector<OccluderBounds> OccluderAABBs;
+    // Compiled map that Map points into, if BeginPlay found one
+    // matching the text map.
+    MappedFile CompiledMapFile;
+    // Occluder tables that culling reads. They point either into
+    // CompiledMapFile or into the tables built from the text map.
+    CompiledMapView<BVH_WIDTH> Map;
+    // Hash of the text map, used to detect stale compiled maps.
+    uint64_t MapSourceHash = 0;
+    bool HasMapSource = false;
     // Bounding volume hierarchy containing cuboids.
     std::unique_ptr<FastBVH::BVH<float, Cuboid>> CuboidBVH{};
+    // Node count, depth and SAH cost of the current CuboidBVH.
+    FastBVH::BuildReport BVHReport;
+    // CuboidBVH collapsed into BVH_WIDTH-wide nodes for traversal.
+    std::unique_ptr<FastBVH::WideBVH<BVH_WIDTH>> CuboidWideBVH{};
     CuboidIntersector Intersector;
     // Note: Could be nice to use std::optional with C++17.
     std::unique_ptr
-        <Traverser<float, decltype(Intersector)>>
+        <Traverser<float, decltype(Intersector), BVH_WIDTH>>
         CuboidTraverser{};
     // All occluding spheres in the map.
     std::vector<Sphere> Spheres;
     // Queues of line-of-sight bundles needing to be culled.
+    // Reserved for every possible pair up front, so it acts as a per-tick
+    // arena: stages compact it in place and it never reallocates.
     std::vector<Bundle> BundleQueue;
+    // With a time budget: the queued bundles, their priorities, and the
+    // order to cull them in as indices. Reserved like BundleQueue.
+    std::vector<Bundle> ScheduledBundles;
+    std::vector<uint8_t> BundlePriorities;
+    std::vector<uint32_t> BundleOrder;
+    // Outcomes of the current stage, indexed like BundleQueue.
+    std::vector<BundleOutcome> Outcomes;
+    // With a time budget, outcomes of the cuboid stage, as Outcomes holds
+    // those of the cache stage, both indexed like BundleOrder.
+    // Reserved like BundleQueue.
+    std::vector<BundleOutcome> CuboidOutcomes;
+    // With a time budget, whether each batch of BUDGET_BATCH bundles was
+    // culled before the deadline. Reserved for a full BundleQueue.
+    std::vector<uint8_t> BatchCulled;
+    // Next batch for a worker to claim, so that batches are culled in
+    // priority order whichever worker gets to them.
+    std::atomic<int> NextBatch{0};
+    // Time workers spent in each stage of the budgeted pass,
+    // which splits the pass's wall time between the stages.
+    std::atomic<long long> BatchCacheNanoseconds{0};
+    std::atomic<long long> BatchCuboidNanoseconds{0};
+    // For each bundle in the cuboid stage, the index of the bundle of the
+    // same pair in the opposite direction, or -1 if it is not queued.
+    // Reserved like BundleQueue.
+    std::vector<int> ReverseBundles;
+    // Depth cube of each player for the raster engine. Only allocated
+    // while the engine is selected.
+    std::vector<OcclusionRaster, AlignedAllocator<OcclusionRaster, 32>> Rasters;
+    // Players whose depth cubes the current raster stage rebuilds.
+    // Reserved for every character.
+    std::vector<int> RasterViewers;
+    // Whether the raster engine hid each bundle, indexed like BundleQueue,
+    // or like BundleOrder with a time budget.
+    std::vector<uint8_t> RasterOccluded;
+    // Scratch index of each pair's bundle in BundleQueue, or in BundleOrder
+    // with a time budget, only trusted after checking that the bundle there
+    // belongs to the pair.
+    int QueueIndices[MAX_CHARACTERS + 1][MAX_CHARACTERS + 1] = {{0}};
+    // Worker threads that share the culling stages with the game thread.
+    CullingThreadPool ThreadPool;
     
-    // How many frames pass between each cull.
-    int CullingPeriod = 2;
+    // How many frames pass between each cull. Set by BeginPlay.
+    int CullingPeriod = DEFAULT_CULLING_PERIOD;
+    // How far characters can move before each pair is culled again,
+    // or zero if hulls and peeks are not swept. Set by BeginPlay.
+    float SweepDistance = 0;
     // Stores how many ticks character j remains visible to character i for.
     int VisibilityTimers[MAX_CHARACTERS][MAX_CHARACTERS] = {{0}};
+    // Horizontal distance each player can peek this tick, from PopulateBundles.
+    float PeekDisplacements[MAX_CHARACTERS + 1] = {0};
+    // Pairs that the time budget ran out before culling. They stay
+    // visible, and are culled first on the next cull.
+    bool Deferred[MAX_CHARACTERS + 1][MAX_CHARACTERS + 1] = {{false}};
+    // Tick on which each pair was last revealed, or its characters were
+    // last dead, to find pairs near the edge of visibility.
+    int LastRevealed[MAX_CHARACTERS + 1][MAX_CHARACTERS + 1] = {{0}};
+    // Tick before which each hidden pair need not be culled again.
+    int NextCullTicks[MAX_CHARACTERS + 1][MAX_CHARACTERS + 1] = {{0}};
     // How many ticks an enemy stays visible for after being revealed.
+    // Set by BeginPlay, as asynchronous culling adds a tick.
     int VisibilityTimerMax = CullingPeriod * 3;
-    // Used to calculate short rolling average of frame times.
-    float RollingTotalTime = 0;
-    float RollingAverageTime = 0;
-    // Stores maximum culling time in rolling window.
-    int RollingMaxTime = 0;
-    // Number of ticks in the rolling window.
-    int RollingWindowLength = 128;
     // Total ticks since game start.
     int TotalTicks = 0;
-    // Stores total culling time to calculate an overall average.
-    int TotalTime = 0;
+    // Heap allocations made during the last tick.
+    // Only counted when built with CULLING_COUNT_ALLOCATIONS.
+    long long TickAllocations = 0;
+    // Stage times and bundle counts of the last cull.
+    CullingTickStats LastTickStats;
+    // Asynchronous culling state. The game thread publishes each tick's
+    // inputs, and AsyncThread culls the newest inputs and publishes the
+    // resulting visibility. Everything above that culling touches is
+    // owned by AsyncThread while it runs.
+    TripleBuffer<TickInputs> AsyncInputs;
+    TripleBuffer<VisibilityFrame> AsyncResults;
+    // Teams from the latest UpdateCharacters, for the game thread's
+    // same-team checks while Characters belongs to AsyncThread.
+    int AsyncTeams[MAX_CHARACTERS + 1] = {0};
+    std::thread AsyncThread;
+    // AsyncThread only sleeps on AsyncWake when it has no inputs to cull,
+    // so the game thread only takes AsyncMutex to wake it from that.
+    std::mutex AsyncMutex;
+    std::condition_variable AsyncWake;
+    std::atomic<bool> AsyncWaiting{false};
+    std::atomic<bool> AsyncStopping{false};
+    // Game ticks published by the game thread, and the tick of the inputs
+    // that AsyncThread last culled. TotalTicks counts culls instead, which
+    // keeps every pair on its stagger when culls skip ticks.
+    int AsyncGameTicks = 0;
+    int AsyncCulledTick = 0;
+    // Histograms and totals of every cull since BeginPlay.
+    CullingMetrics Metrics;
 
-    // Cull while gathering and reporting runtime statistics.
-    void BenchmarkCull();
+    // Builds the occluder tables from a text map.
+    void LoadTextMap(const char* fileName);
+    // Maps a compiled map and points the occluder tables into it.
+    // Returns false if it is missing, malformed or stale.
+    bool LoadCompiledMap(const char* fileName);
+    // Sets the bounding volumes of every character from one tick's inputs.
+    void SetCharacters(
+        const int* Teams,
+        const float* EyesFlat,
+        const float* BasesFlat,
+        const float* Yaws,
+        const float* Pitches,
+        const float* Speeds);
+    // Starts AsyncThread, revealing everyone until its first cull finishes.
+    void StartAsyncCulling();
+    // Stops AsyncThread, if running, after its current cull.
+    void StopAsyncCulling();
+    // Body of AsyncThread.
+    void AsyncCullLoop();
     // Cull visibility for all player, enemy pairs.
     void Cull();
     // Calculates all bundles of lines of sight between characters,
     // adding them to the BundleQueue for culling.
     void PopulateBundles();
+    // Runs the cache and cuboid stages on every queued bundle,
+    // adding to the stage times and counts of LastTickStats.
+    void CullQueuedBundles();
+    // Culls ScheduledBundles in BundleOrder, batch by batch, until Deadline.
+    // Bundles left over are deferred and stay visible. Workers claim
+    // batches in order in a single parallel pass, and outcomes are applied
+    // after it, so depth cubes are rebuilt and the pool woken once a tick.
+    // The pass's time is split between the cache and cuboid stages by the
+    // time workers spent in each.
+    void CullWithinBudget(std::chrono::steady_clock::time_point Deadline);
+    // Computes the outcomes of one batch of BUDGET_BATCH bundles of the
+    // budgeted pass.
+    void CullBatch(int Batch);
+    // Sets the possible peeks of a queued bundle.
+    void SetPossiblePeeks(Bundle& B) const;
+    // Moves the BundleQueue into ScheduledBundles, sorts BundleOrder
+    // by priority, and points QueueIndices at each pair's place in it.
+    void PrioritizeBundles();
     // Culls all bundles with each player's cache of occluders.
     void CullWithCache();
+    // Checks a single bundle against its pair's cache of occluders.
+    BundleOutcome CheckCache(const Bundle& B) const;
+    // How much further a bundle may move before its pair's proof stops
+    // holding, or zero if it no longer holds.
+    float ProofSlack(const Bundle& B) const;
+    // Margin of a new proof that Blocker blocks a bundle,
+    // or zero if the pair is backing off from making proofs.
+    float ProofMargin(const Bundle& B, const CuboidPlanes* Blocker) const;
+    // Applies a blocked outcome that did not reuse a proof,
+    // where Blocker is in the given cache slot.
+    void UpdateProof(const Bundle& B, const CuboidPlanes* Blocker, int CacheSlot, float Margin);
+    // Puts a cuboid that blocked a bundle in its pair's cache, in place of
+    // the least recently used entry, and returns its slot.
+    int CacheBlocker(const Bundle& B, const CuboidPlanes* Blocker);
+    // Records that a cuboid blocked a bundle in the occlusion hints.
+    void RecordHint(const Bundle& B, const CuboidPlanes* Blocker);
+    // Puts a cuboid that blocked a bundle in its player's hot occluders,
+    // in place of the least recently used one if it is not already there.
+    void TouchHotOccluder(int i, const CuboidPlanes* Blocker);
+    // Writes the current map's occlusion hints to culling_<map>.hints
+    // if they are active and changed. Returns false on a write error.
+    bool SaveOcclusionHints();
+    // Loads culling_<map>.pvs into Pvs, unless it is missing, stale, or
+    // its margin does not cover this map's peeks and swept hulls.
+    void LoadPvs();
+    // Farthest that peeks and swept hulls reach past a character's bounds.
+    float GetPeekReach() const;
     // Culls queued bundles with occluding spheres.
     void CullWithSpheres();
     // Culls queued bundles with occluding cuboids.
     void CullWithCuboids();
+    // Fills ReverseBundles for the BundleQueue.
+    void FindReverseBundles();
+    // Applies a blocked outcome of the cache stage.
+    void ApplyCacheOutcome(const Bundle& B, const BundleOutcome& Outcome);
+    // Applies a blocked outcome of the cuboid stage.
+    void ApplyCuboidOutcome(const Bundle& B, const BundleOutcome& Outcome);
+    // Culls queued bundles against each player's depth cube, rebuilding
+    // cubes that no longer cover the player's peeks.
+    void CullWithRaster();
+    // Rebuilds the depth cubes of the players of Bundles that no longer
+    // cover their peeks.
+    void RebuildRasters(const std::vector<Bundle>& Bundles);
+    // Whether a bundle's enemy is hidden in its player's depth cube.
+    bool IsRasterOccluded(const Bundle& B) const;
+    // Sets when a pair that was just found hidden is next culled: as late
+    // as maxCullInterval allows while the characters, moving at
+    // MAX_PLAYER_SPEED, cannot move the bundle by Margin, the margin of
+    // its blocker. Pairs without a margin are culled the next period.
+    void ScheduleNextCull(const Bundle& B, float Margin);
+    // Removes blocked bundles from the BundleQueue, keeping the order of
+    // those that remain.
+    void CompactBundleQueue();
+    // Searches the cuboid BVH for a cuboid that blocks a single bundle.
+    BundleOutcome CheckCuboids(const Bundle& B) const;
+    // Like CheckCuboids, but for the bundles of a pair in both directions,
+    // which share the segment between the eyes and so one traversal.
+    // Each direction tests the candidates nearest its own player first.
+    void CheckCuboidPair(
+        const Bundle& B,
+        const Bundle& Reverse,
+        BundleOutcome& Outcome,
+        BundleOutcome& ReverseOutcome) const;
     // Gets corners of the rectangle encompassing a player's possible peeks
     // on an enemy--in the plane normal to the line of sight.
     // When facing along the vector from player to enemy, Corners are indexed
@@ -88,11 +552,12 @@ class CullingController
     //   Inaccurate on very wide enemies, as the most aggressive angle to peek
     //   the left of an enemy is actually perpendicular to the leftmost point
     //   of the enemy, not its center.
-    static std::vector<vec3> GetPossiblePeeks(
+    static void GetPossiblePeeks(
         const vec3& PlayerCameraLocation,
         const vec3& EnemyLocation,
         float MaxDeltaHorizontal,
-        float MaxDeltaVertical);
+        float MaxDeltaVertical,
+        vec3 (&Corners)[NUM_PEEKS]);
     // Estimates the latency of the client controlling character i in milliseconds.
     // The estimate should be close to the player's maximum latency,
     // as underestimates could cause popping.
@@ -103,17 +568,109 @@ class CullingController
 
 public:
     char* MapName = "";
+    // Directory holding culling_<map>.txt and culling_<map>.bin.
+    const char* mapDirectory = "csgo/maps/";
+    // Whether BeginPlay may load an up-to-date culling_<map>.bin
+    // instead of parsing the text map.
+    bool useCompiledMaps = true;
     // Server tick rate.
     int tickRate = 128;
     // Culling system maximum lookahead (millisceonds).
     // A low value enforces strict culling, but lag may cause popping.
     // A high value will grant a greater advantage to wallhackers.
     int maxLookahead = 110;
+    // Maximum number of cuboids in a leaf of the cuboid BVH.
+    int bvhLeafSize = 4;
+    // Number of worker threads that help the game thread cull.
+    // Zero culls everything on the calling thread.
+    int workerThreads = 0;
+    // Whether to cull on a dedicated thread instead of inside Tick.
+    // Tick then only hands over inputs and picks up the newest finished
+    // cull, so visibility lags by a tick, and reveals last a tick longer
+    // to make up for it. While culls take longer than a tick, results lag
+    // further and everyone is revealed. Takes effect on BeginPlay.
+    bool asyncCulling = false;
+    // Time budget of each cull in microseconds, or zero for no limit.
+    // Once it runs out, pairs left to cull stay visible and carry over
+    // to the next cull. Pairs about to stop being visible go first,
+    // then pairs that were visible recently.
+    int cullBudgetMicroseconds = 0;
+    // Longest time in milliseconds that a hidden pair may go without
+    // being culled again. Zero culls every pair each CullingPeriod.
+    // A pair is only culled less often while the margin of its blocker,
+    // from reuseProofs, is wide enough that characters moving at
+    // MAX_PLAYER_SPEED cannot uncover it before the next cull, so reveals
+    // are not made later. Has no effect without reuseProofs, or with the
+    // raster engine.
+    int maxCullInterval = 0;
+    // Whether a pair stays blocked without being tested again while
+    // it moves less than the margin of its latest OcclusionProof.
+    // Results are unchanged, but making proofs only pays off when
+    // players hold still, such as while holding angles.
+    bool reuseProofs = false;
+    // Ticks between culls of each pair. Culling cost falls in proportion,
+    // but enemies who come into view between culls are revealed late,
+    // by up to the period, unless sweptHulls is set. Without sweptHulls,
+    // periods above DEFAULT_CULLING_PERIOD are clamped to it.
+    // Takes effect on BeginPlay.
+    int cullingPeriod = DEFAULT_CULLING_PERIOD;
+    // Whether to cull enemy hulls and player peeks grown by how far the
+    // characters can move in a period, so that a cull stays valid until
+    // the pair is culled again, and reveals are not late. It culls less
+    // aggressively, as hulls become boxes that grow with the period.
+    // Takes effect on BeginPlay.
+    bool sweptHulls = false;
+    // Whether to try the occluder that most often blocked players in the
+    // same grid cells before searching the BVH, and to keep these hints
+    // in culling_<map>.hints, so that culls start from them the next time
+    // the map is played. Hints are saved when the map changes and when the
+    // controller is destroyed. Takes effect on BeginPlay.
+    bool occlusionHints = false;
+    // Whether to try the cuboids that recently blocked a player from any
+    // enemy before searching the BVH, as enemies tend to gather behind the
+    // same few walls. Each pair that the cache cannot block pays for up to
+    // HOT_OCCLUDER_COUNT more tests, so it only pays off when the pair
+    // caches often miss, such as right after enemies regroup elsewhere.
+    bool hotOccluders = false;
+    // Whether BeginPlay may load culling_<map>.pvs, made by the
+    // culling_compile_pvs tool, to skip pairs of characters in cells that
+    // cannot see each other before any geometry is tested.
+    bool usePvs = true;
+    // Whether BeginPlay may load culling_<map>.portals, to skip pairs of
+    // characters in cells that no sequence of portals joins.
+    bool usePortals = true;
+    // How bundles are culled. The raster engine lets occluders block
+    // enemies together, but shrinks occluders by how far players can peek,
+    // so thin walls cannot block anything. Takes effect on BeginPlay.
+    CullingEngine cullingEngine = CULLING_ENGINE_BVH;
     CullingController();
+    ~CullingController();
     void BeginPlay(char* mapName);
+    // Writes the current map's occluders to culling_<map>.bin.
+    // Returns false if the map has no text source or on a write error.
+    bool SaveCompiledMap();
     void Tick();
     // Returns if player i can see player j
     bool IsVisible(int i, int j);
+    // Returns how many heap allocations the last tick made.
+    // Always zero unless built with CULLING_COUNT_ALLOCATIONS.
+    long long GetTickAllocations() const { return TickAllocations; }
+    // Returns the stage times and bundle counts of the last cull.
+    // Not safe to call while culling asynchronously.
+    const CullingTickStats& GetLastTickStats() const { return LastTickStats; }
+    // Returns the histograms and totals of every cull since BeginPlay.
+    // Safe to read from any thread while culling runs.
+    const CullingMetrics& GetMetrics() const { return Metrics; }
+    // Starts a new window of metrics. While culling asynchronously, the
+    // cull being recorded may be split between the windows.
+    void ResetMetrics() { Metrics.Reset(); }
+    // Gets the bounds enclosing every occluder in the current map.
+    // Both are zero if the map has no occluders.
+    void GetMapBounds(vec3& Min, vec3& Max) const;
+    // Returns the occluder tables of the current map.
+    const CompiledMapView<BVH_WIDTH>& GetMap() const { return Map; }
+    // Returns the hash of the current map's occluder table.
+    uint64_t GetOccluderHash() const { return OccluderHash; }
     void UpdateCharacters(
         int* Teams,
         float* EyesFlat,
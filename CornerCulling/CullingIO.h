@@ -4,8 +4,24 @@
 #include <vector>
 #include <glm/vec3.hpp>
 #include <cstring>
+#include <cstdio>
 using glm::vec3;
 
+// Default directory of culling map files, relative to the game directory.
+constexpr const char* CULLING_MAP_DIRECTORY = "csgo/maps/";
+
+// Writes the path of a culling map file into fileName, such as
+// csgo/maps/culling_de_dust2.txt for directory "csgo/maps/", map name
+// "de_dust2" and extension ".txt".
+inline void MapFileName(
+    char (&fileName)[256],
+    const char* directory,
+    const char* mapName,
+    const char* extension)
+{
+    snprintf(fileName, sizeof(fileName), "%sculling_%s%s", directory, mapName, extension);
+}
+
 // Returns a Cuboid's vertices from a vertex representation.
 // Assumes that input is a filestrem pointing
 // to the first line of a cuboid representation:
@@ -147,15 +163,10 @@ inline Cuboid CuboidFromFaces(std::ifstream& input)
 }
 
 // Returns a list of cuboid vertices from a text representation in a file
-inline std::vector<Cuboid> FileToCuboids(char* mapName)
+inline std::vector<Cuboid> FileToCuboids(const char* fileName)
 {
     std::vector<Cuboid> cuboids;
 
-    char fileName[128];
-    strncpy(fileName, "csgo/maps/culling_", 20);
-    strncat(fileName, mapName, 60);
-    strncat(fileName, ".txt", 10);
-
     std::ifstream in;
     in.open(fileName);
 
@@ -214,10 +225,8 @@ inline std::vector<vec3> GetFirstCuboidVertices(char* mapName)
         vec3(1, 0, 0),
     };
 
-    char fileName[128];
-    strncpy(fileName, "csgo/maps/culling_", 20);
-    strncat(fileName, mapName, 60);
-    strncat(fileName, ".txt", 10);
+    char fileName[256];
+    MapFileName(fileName, CULLING_MAP_DIRECTORY, mapName, ".txt");
 
     std::ifstream in;
     in.open(fileName);
@@ -0,0 +1,217 @@
+/**
+    @author Andrew Huang (87andrewh)
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Maximum number of threads, including the calling thread,
+// that can cooperate on a single ParallelFor.
+constexpr int MAX_CULLING_THREADS = 16;
+
+/**
+ *  Small fork-join pool with work stealing, used to spread the culling
+ *  stages across cores. The calling thread always takes part in the work,
+ *  so a pool with zero workers runs everything inline.
+ *
+ *  Work is a range of item indices. Each participant starts with a
+ *  contiguous slice of that range, pops Grain-sized chunks off the front
+ *  of its own slice, and once it runs dry steals the back half of
+ *  another participant's slice.
+ */
+class CullingThreadPool
+{
+    // Slice of the work range owned by one participant.
+    // Padded so that neighbouring slices do not share a cache line.
+    struct WorkRange
+    {
+        std::mutex Lock;
+        int Begin = 0;
+        int End = 0;
+        char Padding[64];
+    };
+    WorkRange Ranges[MAX_CULLING_THREADS];
+    std::vector<std::thread> Threads;
+    // Type-erased body of the current ParallelFor.
+    void (*Job)(const void* Context, int Begin, int End) = nullptr;
+    const void* JobContext = nullptr;
+    int JobGrain = 1;
+    // Number of participants in the current ParallelFor.
+    int JobParticipants = 1;
+    // Wakes workers when a new job is published or the pool stops.
+    std::mutex Mutex;
+    std::condition_variable WakeUp;
+    int Generation = 0;
+    bool Stopping = false;
+    // Workers that have not yet finished the current job.
+    std::atomic<int> Remaining{0};
+
+    template <typename Body>
+    static void Invoke(const void* Context, int Begin, int End)
+    {
+        (*static_cast<const Body*>(Context))(Begin, End);
+    }
+
+    // Pops the next chunk of work for participant p, stealing if needed.
+    // Returns false once every slice is empty.
+    bool NextChunk(int p, int& Begin, int& End)
+    {
+        {
+            std::lock_guard<std::mutex> Guard(Ranges[p].Lock);
+            if (Ranges[p].Begin < Ranges[p].End)
+            {
+                Begin = Ranges[p].Begin;
+                End = std::min(Begin + JobGrain, Ranges[p].End);
+                Ranges[p].Begin = End;
+                return true;
+            }
+        }
+        for (int k = 1; k < JobParticipants; k++)
+        {
+            int Victim = (p + k) % JobParticipants;
+            int StolenBegin, StolenEnd;
+            {
+                std::lock_guard<std::mutex> Guard(Ranges[Victim].Lock);
+                int Size = Ranges[Victim].End - Ranges[Victim].Begin;
+                if (Size <= 0)
+                {
+                    continue;
+                }
+                // Take everything from small slices, otherwise the back half.
+                StolenEnd = Ranges[Victim].End;
+                StolenBegin = (Size <= JobGrain)
+                    ? Ranges[Victim].Begin
+                    : Ranges[Victim].Begin + Size / 2;
+                Ranges[Victim].End = StolenBegin;
+            }
+            Begin = StolenBegin;
+            End = std::min(StolenBegin + JobGrain, StolenEnd);
+            std::lock_guard<std::mutex> Guard(Ranges[p].Lock);
+            Ranges[p].Begin = End;
+            Ranges[p].End = StolenEnd;
+            return true;
+        }
+        return false;
+    }
+
+    void Participate(int p)
+    {
+        int Begin, End;
+        while (NextChunk(p, Begin, End))
+        {
+            Job(JobContext, Begin, End);
+        }
+    }
+
+    void WorkerMain(int p)
+    {
+        int SeenGeneration = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> Guard(Mutex);
+                WakeUp.wait(
+                    Guard,
+                    [&]{ return Stopping || Generation != SeenGeneration; });
+                if (Stopping)
+                {
+                    return;
+                }
+                SeenGeneration = Generation;
+            }
+            Participate(p);
+            Remaining.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    void Run(int Count)
+    {
+        JobParticipants = int(Threads.size()) + 1;
+        for (int p = 0; p < JobParticipants; p++)
+        {
+            std::lock_guard<std::mutex> Guard(Ranges[p].Lock);
+            Ranges[p].Begin = int((long long)Count * p / JobParticipants);
+            Ranges[p].End = int((long long)Count * (p + 1) / JobParticipants);
+        }
+        Remaining.store(JobParticipants - 1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> Guard(Mutex);
+            Generation++;
+        }
+        WakeUp.notify_all();
+        Participate(0);
+        // Jobs are short, so wait for stragglers without sleeping.
+        while (Remaining.load(std::memory_order_acquire) != 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+public:
+    CullingThreadPool() {}
+    CullingThreadPool(const CullingThreadPool&) = delete;
+    CullingThreadPool& operator=(const CullingThreadPool&) = delete;
+    ~CullingThreadPool()
+    {
+        Resize(0);
+    }
+
+    // Number of background worker threads, excluding the caller.
+    int Size() const
+    {
+        return int(Threads.size());
+    }
+
+    // Stops all workers and starts NumWorkers new ones.
+    // NumWorkers is clamped to [0, MAX_CULLING_THREADS - 1].
+    void Resize(int NumWorkers)
+    {
+        NumWorkers = std::max(0, std::min(NumWorkers, MAX_CULLING_THREADS - 1));
+        if (NumWorkers == int(Threads.size()))
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> Guard(Mutex);
+            Stopping = true;
+        }
+        WakeUp.notify_all();
+        for (auto& T : Threads)
+        {
+            T.join();
+        }
+        Threads.clear();
+        Stopping = false;
+        Generation = 0;
+        for (int p = 1; p <= NumWorkers; p++)
+        {
+            Threads.emplace_back(&CullingThreadPool::WorkerMain, this, p);
+        }
+    }
+
+    // Calls F(Begin, End) over disjoint chunks covering [0, Count),
+    // returning once all chunks are done. F must be safe to call
+    // concurrently on different chunks.
+    template <typename Body>
+    void ParallelFor(int Count, int Grain, const Body& F)
+    {
+        if (Threads.empty() || Count <= Grain)
+        {
+            if (Count > 0)
+            {
+                F(0, Count);
+            }
+            return;
+        }
+        Job = &Invoke<Body>;
+        JobContext = &F;
+        JobGrain = std::max(1, Grain);
+        Run(Count);
+    }
+};
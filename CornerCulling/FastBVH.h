@@ -3,12 +3,14 @@
 #include "FastBVH/BVH.h"
 #include "FastBVH/BuildStrategy.h"
 #include "FastBVH/BuildStrategy1.h"
+#include "FastBVH/BuildStrategy2.h"
 #include "FastBVH/Config.h"
 #include "FastBVH/Intersection.h"
 #include "FastBVH/Iterable.h"
 #include "FastBVH/Ray.h"
 #include "FastBVH/Traverser.h"
 #include "FastBVH/Vector3.h"
+#include "FastBVH/WideBVH.h"
 #include "GeometricPrimitives.h"
 
 // Cuboid BVH API.
@@ -34,7 +36,7 @@ namespace
     {
         public:
             Intersection<float> operator()(
-                const Cuboid& C,
+                const CuboidPlanes& C,
                 const OptSegment& Segment) const noexcept
             {
                 float Time = IntersectionTime(&C, Segment.Start, Segment.Delta);
@@ -85,7 +85,7 @@ class BVH final {
 
   //! Accesses an iterable container to the primitives in the BVH.
   //! \return An iterable container of the primitive array.
-  inline std::vector<const Primitive *> getPrimitives() const noexcept { return primitives; }
+  inline const std::vector<const Primitive *>& getPrimitives() const noexcept { return primitives; }
 
  protected:
   //! Build the BVH tree out of build_prims
@@ -0,0 +1,198 @@
+#include "BuildStrategy.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace FastBVH {
+
+//! \brief Contains details on the implementation
+//! of the variant-2 (binned SAH) BVH build strategy.
+namespace Strategy2 {
+
+//! \brief A bin of primitive centroids along one axis.
+template <typename Float>
+struct Bin final {
+  //! The bounding box of all primitives in the bin.
+  BBox<Float> bbox;
+
+  //! The number of primitives in the bin.
+  uint32_t count = 0;
+};
+
+//! \brief Returns a box that contains nothing, ready to be expanded.
+template <typename Float>
+BBox<Float> emptyBox() noexcept {
+  const Float inf = std::numeric_limits<Float>::infinity();
+  return BBox<Float>(Vector3<Float>{inf, inf, inf}, Vector3<Float>{-inf, -inf, -inf});
+}
+
+//! \brief Surface area of a box that may be empty.
+template <typename Float>
+Float area(const BBox<Float>& b) noexcept {
+  if (b.extent.x < 0 || b.extent.y < 0 || b.extent.z < 0) {
+    return 0;
+  }
+  return b.surfaceArea();
+}
+
+}  // namespace Strategy2
+
+template <typename Float>
+template <typename Primitive, typename BoxConverter>
+BVH<Float, Primitive> BuildStrategy<Float, 2>::operator()(Iterable<Primitive> primitives, BoxConverter converter) {
+  const uint32_t count = (uint32_t)primitives.size();
+
+  // Convert every primitive once, instead of once per tree level.
+  std::vector<BBox<Float>> boxes;
+  std::vector<Vector3<Float>> centers;
+  boxes.reserve(count);
+  centers.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    boxes.push_back(converter(primitives[i]));
+    centers.push_back(boxes.back().getCenter());
+  }
+
+  last_report = BuildReport();
+
+  NodeArray<Float> nodes;
+  nodes.reserve(count * 2);
+
+  if (count > 0) {
+    auto root = Strategy2::emptyBox<Float>();
+    for (const auto& box : boxes) {
+      root.expandToInclude(box);
+    }
+    build(primitives, boxes, centers, nodes, 0, count, 0, std::max(Strategy2::area(root), Float(1e-6)));
+  }
+
+  last_report.node_count = (uint32_t)nodes.size();
+
+  return BVH<Float, Primitive>(std::move(nodes), primitives);
+}
+
+template <typename Float>
+template <typename Primitive>
+void BuildStrategy<Float, 2>::build(Iterable<Primitive>& primitives, std::vector<BBox<Float>>& boxes,
+                                    std::vector<Vector3<Float>>& centers, NodeArray<Float>& nodes, uint32_t start,
+                                    uint32_t end, uint32_t depth, Float root_area) {
+  using namespace Strategy2;
+
+  const uint32_t primitive_count = end - start;
+
+  auto bb = emptyBox<Float>();
+  auto bc = emptyBox<Float>();
+  for (uint32_t p = start; p < end; ++p) {
+    bb.expandToInclude(boxes[p]);
+    bc.expandToInclude(centers[p]);
+  }
+
+  const uint32_t index = (uint32_t)nodes.size();
+  nodes.push_back(Node<Float>{bb, start, primitive_count, 0});
+
+  const Float node_area = area(bb);
+  const Float leaf_cost = intersection_cost * primitive_count;
+
+  // Find the cheapest binned split over all three axes.
+  Float best_cost = std::numeric_limits<Float>::infinity();
+  uint32_t best_axis = 0;
+  uint32_t best_split = 0;
+
+  if (primitive_count > 1) {
+    Bin<Float> bins[64];
+    Float right_areas[64];
+    uint32_t right_counts[64];
+
+    for (uint32_t axis = 0; axis < 3; axis++) {
+      const Float axis_min = bc.min[axis];
+      const Float axis_extent = bc.max[axis] - axis_min;
+      if (axis_extent <= 0) {
+        continue;
+      }
+      const Float scale = Float(bin_count) / axis_extent;
+
+      for (uint32_t b = 0; b < bin_count; b++) {
+        bins[b].bbox = emptyBox<Float>();
+        bins[b].count = 0;
+      }
+      for (uint32_t p = start; p < end; ++p) {
+        uint32_t b = std::min(bin_count - 1, (uint32_t)((centers[p][axis] - axis_min) * scale));
+        bins[b].bbox.expandToInclude(boxes[p]);
+        bins[b].count++;
+      }
+
+      // Sweep from the right to get the area and count right of each plane.
+      auto right_box = emptyBox<Float>();
+      uint32_t right_count = 0;
+      for (uint32_t b = bin_count - 1; b > 0; b--) {
+        right_box.expandToInclude(bins[b].bbox);
+        right_count += bins[b].count;
+        right_areas[b] = area(right_box);
+        right_counts[b] = right_count;
+      }
+
+      // Sweep from the left, evaluating the split before each bin.
+      auto left_box = emptyBox<Float>();
+      uint32_t left_count = 0;
+      for (uint32_t b = 1; b < bin_count; b++) {
+        left_box.expandToInclude(bins[b - 1].bbox);
+        left_count += bins[b - 1].count;
+        if (left_count == 0 || right_counts[b] == 0) {
+          continue;
+        }
+        Float cost = traversal_cost + intersection_cost *
+                                          (area(left_box) * left_count + right_areas[b] * right_counts[b]) /
+                                          std::max(node_area, Float(1e-6));
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = b;
+        }
+      }
+    }
+  }
+
+  // Stop when the node is small enough and splitting would not pay off,
+  // or when no split separates the centroids.
+  const bool small = primitive_count <= leaf_size;
+  if (primitive_count <= 1 || best_cost == std::numeric_limits<Float>::infinity() ||
+      (small && best_cost >= leaf_cost)) {
+    if (primitive_count > 1 && !small) {
+      // Centroids all coincide, so fall back to an even split.
+      best_split = 0;
+    } else {
+      last_report.leaf_count++;
+      last_report.max_depth = std::max(last_report.max_depth, depth);
+      last_report.sah_cost += leaf_cost * node_area / root_area;
+      return;
+    }
+  }
+
+  last_report.sah_cost += traversal_cost * node_area / root_area;
+
+  // Partition the primitives on the chosen plane.
+  uint32_t mid = start;
+  if (best_split == 0) {
+    mid = start + primitive_count / 2;
+  } else {
+    const Float axis_min = bc.min[best_axis];
+    const Float scale = Float(bin_count) / (bc.max[best_axis] - axis_min);
+    for (uint32_t i = start; i < end; ++i) {
+      uint32_t b = std::min(bin_count - 1, (uint32_t)((centers[i][best_axis] - axis_min) * scale));
+      if (b < best_split) {
+        std::swap(primitives[i], primitives[mid]);
+        std::swap(boxes[i], boxes[mid]);
+        std::swap(centers[i], centers[mid]);
+        ++mid;
+      }
+    }
+    if (mid == start || mid == end) {
+      mid = start + primitive_count / 2;
+    }
+  }
+
+  build(primitives, boxes, centers, nodes, start, mid, depth + 1, root_area);
+  nodes[index].right_offset = (uint32_t)nodes.size() - index;
+  build(primitives, boxes, centers, nodes, mid, end, depth + 1, root_area);
+}
+
+}  // namespace FastBVH
@@ -17,8 +17,8 @@ struct Intersection final {
   //! The scale at which the ray reaches the primitive.
   Float t = std::numeric_limits<Float>::infinity();
 
-  // Pointer to the intersected object.
-  const Cuboid* IntersectedP = NULL;
+  // Pointer to the planes of the intersected object.
+  const CuboidPlanes* IntersectedP = NULL;
 
   //! Gets the position at the ray hit the object.
   //! \param ray_pos The ray position.
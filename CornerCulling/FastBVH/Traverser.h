@@ -1,157 +1,221 @@
 #pragma once
 
 #include "BVH.h"
+#include "WideBVH.h"
 #include "../GeometricPrimitives.h"
 #include <vector>
 
 namespace FastBVH {
 
+    //! \brief Counts the work done by one traversal.
+    struct TraversalStats final
+    {
+        //! The number of inner nodes whose children were tested.
+        uint32_t nodes = 0;
+
+        //! The number of primitives given to the blocking test.
+        uint32_t blocking_tests = 0;
+    };
+
     //! \brief Used for traversing a BVH and checking for ray-primitive intersections.
+    //! Traverses the collapsed @ref WideBVH, testing every child of a node
+    //! with one SIMD slab test and visiting hit children nearest first.
     //! \tparam Float The floating point type used by vector components.
     //! \tparam Intersector The type of the primitive intersector.
+    //! \tparam Width The branching factor of the wide BVH, 4 or 8.
     template <
         typename Float,
-        typename Intersector>
+        typename Intersector,
+        int Width = 4>
     class Traverser final
     {
-        const BVH<Float, Cuboid>& bvh;
+        // Nodes of the collapsed BVH, which may live in a mapped file.
+        const WideNode<Width>* nodes;
+        std::size_t node_count;
         Intersector intersector;
+        // Plane table indexed like the BVH primitives.
+        const CuboidPlanes* planes;
 
     public:
         //! Constructs a new BVH traverser.
         //! \param bvh_ The BVH to be traversed.
-        constexpr Traverser(const BVH<Float, Cuboid>& bvh_, const Intersector& intersector_) noexcept
-            : bvh(bvh_), intersector(intersector_) {}
+        //! \param planes_ The occluder planes, in BVH primitive order.
+        constexpr Traverser(
+            const WideBVH<Width>& bvh_,
+            const Intersector& intersector_,
+            const CuboidPlanes* planes_) noexcept
+            : Traverser(bvh_.getNodes(), bvh_.size(), intersector_, planes_) {}
+        //! Constructs a traverser over nodes stored elsewhere.
+        //! \param nodes_ The wide nodes, root first.
+        //! \param node_count_ The number of nodes.
+        //! \param planes_ The occluder planes, in BVH primitive order.
+        constexpr Traverser(
+            const WideNode<Width>* nodes_,
+            std::size_t node_count_,
+            const Intersector& intersector_,
+            const CuboidPlanes* planes_) noexcept
+            : nodes(nodes_), node_count(node_count_),
+              intersector(intersector_), planes(planes_) {}
         // Traces single ray through the BVH, returning true if that ray
         // intersects a cuboid that blocks LOS between peeks and the verticies
         // of an enemy bounding box.
-        const Cuboid* traverse(
+        // All traversal state lives on the stack, so concurrent calls are safe.
+        const CuboidPlanes* traverse(
+            const OptSegment& segment,
+            const vec3 (&peeks)[NUM_PEEKS],
+            const CharacterBounds& Bounds,
+            TraversalStats& stats) const;
+        //! Calls visit on each occluder in the leaves that the segment
+        //! reaches, nearest leaf first, until visit returns true.
+        //! Occluders are not tested against the segment itself, so callers
+        //! can test them against either direction of it.
+        //! \return Whether visit returned true.
+        template <typename Visit>
+        bool forEachCandidate(
             const OptSegment& segment,
-            const std::vector<vec3>& peeks,
-            const CharacterBounds& Bounds);
+            Visit&& visit,
+            TraversalStats& stats) const;
+        //! The intersector that traverse tests occluders with.
+        const Intersector& getIntersector() const noexcept { return intersector; }
     };
 
     //! \brief Contains implementation details for the @ref Traverser class.
     namespace TraverserImpl {
 
         //! \brief Node for storing state information during traversal.
-        template <typename Float>
         struct Traversal final
         {
-            //! The index of the node to be traversed.
+            //! The index of the node, or of the first primitive of a leaf.
             uint32_t i;
 
-            //! Minimum hit time for this node.
-            Float mint;
-
-            //! Constructs an uninitialized instance of a traversal context.
-            constexpr Traversal() noexcept {}
-
-            //! Constructs an initialized traversal context.
-            //! \param i_ The index of the node to be traversed.
-            constexpr Traversal(int i_, Float mint_) noexcept : i(i_), mint(mint_) {}
+            //! The number of primitives in a leaf, or zero for a node.
+            uint32_t count;
         };
 
+        //! The maximum number of entries on the traversal stack.
+        //! Each visited node pushes at most Width - 1 entries more than it
+        //! pops, so this covers wide trees of depth 128 / (Width - 1).
+        constexpr int stack_size = 128;
+
     }  // namespace TraverserImpl
 
     template <
         typename Float,
-        typename Intersector>
-    const Cuboid*
-    Traverser<Float, Intersector>::traverse(
+        typename Intersector,
+        int Width>
+    const CuboidPlanes*
+    Traverser<Float, Intersector, Width>::traverse(
         const OptSegment& segment,
-        const std::vector<vec3>& peeks,
-        const CharacterBounds& bounds)
+        const vec3 (&peeks)[NUM_PEEKS],
+        const CharacterBounds& bounds,
+        TraversalStats& stats) const
     {
-    using Traversal = TraverserImpl::Traversal<Float>;
+    const CuboidPlanes* blocker = NULL;
+    forEachCandidate(
+        segment,
+        [&](const CuboidPlanes& obj)
+        {
+            // Both tests dispatch on obj.Shape, so boxes take slab kernels.
+            Intersection<float> hit = intersector(obj, segment);
+            if (hit)
+            {
+                stats.blocking_tests++;
+                if (
+                    IsBlocking(
+                        peeks,
+                        bounds,
+                        hit.IntersectedP))
+                {
+                    blocker = hit.IntersectedP;
+                    return true;
+                }
+            }
+            return false;
+        },
+        stats);
+    return blocker;
+    }
 
-    // Bounding box min-t/max-t for left/right children at some point in the tree
-    Float bbhits[4];
-    int32_t closer, other;
+    template <
+        typename Float,
+        typename Intersector,
+        int Width>
+    template <typename Visit>
+    bool Traverser<Float, Intersector, Width>::forEachCandidate(
+        const OptSegment& segment,
+        Visit&& visit,
+        TraversalStats& stats) const
+    {
+    using TraverserImpl::Traversal;
+
+    if (node_count == 0)
+    {
+        return false;
+    }
 
     // Working set
-    // WARNING : The working set size is relatively small here, should be made dynamic or template-configurable
-    Traversal todo[64];
+    Traversal todo[TraverserImpl::stack_size];
     int32_t stackptr = 0;
 
     // "Push" on the root node to the working set
     todo[stackptr].i = 0;
-    todo[stackptr].mint = -9999999.f;
-
-    const auto nodes = bvh.getNodes();
-
-    auto build_prims = bvh.getPrimitives();
+    todo[stackptr].count = 0;
 
     while (stackptr >= 0)
     {
         // Pop off the next node to work on.
-        int ni = todo[stackptr].i;
-        Float near = todo[stackptr].mint;
+        const Traversal current = todo[stackptr];
         stackptr--;
-        const auto& node(nodes[ni]);
 
         // Is leaf -> Intersect
-        if (node.isLeaf())
+        if (current.count > 0)
         {
-            for (uint32_t o = 0; o < node.primitive_count; ++o)
+            for (uint32_t o = 0; o < current.count; ++o)
             {
-                const auto& obj = build_prims[node.start + o];
-                Intersection<float> current = intersector(*obj, segment);
-                if (current)
+                if (visit(planes[current.i + o]))
                 {
-                    if (
-                        IsBlocking(
-                            peeks,
-                            bounds,
-                            current.IntersectedP))
-                    {
-                        return current.IntersectedP;
-                    }
+                    return true;
                 }
             }
+            continue;
         }
-        else
-        {  // Not a leaf
 
-            bool hitc0 = nodes[ni + 1].bbox.intersect(segment, bbhits, bbhits + 1);
-            bool hitc1 = nodes[ni + node.right_offset].bbox.intersect(segment, bbhits + 2, bbhits + 3);
+        // Not a leaf: test all children at once.
+        const auto& node = nodes[current.i];
+        stats.nodes++;
+        alignas(32) float tnear[Width];
+        uint32_t mask = intersectChildren(node, segment, tnear);
+        if (mask == 0)
+        {
+            continue;
+        }
 
-            // Did we hit both nodes?
-            if (hitc0 && hitc1)
+        // Sort hit children by entry time, nearest first.
+        int order[Width];
+        int hits = 0;
+        for (int c = 0; c < Width; c++)
+        {
+            if (mask & (1u << c))
             {
-                // We assume that the left child is a closer hit...
-                closer = ni + 1;
-                other = ni + node.right_offset;
-
-                // ... If the right child was actually closer, swap the relevant values.
-                if (bbhits[2] < bbhits[0])
+                int k = hits++;
+                while (k > 0 && tnear[order[k - 1]] > tnear[c])
                 {
-                    std::swap(bbhits[0], bbhits[2]);
-                    std::swap(bbhits[1], bbhits[3]);
-                    std::swap(closer, other);
+                    order[k] = order[k - 1];
+                    k--;
                 }
-
-                // It's possible that the nearest object is still in the other side, but
-                // we'll check the further-away node later...
-
-                // Push the farther first
-                todo[++stackptr] = Traversal(other, bbhits[2]);
-
-                // And now the closer (with overlap test)
-                todo[++stackptr] = Traversal(closer, bbhits[0]);
-            }
-
-            else if (hitc0)
-            {
-                todo[++stackptr] = Traversal(ni + 1, bbhits[0]);
+                order[k] = c;
             }
+        }
 
-            else if (hitc1)
-            {
-                todo[++stackptr] = Traversal(ni + node.right_offset, bbhits[2]);
-            }
+        // Push the farthest first, so the nearest is popped next.
+        for (int k = hits - 1; k >= 0; k--)
+        {
+            const int c = order[k];
+            ++stackptr;
+            todo[stackptr].i = node.child[c];
+            todo[stackptr].count = node.count[c];
         }
     }
-    return NULL;
+    return false;
     }
 }  // namespace FastBVH
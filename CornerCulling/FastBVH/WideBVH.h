@@ -0,0 +1,217 @@
+#pragma once
+
+#include "BVH.h"
+#include "../AlignedAllocator.h"
+#include "../GeometricPrimitives.h"
+
+#include <immintrin.h>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace FastBVH {
+
+//! \brief Node of a collapsed BVH with up to Width children.
+//! Child boxes are stored in SoA layout so that one SIMD slab test
+//! checks a segment against every child at once.
+//! \tparam Width The branching factor, 4 (SSE) or 8 (AVX).
+template <int Width>
+struct alignas(64) WideNode final {
+  //! Bounding boxes of the children, one lane per child.
+  float min_x[Width];
+  float min_y[Width];
+  float min_z[Width];
+  float max_x[Width];
+  float max_y[Width];
+  float max_z[Width];
+
+  //! For inner children, the index of the child node.
+  //! For leaf children, the index of the first primitive.
+  uint32_t child[Width];
+
+  //! The number of primitives in each leaf child,
+  //! or zero if the child is an inner node.
+  uint32_t count[Width];
+
+  //! The number of valid children. Lanes past this are padding.
+  uint32_t child_count;
+};
+
+//! \brief A BVH collapsed from a binary @ref BVH into Width-wide nodes.
+//! Primitive indices are unchanged, so tables indexed like the binary
+//! BVH's primitives (such as the occluder planes) can be reused as-is.
+//! \tparam Width The branching factor, 4 or 8.
+template <int Width>
+class WideBVH final {
+  //! The nodes of the tree. The root is node zero.
+  std::vector<WideNode<Width>, AlignedAllocator<WideNode<Width>, 64>> nodes;
+
+  //! The number of primitives in the whole tree.
+  uint32_t primitive_count = 0;
+
+  //! Collapses the subtree rooted at binary node bi into wide node wi.
+  void collapse(const ConstIterable<Node<float>>& binary, uint32_t bi, uint32_t wi);
+
+ public:
+  //! Builds a wide BVH from a binary BVH.
+  //! \param bvh The binary BVH to collapse.
+  template <typename Primitive>
+  explicit WideBVH(const BVH<float, Primitive>& bvh) : WideBVH(bvh.getNodes()) {}
+
+  //! Builds a wide BVH from the flattened nodes of a binary BVH.
+  //! \param binary The nodes to collapse, root first.
+  explicit WideBVH(const ConstIterable<Node<float>>& binary);
+
+  //! Accesses the nodes of the tree.
+  inline const WideNode<Width>* getNodes() const noexcept { return nodes.data(); }
+
+  //! Indicates the number of nodes in the tree.
+  inline std::size_t size() const noexcept { return nodes.size(); }
+};
+
+template <int Width>
+WideBVH<Width>::WideBVH(const ConstIterable<Node<float>>& binary) {
+  if (binary.size() == 0) {
+    return;
+  }
+  nodes.emplace_back();
+  collapse(binary, 0, 0);
+}
+
+template <int Width>
+void WideBVH<Width>::collapse(const ConstIterable<Node<float>>& binary, uint32_t bi, uint32_t wi) {
+  // Open the binary subtree until there are Width children,
+  // always opening the inner child with the largest surface area.
+  uint32_t open[Width];
+  uint32_t open_count = 0;
+  if (binary[bi].isLeaf()) {
+    open[open_count++] = bi;
+  } else {
+    open[open_count++] = bi + 1;
+    open[open_count++] = bi + binary[bi].right_offset;
+  }
+  while (open_count < Width) {
+    int best = -1;
+    float best_area = -1;
+    for (uint32_t c = 0; c < open_count; c++) {
+      const auto& node = binary[open[c]];
+      if (!node.isLeaf() && node.bbox.surfaceArea() > best_area) {
+        best_area = node.bbox.surfaceArea();
+        best = int(c);
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    uint32_t parent = open[best];
+    open[best] = parent + 1;
+    open[open_count++] = parent + binary[parent].right_offset;
+  }
+
+  uint32_t inner[Width];
+  for (uint32_t c = 0; c < Width; c++) {
+    auto& node = nodes[wi];
+    if (c < open_count) {
+      const auto& child = binary[open[c]];
+      node.min_x[c] = child.bbox.min.x;
+      node.min_y[c] = child.bbox.min.y;
+      node.min_z[c] = child.bbox.min.z;
+      node.max_x[c] = child.bbox.max.x;
+      node.max_y[c] = child.bbox.max.y;
+      node.max_z[c] = child.bbox.max.z;
+      if (child.isLeaf()) {
+        node.child[c] = child.start;
+        node.count[c] = child.primitive_count;
+      } else {
+        node.child[c] = (uint32_t)nodes.size();
+        node.count[c] = 0;
+        nodes.emplace_back();
+      }
+    } else {
+      node.min_x[c] = node.min_y[c] = node.min_z[c] = 0;
+      node.max_x[c] = node.max_y[c] = node.max_z[c] = 0;
+      node.child[c] = 0;
+      node.count[c] = 0;
+    }
+    inner[c] = nodes[wi].count[c] == 0 && c < open_count ? nodes[wi].child[c] : 0;
+  }
+  nodes[wi].child_count = open_count;
+
+  // Binary leaves with zero primitives never occur, so a zero count
+  // always marks an inner child.
+  for (uint32_t c = 0; c < open_count; c++) {
+    if (inner[c] != 0) {
+      collapse(binary, open[c], inner[c]);
+    }
+  }
+}
+
+//! \brief Intersects a segment with every child box of a 4-wide node.
+//! \param node The node whose children are tested.
+//! \param segment The segment being traced.
+//! \param tnear Receives the entry time of each child.
+//! \return A bit mask of the children that the segment hits.
+inline uint32_t intersectChildren(const WideNode<4>& node, const OptSegment& segment, float* tnear) noexcept {
+  const __m128 sx = _mm_set1_ps(segment.Start.x);
+  const __m128 sy = _mm_set1_ps(segment.Start.y);
+  const __m128 sz = _mm_set1_ps(segment.Start.z);
+  const __m128 rx = _mm_set1_ps(segment.Reciprocal.x);
+  const __m128 ry = _mm_set1_ps(segment.Reciprocal.y);
+  const __m128 rz = _mm_set1_ps(segment.Reciprocal.z);
+
+  __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), sx), rx);
+  __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), sx), rx);
+  __m128 tmin = _mm_min_ps(t1, t2);
+  __m128 tmax = _mm_max_ps(t1, t2);
+
+  t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), sy), ry);
+  t2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), sy), ry);
+  tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+  tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+
+  t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), sz), rz);
+  t2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), sz), rz);
+  tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+  tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+
+  const __m128 hit = _mm_and_ps(
+      _mm_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+      _mm_and_ps(_mm_cmp_ps(tmax, _mm_setzero_ps(), _CMP_GE_OQ), _mm_cmp_ps(tmin, _mm_set1_ps(1), _CMP_LE_OQ)));
+  _mm_storeu_ps(tnear, tmin);
+  return uint32_t(_mm_movemask_ps(hit)) & ((1u << node.child_count) - 1);
+}
+
+//! \brief Intersects a segment with every child box of an 8-wide node.
+//! \copydetails intersectChildren(const WideNode<4>&, const OptSegment&, float*)
+inline uint32_t intersectChildren(const WideNode<8>& node, const OptSegment& segment, float* tnear) noexcept {
+  const __m256 sx = _mm256_set1_ps(segment.Start.x);
+  const __m256 sy = _mm256_set1_ps(segment.Start.y);
+  const __m256 sz = _mm256_set1_ps(segment.Start.z);
+  const __m256 rx = _mm256_set1_ps(segment.Reciprocal.x);
+  const __m256 ry = _mm256_set1_ps(segment.Reciprocal.y);
+  const __m256 rz = _mm256_set1_ps(segment.Reciprocal.z);
+
+  __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_x), sx), rx);
+  __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_x), sx), rx);
+  __m256 tmin = _mm256_min_ps(t1, t2);
+  __m256 tmax = _mm256_max_ps(t1, t2);
+
+  t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_y), sy), ry);
+  t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_y), sy), ry);
+  tmin = _mm256_max_ps(tmin, _mm256_min_ps(t1, t2));
+  tmax = _mm256_min_ps(tmax, _mm256_max_ps(t1, t2));
+
+  t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.min_z), sz), rz);
+  t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.max_z), sz), rz);
+  tmin = _mm256_max_ps(tmin, _mm256_min_ps(t1, t2));
+  tmax = _mm256_min_ps(tmax, _mm256_max_ps(t1, t2));
+
+  const __m256 hit = _mm256_and_ps(
+      _mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+      _mm256_and_ps(_mm256_cmp_ps(tmax, _mm256_setzero_ps(), _CMP_GE_OQ),
+                    _mm256_cmp_ps(tmin, _mm256_set1_ps(1), _CMP_LE_OQ)));
+  _mm256_storeu_ps(tnear, tmin);
+  return uint32_t(_mm256_movemask_ps(hit)) & ((1u << node.child_count) - 1);
+}
+
+}  // namespace FastBVH
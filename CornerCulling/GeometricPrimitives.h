@@ -2,10 +2,12 @@
 
 #include <immintrin.h>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <vector>
 #include <glm/glm.hpp>
 #include <glm/vec3.hpp>
-#include <glm/gtx/rotate_vector.hpp>
+#include "AlignedAllocator.h"
 using glm::vec3;
 
 constexpr float PI = 3.141592653589793f;
@@ -14,6 +16,11 @@ constexpr char CUBOID_V = 8;
 constexpr char CUBOID_F = 6;
 // Number of vertices in a face of a cuboid.
 constexpr char CUBOID_FACE_V = 4;
+// Number of peeks in each Bundle.
+constexpr int NUM_PEEKS = 4;
+// Number of vertices in the top and in the bottom half of a character's
+// bounding volume.
+constexpr int CHARACTER_HALF_V = 4;
 
 // Maps a Face with index i's j-th vertex onto a Cuboid vertex index.
 // Faces are indexed as such:
@@ -44,6 +51,7 @@ struct Face
     // Outward normal of the face
 	vec3 Normal = vec3{0, 0, 1};
 
+    Face() {}
     Face(vec3 Point, vec3 Normal)
     {
         this->Point = Point;
@@ -60,7 +68,7 @@ struct Cuboid
     vec3 AABBMin;
     vec3 AABBMax;
     // Faces that define the cuboid
-	std::vector<Face> Faces;
+	Face Faces[CUBOID_F];
 
 	// Constructs a cuboid from a list of vertices.
 	// Vertices are ordered and indexed as such:
@@ -102,7 +110,7 @@ struct Cuboid
             vec3 Normal = glm::normalize(glm::cross(
                 Vertices[FaceCuboidMap[i][1]] - Vertices[FaceCuboidMap[i][0]],
                 Vertices[FaceCuboidMap[i][2]] - Vertices[FaceCuboidMap[i][0]]));
-			Faces.emplace_back(Face(Point, Normal));
+			Faces[i] = Face(Point, Normal);
 		}
 	}
 
@@ -110,9 +118,9 @@ struct Cuboid
 	{
         this->AABBMin = Min;
         this->AABBMax = Max;
-        for (auto F : Faces)
+        for (auto i = 0U; i < Faces.size() && i < CUBOID_F; i++)
         {
-            this->Faces.emplace_back(F);
+            this->Faces[i] = Faces[i];
         }
 	}
 	//Cuboid(const Cuboid& C)
@@ -128,6 +136,189 @@ struct Cuboid
 	//}
 };
 
+// Kind of occluder, which picks the kernels that test it.
+// Boxes are clipped one slab (pair of opposite faces) at a time,
+// which needs a divide per axis instead of one per face.
+enum OccluderShape : uint32_t
+{
+    // Any convex hexahedron, tested face by face.
+    OCCLUDER_GENERAL,
+    // Box whose faces are perpendicular to the world axes.
+    OCCLUDER_AABB,
+    // Box with vertical sides, rotated about the z axis only.
+    OCCLUDER_Z_OBB
+};
+
+// Planes of one occluder, stored for SIMD kernels.
+// Normals are split into SoA lanes, and each face keeps its plane offset
+// dot(Normal, Point), so kernels can broadcast every value straight from
+// memory instead of rebuilding it from Faces.
+// Normal lanes past CUBOID_F are padding for 256-bit loads.
+// Boxes keep their faces in slab order: face a + 3 is face a flipped,
+// so slab a spans -Offsets[a + 3] <= dot(Normal a, Point) <= Offsets[a].
+// AABBs use the x, y and z axes in that order, and Z-rotated OBBs keep
+// the vertical slab last.
+// Records are stored contiguously in BVH primitive order (see OccluderTable),
+// so the planes of leaf primitive i are OccluderTable[i].
+// Records are hashed and written to files byte for byte, so the padding
+// up to the alignment is an explicit, zeroed member.
+struct alignas(64) CuboidPlanes
+{
+    float NormalXs[8];
+    float NormalYs[8];
+    float NormalZs[8];
+    float Offsets[CUBOID_F];
+    OccluderShape Shape;
+    uint32_t Padding = 0;
+
+    CuboidPlanes() {}
+    CuboidPlanes(const Cuboid& C)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            NormalXs[i] = 0;
+            NormalYs[i] = 0;
+            NormalZs[i] = 0;
+        }
+        for (int i = 0; i < CUBOID_F; i++)
+        {
+            SetFace(i, C.Faces[i].Normal, C.Faces[i].Point);
+        }
+        Shape = OCCLUDER_GENERAL;
+        // Faces of the box in slab order.
+        int Order[CUBOID_F];
+        if (!FindSlabs(C, Order))
+        {
+            return;
+        }
+        vec3 Axes[3];
+        for (int a = 0; a < 3; a++)
+        {
+            Axes[a] = C.Faces[Order[a]].Normal;
+        }
+        // Snap the normals, so that each flipped face is exactly
+        // the negation of its partner and slab kernels see the same
+        // planes as the face-by-face kernels.
+        if (AxisOf(Axes[0]) == 0 && AxisOf(Axes[1]) == 1)
+        {
+            Shape = OCCLUDER_AABB;
+            for (int a = 0; a < 3; a++)
+            {
+                Axes[a] = vec3(0);
+                Axes[a][a] = 1;
+            }
+        }
+        else
+        {
+            Shape = OCCLUDER_Z_OBB;
+            for (int a = 0; a < 2; a++)
+            {
+                Axes[a] = glm::normalize(vec3(Axes[a].x, Axes[a].y, 0));
+            }
+            Axes[2] = vec3(0, 0, 1);
+        }
+        for (int a = 0; a < 3; a++)
+        {
+            SetFace(a, Axes[a], C.Faces[Order[a]].Point);
+            SetFace(a + 3, -Axes[a], C.Faces[Order[a + 3]].Point);
+        }
+    }
+
+private:
+    // Largest error, in radians, for which a face counts as parallel
+    // to an axis or to another face. Loose enough for the rounding
+    // of rotated map cuboids, and tight enough that snapping moves
+    // no face by a visible amount.
+    static constexpr float SHAPE_TOLERANCE = 1e-5f;
+
+    void SetFace(int i, const vec3& Normal, const vec3& Point)
+    {
+        NormalXs[i] = Normal.x;
+        NormalYs[i] = Normal.y;
+        NormalZs[i] = Normal.z;
+        Offsets[i] = glm::dot(Normal, Point);
+    }
+
+    // Returns the world axis that Normal points along, or -1.
+    static int AxisOf(const vec3& Normal)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            if (std::fabs(Normal[(a + 1) % 3]) < SHAPE_TOLERANCE
+                && std::fabs(Normal[(a + 2) % 3]) < SHAPE_TOLERANCE)
+            {
+                return a;
+            }
+        }
+        return -1;
+    }
+
+    // Pairs up opposite faces of a box with vertical sides, writing
+    // the face indices in slab order. Returns false for any other shape.
+    static bool FindSlabs(const Cuboid& C, int (&Order)[CUBOID_F])
+    {
+        bool Paired[CUBOID_F] = {};
+        int Horizontal = 0;
+        int Vertical = 0;
+        for (int i = 0; i < CUBOID_F; i++)
+        {
+            if (Paired[i])
+            {
+                continue;
+            }
+            const vec3& Normal = C.Faces[i].Normal;
+            int Flipped = -1;
+            for (int j = i + 1; j < CUBOID_F && Flipped < 0; j++)
+            {
+                if (!Paired[j]
+                    && glm::length(Normal + C.Faces[j].Normal) < SHAPE_TOLERANCE)
+                {
+                    Flipped = j;
+                }
+            }
+            if (Flipped < 0)
+            {
+                return false;
+            }
+            Paired[i] = Paired[Flipped] = true;
+            // The slab's face that points along +x, +y or +z comes first.
+            const int Axis = AxisOf(Normal);
+            const bool Positive = Axis < 0 || Normal[Axis] > 0;
+            int Slab;
+            if (Axis == 2)
+            {
+                Slab = 2;
+                Vertical++;
+            }
+            else if (std::fabs(Normal.z) < SHAPE_TOLERANCE && Horizontal < 2)
+            {
+                Slab = Horizontal++;
+            }
+            else
+            {
+                return false;
+            }
+            Order[Slab] = Positive ? i : Flipped;
+            Order[Slab + 3] = Positive ? Flipped : i;
+        }
+        if (Vertical != 1 || Horizontal != 2)
+        {
+            return false;
+        }
+        // AABBs keep x before y.
+        if (AxisOf(C.Faces[Order[0]].Normal) == 1)
+        {
+            std::swap(Order[0], Order[1]);
+            std::swap(Order[3], Order[4]);
+        }
+        return true;
+    }
+};
+static_assert(sizeof(CuboidPlanes) == 128, "CuboidPlanes must not have implicit padding");
+
+// Contiguous, cache-line aligned table of occluder planes.
+using OccluderTable = std::vector<CuboidPlanes, AlignedAllocator<CuboidPlanes, 64>>;
+
 struct Sphere
 {
     vec3 Center;
@@ -148,16 +339,17 @@ struct Sphere
 // Bundle representing lines of sight between a player's possible peeks
 // and an enemy's bounds. Bounds are stored in a field of
 // the CullingController to prevent data duplication.
+// Peeks are stored inline, so queues of bundles never touch the heap.
 struct Bundle
 {
 	unsigned char PlayerI;
 	unsigned char EnemyI;
-    std::vector<vec3> PossiblePeeks;
-	Bundle(int i, int j, const std::vector<vec3>& Peeks)
+    vec3 PossiblePeeks[NUM_PEEKS];
+    Bundle() {}
+	Bundle(int i, int j)
     {
 		PlayerI = i;
 		EnemyI = j;
-        PossiblePeeks = Peeks;
 	}
 };
 
@@ -178,9 +370,13 @@ struct CharacterBounds
     // a player peeks it from above, and vice versa for peeks from below.
     // This computational shortcut may result in over-aggressive culling
     // in very rare situations.
-    std::vector<vec3> TopVertices;
-    std::vector<vec3> BottomVertices;
-    // We also precalculate and store representations optimized for SIMD.
+    vec3 TopVertices[CHARACTER_HALF_V];
+    vec3 BottomVertices[CHARACTER_HALF_V];
+    // The same vertices laid out for the IsBlocking kernels:
+    // Hull[a][0] holds coordinate a of the top vertices, and Hull[a][1]
+    // of the bottom vertices, in the order of the arrays above.
+    // Needs 16-byte alignment, so vectors of bounds use AlignedAllocator.
+    __m128 Hull[3][2];
     CharacterBounds() : CharacterBounds(0, vec3(), vec3(), 0, 0, 0.0) {}
     CharacterBounds(
         int team, vec3 eyes, vec3 base, float yaw, float pitch, float speed)
@@ -191,27 +387,85 @@ struct CharacterBounds
         Yaw = yaw;
         Pitch = pitch;
         Speed = speed;
-        const vec3 z = vec3(0, 0, 1);
-        const vec3 y = vec3(0, 1, 0);
-        float yawR = yaw * PI / 180;
-        float pitchR = pitch * PI / 180;
-        // Gun barrel. TODO: rotate by pitch.
-        vec3 BarrelExtent = glm::rotate(
-            glm::rotate(vec3(40, 0, 0), pitchR, y),
-            yawR,
-            z);
-        TopVertices.emplace_back(eyes + BarrelExtent);
-        // Body bounding heptahedron.
-        TopVertices.emplace_back(eyes + glm::rotate(vec3( 16,   0, 12), yawR, z));
-        TopVertices.emplace_back(eyes + glm::rotate(vec3(-10, -15, 5), yawR, z));
-        TopVertices.emplace_back(eyes + glm::rotate(vec3(-10,  15, 5), yawR, z));
+        BuildHull();
+    }
+
+    // Computes the vertices from the eyes, base, yaw, pitch and speed,
+    // rotating all 8 of them by the yaw with one set of 256-bit operations.
+    // Lanes 0-3 hold the top vertices, which are offset from the eyes,
+    // and lanes 4-7 the bottom vertices, which are offset from the base.
+    void BuildHull()
+    {
+        const float yawR = Yaw * PI / 180;
+        const float pitchR = Pitch * PI / 180;
+        // Gun barrel, tilted by the pitch before it turns with the yaw.
+        const float BarrelX = std::cos(pitchR) * 40;
+        const float BarrelZ = -std::sin(pitchR) * 40;
         // Radius of the base of the player. Wider when legs are moving.
-        float r = (speed > 0.1f) ? 24.0f : 16.0f;
-        BottomVertices.emplace_back(base + glm::rotate(vec3( r,  r, 0), yawR, z));
-        BottomVertices.emplace_back(base + glm::rotate(vec3(-r,  r, 0), yawR, z));
-        BottomVertices.emplace_back(base + glm::rotate(vec3(-r, -r, 0), yawR, z));
-        BottomVertices.emplace_back(base + glm::rotate(vec3( r, -r, 0), yawR, z));
+        const float r = (Speed > 0.1f) ? 24.0f : 16.0f;
+        // Unrotated offsets of the barrel, the body bounding heptahedron,
+        // and the corners of the base.
+        const __m256 Xs = _mm256_setr_ps(BarrelX, 16, -10, -10,  r, -r, -r,  r);
+        const __m256 Ys = _mm256_setr_ps(      0,  0, -15,  15,  r,  r, -r, -r);
+        const __m256 Zs = _mm256_setr_ps(BarrelZ, 12,   5,   5,  0,  0,  0,  0);
+        const __m256 Cos = _mm256_set1_ps(std::cos(yawR));
+        const __m256 Sin = _mm256_set1_ps(std::sin(yawR));
+        const __m256 Coords[3] =
+        {
+            _mm256_add_ps(
+                _mm256_set_m128(_mm_set1_ps(Base.x), _mm_set1_ps(Eye.x)),
+                _mm256_sub_ps(_mm256_mul_ps(Cos, Xs), _mm256_mul_ps(Sin, Ys))),
+            _mm256_add_ps(
+                _mm256_set_m128(_mm_set1_ps(Base.y), _mm_set1_ps(Eye.y)),
+                _mm256_add_ps(_mm256_mul_ps(Sin, Xs), _mm256_mul_ps(Cos, Ys))),
+            _mm256_add_ps(
+                _mm256_set_m128(_mm_set1_ps(Base.z), _mm_set1_ps(Eye.z)),
+                Zs)
+        };
+        float Vertices[3][2 * CHARACTER_HALF_V];
+        for (int a = 0; a < 3; a++)
+        {
+            Hull[a][0] = _mm256_castps256_ps128(Coords[a]);
+            Hull[a][1] = _mm256_extractf128_ps(Coords[a], 1);
+            _mm256_storeu_ps(Vertices[a], Coords[a]);
+        }
+        for (int v = 0; v < CHARACTER_HALF_V; v++)
+        {
+            TopVertices[v] = vec3(Vertices[0][v], Vertices[1][v], Vertices[2][v]);
+            BottomVertices[v] = vec3(
+                Vertices[0][CHARACTER_HALF_V + v],
+                Vertices[1][CHARACTER_HALF_V + v],
+                Vertices[2][CHARACTER_HALF_V + v]);
+        }
+    }
 
+    // Replaces the vertices with the corners of a box that contains
+    // the bounds wherever they move within Distance in any direction,
+    // so that anything that blocks the box keeps blocking the character
+    // while it moves that far. Aim is not swept.
+    void Sweep(float Distance)
+    {
+        vec3 Min = TopVertices[0];
+        vec3 Max = TopVertices[0];
+        for (int v = 0; v < CHARACTER_HALF_V; v++)
+        {
+            Min = glm::min(Min, glm::min(TopVertices[v], BottomVertices[v]));
+            Max = glm::max(Max, glm::max(TopVertices[v], BottomVertices[v]));
+        }
+        Min -= vec3(Distance);
+        Max += vec3(Distance);
+        TopVertices[0] = vec3(Max.x, Max.y, Max.z);
+        TopVertices[1] = vec3(Min.x, Max.y, Max.z);
+        TopVertices[2] = vec3(Min.x, Min.y, Max.z);
+        TopVertices[3] = vec3(Max.x, Min.y, Max.z);
+        BottomVertices[0] = vec3(Max.x, Max.y, Min.z);
+        BottomVertices[1] = vec3(Min.x, Max.y, Min.z);
+        BottomVertices[2] = vec3(Min.x, Min.y, Min.z);
+        BottomVertices[3] = vec3(Max.x, Min.y, Min.z);
+        Hull[0][0] = Hull[0][1] = _mm_setr_ps(Max.x, Min.x, Min.x, Max.x);
+        Hull[1][0] = Hull[1][1] = _mm_setr_ps(Max.y, Max.y, Min.y, Min.y);
+        Hull[2][0] = _mm_set1_ps(Max.z);
+        Hull[2][1] = _mm_set1_ps(Min.z);
     }
 };
 
@@ -222,19 +476,29 @@ struct CharacterBounds
 // Otherwise, returns NaN.
 // Implements Cyrus-Beck line clipping algorithm from:
 // http://geomalgorithms.com/a13-_intersect-4.html
+inline float SlabIntersectionTime(
+    const CuboidPlanes* C,
+    const vec3& Start,
+    const vec3& Direction,
+    const float MaxTime);
+
 inline float IntersectionTime(
-    const Cuboid* C,
+    const CuboidPlanes* C,
     const vec3& Start,
     const vec3& Direction,
     const float MaxTime = 1)
 {
+    if (C->Shape != OCCLUDER_GENERAL)
+    {
+        return SlabIntersectionTime(C, Start, Direction, MaxTime);
+    }
     float TimeEnter = 0;
     float TimeExit = MaxTime;
     for (int i = 0; i < CUBOID_F; i++)
     {
         // Numerator of a plane/line intersection test.
-        const vec3& Normal = C->Faces[i].Normal;
-        float Num = glm::dot(Normal, (C->Faces[i].Point - Start));
+        const vec3 Normal = vec3(C->NormalXs[i], C->NormalYs[i], C->NormalZs[i]);
+        float Num = C->Offsets[i] - glm::dot(Normal, Start);
         float Denom = glm::dot(Normal, Direction);
         if (Denom == 0)
         {
@@ -268,13 +532,57 @@ inline float IntersectionTime(
     return TimeEnter;
 }
 
+// Same as IntersectionTime, but for boxes: projects the segment onto
+// each slab axis and clips it with both faces of the slab at once.
+// AABB slab axes are the world axes, so they skip the projection.
+inline float SlabIntersectionTime(
+    const CuboidPlanes* C,
+    const vec3& Start,
+    const vec3& Direction,
+    const float MaxTime)
+{
+    float TimeEnter = 0;
+    float TimeExit = MaxTime;
+    for (int a = 0; a < 3; a++)
+    {
+        float S = Start[a];
+        float D = Direction[a];
+        if (C->Shape == OCCLUDER_Z_OBB && a < 2)
+        {
+            S = C->NormalXs[a] * Start.x + C->NormalYs[a] * Start.y;
+            D = C->NormalXs[a] * Direction.x + C->NormalYs[a] * Direction.y;
+        }
+        const float Max = C->Offsets[a];
+        const float Min = -C->Offsets[a + 3];
+        if (D == 0)
+        {
+            // Start is outside of the slab,
+            // so it cannot intersect the box.
+            if (S > Max || S < Min)
+            {
+                return std::numeric_limits<float>::quiet_NaN();
+            }
+            continue;
+        }
+        const float ToMin = (Min - S) / D;
+        const float ToMax = (Max - S) / D;
+        TimeEnter = std::max(TimeEnter, std::min(ToMin, ToMax));
+        TimeExit = std::min(TimeExit, std::max(ToMin, ToMax));
+        if (TimeEnter > TimeExit)
+        {
+            return std::numeric_limits<float>::quiet_NaN();
+        }
+    }
+    return TimeEnter;
+}
+
 // Checks if a Cuboid intersects all line segments between Starts[i]
 // and Ends[i]
 // Implements Cyrus-Beck line clipping algorithm from:
 // http://geomalgorithms.com/a13-_intersect-4.html
 // Uses SIMD for 8x throughput.
 inline bool IntersectsAll(
-    const Cuboid* C,
+    const CuboidPlanes* C,
     __m128 StartXs,
     __m128 StartYs,
     __m128 StartZs,
@@ -287,22 +595,20 @@ inline bool IntersectsAll(
     __m128 ExitTimes = _mm_set1_ps(1);
     for (int i = 0; i < CUBOID_F; i++)
     {
-        const vec3& Normal = C->Faces[i].Normal;
-        __m128 NormalXs = _mm_set1_ps(Normal.x);
-        __m128 NormalYs = _mm_set1_ps(Normal.y);
-        __m128 NormalZs = _mm_set1_ps(Normal.z);
-        const vec3& Vertex = C->Faces[i].Point;
+        __m128 NormalXs = _mm_set1_ps(C->NormalXs[i]);
+        __m128 NormalYs = _mm_set1_ps(C->NormalYs[i]);
+        __m128 NormalZs = _mm_set1_ps(C->NormalZs[i]);
+        __m128 Offsets = _mm_set1_ps(C->Offsets[i]);
+        // Nums = dot(Normal, Point - Start) = Offset - dot(Normal, Start)
 #ifdef __FMA__  
         __m128 Nums =
-            _mm_fmadd_ps(
-                _mm_sub_ps(_mm_set1_ps(Vertex.x), StartXs),
+            _mm_fnmadd_ps(
+                StartXs,
                 NormalXs,
-                _mm_fmadd_ps(
-                    _mm_sub_ps(_mm_set1_ps(Vertex.y), StartYs),
+                _mm_fnmadd_ps(
+                    StartYs,
                     NormalYs,
-                    _mm_mul_ps(
-                        _mm_sub_ps(_mm_set1_ps(Vertex.z), StartZs),
-                        NormalZs)));
+                    _mm_fnmadd_ps(StartZs, NormalZs, Offsets)));
         __m128 Denoms =
             _mm_fmadd_ps(
                 _mm_sub_ps(EndXs, StartXs),
@@ -313,19 +619,13 @@ inline bool IntersectsAll(
                     _mm_mul_ps(_mm_sub_ps(EndZs, StartZs), NormalZs)));
 #else 
         __m128 Nums =
-            _mm_add_ps(
-                _mm_mul_ps(
-                    _mm_sub_ps(_mm_set1_ps(Vertex.x), StartXs),
-                    NormalXs
-                ),
+            _mm_sub_ps(
+                Offsets,
                 _mm_add_ps(
-                    _mm_mul_ps(
-                        _mm_sub_ps(_mm_set1_ps(Vertex.y), StartYs),
-                        NormalYs
-                    ),
-                    _mm_mul_ps(
-                        _mm_sub_ps(_mm_set1_ps(Vertex.z), StartZs),
-                        NormalZs)));
+                    _mm_mul_ps(StartXs, NormalXs),
+                    _mm_add_ps(
+                        _mm_mul_ps(StartYs, NormalYs),
+                        _mm_mul_ps(StartZs, NormalZs))));
         __m128 Denoms =
             _mm_add_ps(
                 _mm_mul_ps(
@@ -368,46 +668,146 @@ inline bool IntersectsAll(
     return true;
 }
 
+// Returns the smallest depth inside the Cuboid of the middles of the parts
+// of the segments from Starts[i] to Ends[i] that it clips,
+// or zero if any segment misses the Cuboid.
+// Depth is the distance to the nearest face, as normals are unit length.
+inline float MinMiddleDepth(
+    const CuboidPlanes* C,
+    __m256 StartXs,
+    __m256 StartYs,
+    __m256 StartZs,
+    __m256 EndXs,
+    __m256 EndYs,
+    __m256 EndZs)
+{
+    const __m256 Zero = _mm256_set1_ps(0);
+    const __m256 DeltaXs = _mm256_sub_ps(EndXs, StartXs);
+    const __m256 DeltaYs = _mm256_sub_ps(EndYs, StartYs);
+    const __m256 DeltaZs = _mm256_sub_ps(EndZs, StartZs);
+    const __m256 One = _mm256_set1_ps(1);
+    __m256 EnterTimes = Zero;
+    __m256 ExitTimes = One;
+    for (int i = 0; i < CUBOID_F; i++)
+    {
+        const __m256 NormalXs = _mm256_set1_ps(C->NormalXs[i]);
+        const __m256 NormalYs = _mm256_set1_ps(C->NormalYs[i]);
+        const __m256 NormalZs = _mm256_set1_ps(C->NormalZs[i]);
+        const __m256 Nums =
+            _mm256_sub_ps(
+                _mm256_set1_ps(C->Offsets[i]),
+                _mm256_add_ps(
+                    _mm256_mul_ps(StartXs, NormalXs),
+                    _mm256_add_ps(
+                        _mm256_mul_ps(StartYs, NormalYs),
+                        _mm256_mul_ps(StartZs, NormalZs))));
+        const __m256 Denoms =
+            _mm256_add_ps(
+                _mm256_mul_ps(DeltaXs, NormalXs),
+                _mm256_add_ps(
+                    _mm256_mul_ps(DeltaYs, NormalYs),
+                    _mm256_mul_ps(DeltaZs, NormalZs)));
+        // A segment is parallel to and outside of a face.
+        if (0 !=
+            _mm256_movemask_ps(
+                _mm256_and_ps(
+                    _mm256_cmp_ps(Denoms, Zero, _CMP_EQ_OQ),
+                    _mm256_cmp_ps(Nums, Zero, _CMP_LE_OQ))))
+        {
+            return 0;
+        }
+        // Approximate times are safe: the depth below is measured at
+        // the point actually chosen, which is zero if it is outside.
+        // Masks rather than blends, which GCC scalarizes without AVX2.
+        // Masked-off entry times become 0 and exit times become 1,
+        // which cannot tighten the interval.
+        const __m256 Times = _mm256_mul_ps(Nums, _mm256_rcp_ps(Denoms));
+        const __m256 ExitMask = _mm256_cmp_ps(Denoms, Zero, _CMP_GT_OS);
+        EnterTimes = _mm256_max_ps(
+            EnterTimes,
+            _mm256_and_ps(_mm256_cmp_ps(Denoms, Zero, _CMP_LT_OS), Times));
+        ExitTimes = _mm256_min_ps(
+            ExitTimes,
+            _mm256_or_ps(
+                _mm256_and_ps(ExitMask, Times),
+                _mm256_andnot_ps(ExitMask, One)));
+    }
+    if (0 != _mm256_movemask_ps(_mm256_cmp_ps(EnterTimes, ExitTimes, _CMP_GT_OS)))
+    {
+        return 0;
+    }
+    const __m256 MiddleTimes =
+        _mm256_mul_ps(_mm256_add_ps(EnterTimes, ExitTimes), _mm256_set1_ps(0.5f));
+    const __m256 MiddleXs = _mm256_add_ps(StartXs, _mm256_mul_ps(MiddleTimes, DeltaXs));
+    const __m256 MiddleYs = _mm256_add_ps(StartYs, _mm256_mul_ps(MiddleTimes, DeltaYs));
+    const __m256 MiddleZs = _mm256_add_ps(StartZs, _mm256_mul_ps(MiddleTimes, DeltaZs));
+    __m256 Depths = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    for (int i = 0; i < CUBOID_F; i++)
+    {
+        Depths = _mm256_min_ps(
+            Depths,
+            _mm256_sub_ps(
+                _mm256_set1_ps(C->Offsets[i]),
+                _mm256_add_ps(
+                    _mm256_mul_ps(MiddleXs, _mm256_set1_ps(C->NormalXs[i])),
+                    _mm256_add_ps(
+                        _mm256_mul_ps(MiddleYs, _mm256_set1_ps(C->NormalYs[i])),
+                        _mm256_mul_ps(MiddleZs, _mm256_set1_ps(C->NormalZs[i]))))));
+    }
+    __m128 Min = _mm_min_ps(_mm256_castps256_ps128(Depths), _mm256_extractf128_ps(Depths, 1));
+    Min = _mm_min_ps(Min, _mm_shuffle_ps(Min, Min, _MM_SHUFFLE(1, 0, 3, 2)));
+    Min = _mm_min_ps(Min, _mm_shuffle_ps(Min, Min, _MM_SHUFFLE(2, 3, 0, 1)));
+    return std::max(0.0f, _mm_cvtss_f32(Min));
+}
+
+// Returns a margin by which a Cuboid that blocks a bundle is known to keep
+// blocking it: every segment from a peek to an enemy vertex passes through
+// a point at least this deep inside the Cuboid. A point on a segment moves
+// no further than its endpoints, so moving each peek and vertex by less
+// than the margin keeps all of those points inside.
+// Returns zero if the Cuboid does not block the bundle.
+inline float BlockingMargin(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C)
+{
+    // Each pass pairs two peeks with the four vertices of one half.
+    float Margin = std::numeric_limits<float>::infinity();
+    for (int h = 0; h < 2 && Margin > 0; h++)
+    {
+        const vec3& P = Peeks[2 * h];
+        const vec3& Q = Peeks[2 * h + 1];
+        Margin = std::min(
+            Margin,
+            MinMiddleDepth(
+                C,
+                _mm256_set_ps(P.x, P.x, P.x, P.x, Q.x, Q.x, Q.x, Q.x),
+                _mm256_set_ps(P.y, P.y, P.y, P.y, Q.y, Q.y, Q.y, Q.y),
+                _mm256_set_ps(P.z, P.z, P.z, P.z, Q.z, Q.z, Q.z, Q.z),
+                _mm256_set_m128(Bounds.Hull[0][h], Bounds.Hull[0][h]),
+                _mm256_set_m128(Bounds.Hull[1][h], Bounds.Hull[1][h]),
+                _mm256_set_m128(Bounds.Hull[2][h], Bounds.Hull[2][h])));
+    }
+    return Margin;
+}
+
 // Checks if the Cuboid blocks visibility between a player and enemy,
 // returning true if and only if all lines of sights from the player's possible
 // peeks are blocked.
 // Assumes that the BottomVerticies of the enemy bounding box are directly below
 // the TopVerticies.
-inline bool IsBlocking(
-    const std::vector<vec3>& Peeks,
+// Baseline kernel that tests one peek (4 segments) per IntersectsAll call.
+inline bool IsBlockingSSE(
+    const vec3 (&Peeks)[NUM_PEEKS],
     const CharacterBounds& Bounds,
-    const Cuboid* C)
+    const CuboidPlanes* C)
 {
-    auto TopVerticesXs = _mm_set_ps(
-        Bounds.TopVertices[0].x, 
-        Bounds.TopVertices[1].x,
-        Bounds.TopVertices[2].x,
-        Bounds.TopVertices[3].x);
-    auto TopVerticesYs = _mm_set_ps(
-        Bounds.TopVertices[0].y, 
-        Bounds.TopVertices[1].y,
-        Bounds.TopVertices[2].y,
-        Bounds.TopVertices[3].y);
-    auto TopVerticesZs = _mm_set_ps(
-        Bounds.TopVertices[0].z, 
-        Bounds.TopVertices[1].z,
-        Bounds.TopVertices[2].z,
-        Bounds.TopVertices[3].z);
-    auto BottomVerticesXs = _mm_set_ps(
-        Bounds.BottomVertices[0].x, 
-        Bounds.BottomVertices[1].x,
-        Bounds.BottomVertices[2].x,
-        Bounds.BottomVertices[3].x);
-    auto BottomVerticesYs = _mm_set_ps(
-        Bounds.BottomVertices[0].y, 
-        Bounds.BottomVertices[1].y,
-        Bounds.BottomVertices[2].y,
-        Bounds.BottomVertices[3].y);
-    auto BottomVerticesZs = _mm_set_ps(
-        Bounds.BottomVertices[0].z, 
-        Bounds.BottomVertices[1].z,
-        Bounds.BottomVertices[2].z,
-        Bounds.BottomVertices[3].z);
+    const __m128 TopVerticesXs = Bounds.Hull[0][0];
+    const __m128 TopVerticesYs = Bounds.Hull[1][0];
+    const __m128 TopVerticesZs = Bounds.Hull[2][0];
+    const __m128 BottomVerticesXs = Bounds.Hull[0][1];
+    const __m128 BottomVerticesYs = Bounds.Hull[1][1];
+    const __m128 BottomVerticesZs = Bounds.Hull[2][1];
 
     auto StartXs = _mm_set_ps1(Peeks[0].x);
     auto StartYs = _mm_set_ps1(Peeks[0].y);
@@ -456,32 +856,438 @@ inline bool IsBlocking(
     return true;
 }
 
+// Slab bounds and rotation of a box, broadcast across the lanes of the
+// slab kernels.
+template <OccluderShape Shape>
+struct BoxSlabs
+{
+    __m256 Mins[3];
+    __m256 Maxs[3];
+    // Horizontal slab axes of Z-rotated boxes.
+    __m256 Cos[2];
+    __m256 Sin[2];
+
+    explicit BoxSlabs(const CuboidPlanes* C)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            Maxs[a] = _mm256_broadcast_ss(&C->Offsets[a]);
+            Mins[a] = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_broadcast_ss(&C->Offsets[a + 3]));
+        }
+        for (int a = 0; Shape == OCCLUDER_Z_OBB && a < 2; a++)
+        {
+            Cos[a] = _mm256_broadcast_ss(&C->NormalXs[a]);
+            Sin[a] = _mm256_broadcast_ss(&C->NormalYs[a]);
+        }
+    }
+};
+
+// Checks if a box intersects all 8 line segments from Starts[i] to
+// Starts[i] + Deltas[i], given in its slab axes, clipping them with
+// one slab per pass. Agrees with IntersectsAll on the same planes.
+template <OccluderShape Shape>
+inline bool IntersectsAllSlabs(
+    const BoxSlabs<Shape>& Slabs,
+    const __m256 (&Starts)[3],
+    const __m256 (&Deltas)[3])
+{
+    const __m256 Zero = _mm256_setzero_ps();
+    __m256 EnterTimes = Zero;
+    __m256 ExitTimes = _mm256_set1_ps(1);
+    for (int a = 0; a < 3; a++)
+    {
+        // Distances from the starts to the far and near sides of the slab.
+        const __m256 ToMaxs = _mm256_sub_ps(Slabs.Maxs[a], Starts[a]);
+        const __m256 ToMins = _mm256_sub_ps(Slabs.Mins[a], Starts[a]);
+        // A line segment is parallel to and outside of the slab.
+        if (0 !=
+            _mm256_movemask_ps(
+                _mm256_and_ps(
+                    _mm256_cmp_ps(Deltas[a], Zero, _CMP_EQ_OQ),
+                    _mm256_or_ps(
+                        _mm256_cmp_ps(ToMaxs, Zero, _CMP_LE_OQ),
+                        _mm256_cmp_ps(ToMins, Zero, _CMP_GE_OQ)))))
+        {
+            return false;
+        }
+        // Parallel segments inside the slab get infinite times,
+        // which cannot tighten the interval.
+        const __m256 Inverses = _mm256_div_ps(_mm256_set1_ps(1), Deltas[a]);
+        const __m256 MinTimes = _mm256_mul_ps(ToMins, Inverses);
+        const __m256 MaxTimes = _mm256_mul_ps(ToMaxs, Inverses);
+        EnterTimes = _mm256_max_ps(EnterTimes, _mm256_min_ps(MinTimes, MaxTimes));
+        ExitTimes = _mm256_min_ps(ExitTimes, _mm256_max_ps(MinTimes, MaxTimes));
+        if (0 !=
+            _mm256_movemask_ps(_mm256_cmp_ps(EnterTimes, ExitTimes, _CMP_GT_OS)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Tests the segments from two peeks to the same 4 hull vertices,
+// the top (Half 0) or bottom (Half 1) of Bounds.Hull, against a box.
+// Lanes 0-3 start at PeekA and lanes 4-7 start at PeekB.
+// Z-rotated boxes first rotate the segments into the box's frame.
+template <OccluderShape Shape>
+inline bool IsBlockingBoxPeekPair(
+    const BoxSlabs<Shape>& Slabs,
+    const vec3& PeekA,
+    const vec3& PeekB,
+    const CharacterBounds& Bounds,
+    int Half)
+{
+    __m256 Starts[3];
+    __m256 Deltas[3];
+    for (int a = 0; a < 3; a++)
+    {
+        const __m128 Ends = Bounds.Hull[a][Half];
+        Starts[a] = _mm256_set_m128(_mm_set1_ps(PeekB[a]), _mm_set1_ps(PeekA[a]));
+        Deltas[a] = _mm256_sub_ps(_mm256_set_m128(Ends, Ends), Starts[a]);
+    }
+    if (Shape == OCCLUDER_Z_OBB)
+    {
+        const __m256 Xs = Starts[0];
+        const __m256 Ys = Starts[1];
+        const __m256 DeltaXs = Deltas[0];
+        const __m256 DeltaYs = Deltas[1];
+        for (int a = 0; a < 2; a++)
+        {
+            Starts[a] = _mm256_add_ps(
+                _mm256_mul_ps(Xs, Slabs.Cos[a]), _mm256_mul_ps(Ys, Slabs.Sin[a]));
+            Deltas[a] = _mm256_add_ps(
+                _mm256_mul_ps(DeltaXs, Slabs.Cos[a]), _mm256_mul_ps(DeltaYs, Slabs.Sin[a]));
+        }
+    }
+    return IntersectsAllSlabs(Slabs, Starts, Deltas);
+}
+
+// Checks if a box blocks visibility with two 8-wide slab passes:
+// top peeks against top vertices, then bottom peeks against bottom vertices.
+template <OccluderShape Shape>
+inline bool IsBlockingBox(
+    const BoxSlabs<Shape>& Slabs,
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds)
+{
+    return
+        IsBlockingBoxPeekPair(Slabs, Peeks[0], Peeks[1], Bounds, 0)
+        && IsBlockingBoxPeekPair(Slabs, Peeks[2], Peeks[3], Bounds, 1);
+}
+
+// IsBlocking kernels for AABBs and Z-rotated boxes.
+inline bool IsBlockingAABB(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C)
+{
+    return IsBlockingBox(BoxSlabs<OCCLUDER_AABB>(C), Peeks, Bounds);
+}
+
+inline bool IsBlockingZOBB(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C)
+{
+    return IsBlockingBox(BoxSlabs<OCCLUDER_Z_OBB>(C), Peeks, Bounds);
+}
+
+// Wider IsBlocking kernels, selected at runtime by the host's instruction set.
+// They need per-function target attributes, so they are GCC/Clang only.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define CULLING_WIDE_KERNELS
+
+// Same as IsBlockingSSE, but tests both top peeks (8 segments) with each
+// 256-bit instruction, so a cuboid takes two passes instead of four.
+__attribute__((target("avx2,fma")))
+inline bool IntersectsAll8(
+    const CuboidPlanes* C,
+    __m256 StartXs,
+    __m256 StartYs,
+    __m256 StartZs,
+    __m256 EndXs,
+    __m256 EndYs,
+    __m256 EndZs)
+{
+    const __m256 Zero = _mm256_setzero_ps();
+    __m256 EnterTimes = Zero;
+    __m256 ExitTimes = _mm256_set1_ps(1);
+    const __m256 DeltaXs = _mm256_sub_ps(EndXs, StartXs);
+    const __m256 DeltaYs = _mm256_sub_ps(EndYs, StartYs);
+    const __m256 DeltaZs = _mm256_sub_ps(EndZs, StartZs);
+    for (int i = 0; i < CUBOID_F; i++)
+    {
+        __m256 NormalXs = _mm256_broadcast_ss(&C->NormalXs[i]);
+        __m256 NormalYs = _mm256_broadcast_ss(&C->NormalYs[i]);
+        __m256 NormalZs = _mm256_broadcast_ss(&C->NormalZs[i]);
+        __m256 Nums =
+            _mm256_fnmadd_ps(
+                StartXs,
+                NormalXs,
+                _mm256_fnmadd_ps(
+                    StartYs,
+                    NormalYs,
+                    _mm256_fnmadd_ps(
+                        StartZs,
+                        NormalZs,
+                        _mm256_broadcast_ss(&C->Offsets[i]))));
+        __m256 Denoms =
+            _mm256_fmadd_ps(
+                DeltaXs,
+                NormalXs,
+                _mm256_fmadd_ps(
+                    DeltaYs,
+                    NormalYs,
+                    _mm256_mul_ps(DeltaZs, NormalZs)));
+        // A line segment is parallel to and outside of a face.
+        if (0 !=
+            _mm256_movemask_ps(
+                _mm256_and_ps(
+                    _mm256_cmp_ps(Denoms, Zero, _CMP_EQ_OQ),
+                    _mm256_cmp_ps(Nums, Zero, _CMP_LE_OQ))))
+        {
+            return false;
+        }
+        __m256 Times = _mm256_div_ps(Nums, Denoms);
+        EnterTimes = _mm256_blendv_ps(
+            EnterTimes,
+            _mm256_max_ps(EnterTimes, Times),
+            _mm256_cmp_ps(Denoms, Zero, _CMP_LT_OS));
+        ExitTimes = _mm256_blendv_ps(
+            ExitTimes,
+            _mm256_min_ps(ExitTimes, Times),
+            _mm256_cmp_ps(Denoms, Zero, _CMP_GT_OS));
+        if (0 !=
+            _mm256_movemask_ps(_mm256_cmp_ps(EnterTimes, ExitTimes, _CMP_GT_OS)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Tests the segments from two peeks to the same 4 hull vertices,
+// the top (Half 0) or bottom (Half 1) of Bounds.Hull.
+// Lanes 0-3 start at PeekA and lanes 4-7 start at PeekB.
+__attribute__((target("avx2,fma")))
+inline bool IsBlockingPeekPair8(
+    const CuboidPlanes* C,
+    const vec3& PeekA,
+    const vec3& PeekB,
+    const CharacterBounds& Bounds,
+    int Half)
+{
+    const __m128 EndXs = Bounds.Hull[0][Half];
+    const __m128 EndYs = Bounds.Hull[1][Half];
+    const __m128 EndZs = Bounds.Hull[2][Half];
+    return IntersectsAll8(
+        C,
+        _mm256_set_m128(_mm_set1_ps(PeekB.x), _mm_set1_ps(PeekA.x)),
+        _mm256_set_m128(_mm_set1_ps(PeekB.y), _mm_set1_ps(PeekA.y)),
+        _mm256_set_m128(_mm_set1_ps(PeekB.z), _mm_set1_ps(PeekA.z)),
+        _mm256_set_m128(EndXs, EndXs),
+        _mm256_set_m128(EndYs, EndYs),
+        _mm256_set_m128(EndZs, EndZs));
+}
+
+// Checks if the Cuboid blocks visibility with two 8-wide passes:
+// top peeks against top vertices, then bottom peeks against bottom vertices.
+__attribute__((target("avx2,fma")))
+inline bool IsBlockingAVX2(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C)
+{
+    return
+        IsBlockingPeekPair8(C, Peeks[0], Peeks[1], Bounds, 0)
+        && IsBlockingPeekPair8(C, Peeks[2], Peeks[3], Bounds, 1);
+}
+
+// Spreads a hull's top vertices over lanes 0-7 and its bottom vertices
+// over lanes 8-15.
+__attribute__((target("avx512f")))
+inline __m512 HullLanes16(const __m128& Top, const __m128& Bottom)
+{
+    __m512 Lanes = _mm512_castps128_ps512(Top);
+    Lanes = _mm512_insertf32x4(Lanes, Top, 1);
+    Lanes = _mm512_insertf32x4(Lanes, Bottom, 2);
+    return _mm512_insertf32x4(Lanes, Bottom, 3);
+}
+
+// Checks if the Cuboid blocks visibility with a single 16-wide pass over
+// every peek-to-vertex segment. Lanes 0-7 hold the top peeks and top
+// vertices, lanes 8-15 the bottom peeks and bottom vertices.
+__attribute__((target("avx512f")))
+inline bool IsBlockingAVX512(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C)
+{
+    const __m512 StartXs = _mm512_setr_ps(
+        Peeks[0].x, Peeks[0].x, Peeks[0].x, Peeks[0].x,
+        Peeks[1].x, Peeks[1].x, Peeks[1].x, Peeks[1].x,
+        Peeks[2].x, Peeks[2].x, Peeks[2].x, Peeks[2].x,
+        Peeks[3].x, Peeks[3].x, Peeks[3].x, Peeks[3].x);
+    const __m512 StartYs = _mm512_setr_ps(
+        Peeks[0].y, Peeks[0].y, Peeks[0].y, Peeks[0].y,
+        Peeks[1].y, Peeks[1].y, Peeks[1].y, Peeks[1].y,
+        Peeks[2].y, Peeks[2].y, Peeks[2].y, Peeks[2].y,
+        Peeks[3].y, Peeks[3].y, Peeks[3].y, Peeks[3].y);
+    const __m512 StartZs = _mm512_setr_ps(
+        Peeks[0].z, Peeks[0].z, Peeks[0].z, Peeks[0].z,
+        Peeks[1].z, Peeks[1].z, Peeks[1].z, Peeks[1].z,
+        Peeks[2].z, Peeks[2].z, Peeks[2].z, Peeks[2].z,
+        Peeks[3].z, Peeks[3].z, Peeks[3].z, Peeks[3].z);
+    const __m512 DeltaXs = _mm512_sub_ps(
+        HullLanes16(Bounds.Hull[0][0], Bounds.Hull[0][1]),
+        StartXs);
+    const __m512 DeltaYs = _mm512_sub_ps(
+        HullLanes16(Bounds.Hull[1][0], Bounds.Hull[1][1]),
+        StartYs);
+    const __m512 DeltaZs = _mm512_sub_ps(
+        HullLanes16(Bounds.Hull[2][0], Bounds.Hull[2][1]),
+        StartZs);
+    const __m512 Zero = _mm512_setzero_ps();
+    __m512 EnterTimes = Zero;
+    __m512 ExitTimes = _mm512_set1_ps(1);
+    for (int i = 0; i < CUBOID_F; i++)
+    {
+        __m512 NormalXs = _mm512_set1_ps(C->NormalXs[i]);
+        __m512 NormalYs = _mm512_set1_ps(C->NormalYs[i]);
+        __m512 NormalZs = _mm512_set1_ps(C->NormalZs[i]);
+        __m512 Nums =
+            _mm512_fnmadd_ps(
+                StartXs,
+                NormalXs,
+                _mm512_fnmadd_ps(
+                    StartYs,
+                    NormalYs,
+                    _mm512_fnmadd_ps(
+                        StartZs,
+                        NormalZs,
+                        _mm512_set1_ps(C->Offsets[i]))));
+        __m512 Denoms =
+            _mm512_fmadd_ps(
+                DeltaXs,
+                NormalXs,
+                _mm512_fmadd_ps(
+                    DeltaYs,
+                    NormalYs,
+                    _mm512_mul_ps(DeltaZs, NormalZs)));
+        // A line segment is parallel to and outside of a face.
+        if (0 !=
+            _mm512_mask_cmp_ps_mask(
+                _mm512_cmp_ps_mask(Denoms, Zero, _CMP_EQ_OQ),
+                Nums,
+                Zero,
+                _CMP_LE_OQ))
+        {
+            return false;
+        }
+        __m512 Times = _mm512_div_ps(Nums, Denoms);
+        EnterTimes = _mm512_mask_max_ps(
+            EnterTimes,
+            _mm512_cmp_ps_mask(Denoms, Zero, _CMP_LT_OS),
+            EnterTimes,
+            Times);
+        ExitTimes = _mm512_mask_min_ps(
+            ExitTimes,
+            _mm512_cmp_ps_mask(Denoms, Zero, _CMP_GT_OS),
+            ExitTimes,
+            Times);
+        if (0 != _mm512_cmp_ps_mask(EnterTimes, ExitTimes, _CMP_GT_OS))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// Signature shared by all cuboid IsBlocking kernels.
+using CuboidBlockingKernel = bool (*)(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C);
+
+// Widest IsBlocking kernel that can be selected, in SIMD lanes.
+enum class KernelWidth
+{
+    SSE = 4,
+    AVX2 = 8,
+    AVX512 = 16
+};
+
+// Returns the widest kernel that both the host CPU and MaxWidth allow.
+inline CuboidBlockingKernel SelectCuboidBlockingKernel(
+    KernelWidth MaxWidth = KernelWidth::AVX512)
+{
+#ifdef CULLING_WIDE_KERNELS
+    __builtin_cpu_init();
+    if (MaxWidth >= KernelWidth::AVX512 && __builtin_cpu_supports("avx512f"))
+    {
+        return &IsBlockingAVX512;
+    }
+    if (MaxWidth >= KernelWidth::AVX2
+        && __builtin_cpu_supports("avx2")
+        && __builtin_cpu_supports("fma"))
+    {
+        return &IsBlockingAVX2;
+    }
+#endif
+    return &IsBlockingSSE;
+}
+
+// Kernel used by IsBlocking. Chosen on first use; since statics are not
+// thread-safe in this build, the first call must come before any worker
+// thread culls (the CullingController constructor makes it).
+inline CuboidBlockingKernel& ActiveCuboidBlockingKernel()
+{
+    static CuboidBlockingKernel Kernel = SelectCuboidBlockingKernel();
+    return Kernel;
+}
+
+// Checks if the Cuboid blocks visibility between a player and enemy,
+// returning true if and only if all lines of sights from the player's possible
+// peeks are blocked. Boxes go to their slab kernels, and other occluders
+// to the widest kernel the host supports.
+inline bool IsBlocking(
+    const vec3 (&Peeks)[NUM_PEEKS],
+    const CharacterBounds& Bounds,
+    const CuboidPlanes* C)
+{
+    switch (C->Shape)
+    {
+        case OCCLUDER_AABB:
+            return IsBlockingAABB(Peeks, Bounds, C);
+        case OCCLUDER_Z_OBB:
+            return IsBlockingZOBB(Peeks, Bounds, C);
+        default:
+            return ActiveCuboidBlockingKernel()(Peeks, Bounds, C);
+    }
+}
+
 // Checks sphere intersection for all line segments between
 // a player's possible peeks and the vertices of an enemy's bounding box.
 // Uses sphere and line segment intersection with formula from:
 // http://paulbourke.net/geometry/circlesphere/index.html#linesphere
 inline bool IsBlocking(
-    const std::vector<vec3>& Peeks,
+    const vec3 (&Peeks)[NUM_PEEKS],
     const CharacterBounds& Bounds,
     const Sphere& OccludingSphere)
 {
     // Unpack constant variables outside of loop for performance.
     const vec3 SphereCenter = OccludingSphere.Center;
     const float RadiusSquared = OccludingSphere.Radius * OccludingSphere.Radius;
-    for (auto i = 0U; i < Peeks.size(); i++)
+    for (int i = 0; i < NUM_PEEKS; i++)
     {
         vec3 PlayerToSphere = SphereCenter - Peeks[i];
-        std::vector<vec3> Vertices;
-        if (i < 2)
-        {
-            Vertices = Bounds.TopVertices;
-        }
-        else
-        {
-            Vertices = Bounds.BottomVertices;
-        }
-        for (vec3 V : Vertices)
+        const vec3* Vertices =
+            (i < 2) ? Bounds.TopVertices : Bounds.BottomVertices;
+        for (int v = 0; v < CHARACTER_HALF_V; v++)
         {
+            const vec3& V = Vertices[v];
             const vec3 PlayerToEnemy = V - Peeks[i];
             const float u = (
                 glm::dot(PlayerToEnemy, PlayerToSphere)
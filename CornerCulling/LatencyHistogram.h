@@ -0,0 +1,120 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+/**
+ *  Histogram of durations in nanoseconds, in the style of HdrHistogram.
+ *  Values below 16 get their own bucket. Above that, each power of two
+ *  is split into 16 linear buckets, so percentiles are accurate to within
+ *  1/16 (about 6%) at any scale, from nanoseconds to minutes.
+ *  Recording is wait-free, and reads may run concurrently with it.
+ */
+class LatencyHistogram
+{
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // Largest tracked power of two, about 18 minutes in nanoseconds.
+    // Longer durations are counted as this long.
+    static constexpr int MAX_POWER = 40;
+    static constexpr int NUM_BUCKETS = SUB_BUCKETS * (MAX_POWER - SUB_BUCKET_BITS + 2);
+
+    std::atomic<uint64_t> Counts[NUM_BUCKETS];
+    std::atomic<uint64_t> TotalCount{0};
+    std::atomic<uint64_t> Sum{0};
+    std::atomic<uint64_t> MaxValue{0};
+
+    static int BucketOf(uint64_t Value)
+    {
+        if (Value < SUB_BUCKETS)
+        {
+            return int(Value);
+        }
+        if (Value >= (uint64_t(2) << MAX_POWER))
+        {
+            return NUM_BUCKETS - 1;
+        }
+#ifdef __GNUC__
+        int Power = 63 - __builtin_clzll(Value);
+#else
+        int Power = SUB_BUCKET_BITS;
+        while ((Value >> (Power + 1)) != 0)
+        {
+            Power++;
+        }
+#endif
+        int Shift = Power - SUB_BUCKET_BITS;
+        return SUB_BUCKETS * (Shift + 1) + int(Value >> Shift) - SUB_BUCKETS;
+    }
+
+    // Largest value that falls in a bucket.
+    static uint64_t UpperBoundOf(int Bucket)
+    {
+        if (Bucket < SUB_BUCKETS)
+        {
+            return uint64_t(Bucket);
+        }
+        int Shift = Bucket / SUB_BUCKETS - 1;
+        uint64_t Sub = uint64_t(Bucket % SUB_BUCKETS + SUB_BUCKETS);
+        return ((Sub + 1) << Shift) - 1;
+    }
+
+public:
+    LatencyHistogram() { Reset(); }
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void Record(uint64_t Nanoseconds)
+    {
+        Counts[BucketOf(Nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+        TotalCount.fetch_add(1, std::memory_order_relaxed);
+        Sum.fetch_add(Nanoseconds, std::memory_order_relaxed);
+        uint64_t Max = MaxValue.load(std::memory_order_relaxed);
+        while (Nanoseconds > Max
+               && !MaxValue.compare_exchange_weak(Max, Nanoseconds, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void Reset()
+    {
+        for (auto& Count : Counts)
+        {
+            Count.store(0, std::memory_order_relaxed);
+        }
+        TotalCount.store(0, std::memory_order_relaxed);
+        Sum.store(0, std::memory_order_relaxed);
+        MaxValue.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t Count() const { return TotalCount.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return MaxValue.load(std::memory_order_relaxed); }
+    double Mean() const
+    {
+        uint64_t N = Count();
+        return N == 0 ? 0 : double(Sum.load(std::memory_order_relaxed)) / double(N);
+    }
+
+    // Returns a value that at least Percent percent of recorded values
+    // are no greater than, rounded up to the end of its bucket.
+    uint64_t Percentile(double Percent) const
+    {
+        const uint64_t N = Count();
+        if (N == 0)
+        {
+            return 0;
+        }
+        uint64_t Rank = uint64_t(Percent / 100 * double(N) + 0.5);
+        Rank = Rank < 1 ? 1 : Rank;
+        uint64_t Seen = 0;
+        for (int b = 0; b < NUM_BUCKETS; b++)
+        {
+            Seen += Counts[b].load(std::memory_order_relaxed);
+            if (Seen >= Rank)
+            {
+                uint64_t Bound = UpperBoundOf(b);
+                return Bound < Max() ? Bound : Max();
+            }
+        }
+        return Max();
+    }
+};
@@ -0,0 +1,102 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const char* fileName)
+{
+    Close();
+    HANDLE File = CreateFileA(
+        fileName,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (File == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER FileSize;
+    if (!GetFileSizeEx(File, &FileSize) || FileSize.QuadPart == 0)
+    {
+        CloseHandle(File);
+        return false;
+    }
+    HANDLE Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+    // The view keeps the mapping alive, so neither handle is needed after.
+    CloseHandle(File);
+    if (Mapping == NULL)
+    {
+        return false;
+    }
+    const void* View = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(Mapping);
+    if (View == NULL)
+    {
+        return false;
+    }
+    Data = View;
+    Size = size_t(FileSize.QuadPart);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (Data != NULL)
+    {
+        UnmapViewOfFile(Data);
+    }
+    Data = NULL;
+    Size = 0;
+}
+
+#else
+
+bool MappedFile::Open(const char* fileName)
+{
+    Close();
+    int File = open(fileName, O_RDONLY);
+    if (File < 0)
+    {
+        return false;
+    }
+    struct stat Stat;
+    if (fstat(File, &Stat) != 0 || Stat.st_size == 0)
+    {
+        close(File);
+        return false;
+    }
+    void* View = mmap(NULL, size_t(Stat.st_size), PROT_READ, MAP_PRIVATE, File, 0);
+    // The mapping stays valid after the descriptor is closed.
+    close(File);
+    if (View == MAP_FAILED)
+    {
+        return false;
+    }
+    Data = View;
+    Size = size_t(Stat.st_size);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (Data != NULL)
+    {
+        munmap(const_cast<void*>(Data), Size);
+    }
+    Data = NULL;
+    Size = 0;
+}
+
+#endif
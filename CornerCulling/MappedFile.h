@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+
+// Read-only memory mapping of a whole file.
+// Mappings start on a page boundary, so records stored at aligned
+// offsets in the file can be used in place without copying.
+class MappedFile
+{
+    const void* Data = NULL;
+    size_t Size = 0;
+
+public:
+    MappedFile() {}
+    ~MappedFile() { Close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps fileName, replacing any current mapping.
+    // Returns false if the file is missing, empty or cannot be mapped.
+    bool Open(const char* fileName);
+    // Unmaps the file. Pointers into it become invalid.
+    void Close();
+    const void* GetData() const { return Data; }
+    size_t GetSize() const { return Size; }
+};
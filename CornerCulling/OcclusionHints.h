@@ -0,0 +1,223 @@
+#pragma once
+#include "GeometricPrimitives.h"
+#include "AlignedAllocator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Occluders that blocked players standing in one cell of a grid over the
+// map from enemies in another cell, kept across rounds, reconnects and
+// map changes in culling_<map>.hints, next to the map.
+// File layout: an OcclusionHintsHeader, then the table's HintEntry array.
+// Entries name occluders by their index in the map's occluder table,
+// so OccluderHash rejects files made for other occluders.
+constexpr uint32_t OCCLUSION_HINTS_VERSION = 1;
+const char OCCLUSION_HINTS_MAGIC[8] = "CULLHNT";
+// Width of a grid cell in units. Small enough that a player holding an
+// angle stays in one cell.
+constexpr float HINT_CELL_SIZE = 64;
+// Bits of each cell coordinate in a key. Cells wrap around every
+// 2^HINT_CELL_BITS cells, which is 65536 units, beyond any map.
+constexpr int HINT_CELL_BITS = 10;
+// The table holds 2^HINT_SET_BITS sets of HINT_WAYS entries.
+// Each set is one cache line.
+constexpr int HINT_SET_BITS = 14;
+constexpr int HINT_WAYS = 4;
+// Hits saturate here, so that a hint that stops blocking is replaced
+// within this many disagreeing records.
+constexpr uint32_t MAX_HINT_HITS = 64;
+
+struct HintEntry
+{
+    // Cells of the player and enemy, or zero if the entry is empty.
+    uint64_t Key;
+    // Index of the occluder in the map's occluder table.
+    uint32_t Occluder;
+    // Times Occluder blocked the pair of cells, less times another did.
+    uint32_t Hits;
+};
+static_assert(sizeof(HintEntry) * HINT_WAYS == 64, "Sets of hints must fill a cache line");
+
+struct OcclusionHintsHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t EntrySize;
+    uint32_t EntryCount;
+    uint32_t OccluderCount;
+    // Hash of the map's occluder table.
+    uint64_t OccluderHash;
+};
+
+/**
+ *  Fixed-size, set-associative table from pairs of grid cells to the
+ *  occluder most likely to block them. Lookups are read-only, so culling
+ *  threads can share the table while nothing records into it.
+ */
+class OcclusionHints
+{
+    std::vector<HintEntry, AlignedAllocator<HintEntry, 64>> Entries;
+    // Whether the table changed since it was loaded or saved.
+    bool Changed = false;
+
+    static uint64_t CellOf(const vec3& Location)
+    {
+        const uint64_t Mask = (uint64_t(1) << HINT_CELL_BITS) - 1;
+        const uint64_t X = uint64_t(int64_t(floorf(Location.x / HINT_CELL_SIZE))) & Mask;
+        const uint64_t Y = uint64_t(int64_t(floorf(Location.y / HINT_CELL_SIZE))) & Mask;
+        const uint64_t Z = uint64_t(int64_t(floorf(Location.z / HINT_CELL_SIZE))) & Mask;
+        return (X << (2 * HINT_CELL_BITS)) | (Y << HINT_CELL_BITS) | Z;
+    }
+
+    HintEntry* SetOf(uint64_t Key)
+    {
+        return &Entries[((Key * 0x9E3779B97F4A7C15ull) >> (64 - HINT_SET_BITS)) * HINT_WAYS];
+    }
+    const HintEntry* SetOf(uint64_t Key) const
+    {
+        return const_cast<OcclusionHints*>(this)->SetOf(Key);
+    }
+
+public:
+    OcclusionHints() {}
+    OcclusionHints(const OcclusionHints&) = delete;
+    OcclusionHints& operator=(const OcclusionHints&) = delete;
+
+    // Key of a player's eye and an enemy's eye. Never zero.
+    static uint64_t KeyOf(const vec3& Player, const vec3& Enemy)
+    {
+        return (uint64_t(1) << 63)
+            | (CellOf(Player) << (3 * HINT_CELL_BITS))
+            | CellOf(Enemy);
+    }
+
+    bool IsEmpty() const { return Entries.empty(); }
+
+    // Empties the table, allocating it on first use.
+    void Clear()
+    {
+        Entries.assign(size_t(HINT_WAYS) << HINT_SET_BITS, HintEntry{ 0, 0, 0 });
+        Changed = false;
+    }
+
+    // Returns the index of the occluder hinted for Key, or -1.
+    int Lookup(uint64_t Key) const
+    {
+        const HintEntry* Set = SetOf(Key);
+        for (int w = 0; w < HINT_WAYS; w++)
+        {
+            if (Set[w].Key == Key)
+            {
+                return int(Set[w].Occluder);
+            }
+        }
+        return -1;
+    }
+
+    // Records that an occluder blocked the pair of cells of Key.
+    // A different occluder only takes over a key once the current one's
+    // hits run out, and a new key takes the way with the fewest hits,
+    // halving the others so that stale keys age out.
+    void Record(uint64_t Key, uint32_t Occluder)
+    {
+        HintEntry* Set = SetOf(Key);
+        int Victim = 0;
+        for (int w = 0; w < HINT_WAYS; w++)
+        {
+            if (Set[w].Key == Key)
+            {
+                if (Set[w].Occluder == Occluder)
+                {
+                    Set[w].Hits = std::min(Set[w].Hits + 1, MAX_HINT_HITS);
+                }
+                // Aging can leave a key with no hits, which must not wrap.
+                else if (Set[w].Hits <= 1)
+                {
+                    Set[w].Occluder = Occluder;
+                    Set[w].Hits = 1;
+                }
+                else
+                {
+                    Set[w].Hits--;
+                }
+                Changed = true;
+                return;
+            }
+            if (Set[w].Hits < Set[Victim].Hits)
+            {
+                Victim = w;
+            }
+        }
+        for (int w = 0; w < HINT_WAYS; w++)
+        {
+            Set[w].Hits /= 2;
+        }
+        Set[Victim] = HintEntry{ Key, Occluder, 1 };
+        Changed = true;
+    }
+
+    // Loads a table saved for the same occluders, or empties the table.
+    // Returns false if the file is missing, malformed or stale.
+    bool Load(const char* fileName, uint64_t occluderHash, uint32_t occluderCount)
+    {
+        Clear();
+        FILE* file = fopen(fileName, "rb");
+        if (file == NULL)
+        {
+            return false;
+        }
+        OcclusionHintsHeader header;
+        bool ok =
+            fread(&header, sizeof(header), 1, file) == 1
+            && memcmp(header.Magic, OCCLUSION_HINTS_MAGIC, sizeof(header.Magic)) == 0
+            && header.Version == OCCLUSION_HINTS_VERSION
+            && header.EntrySize == sizeof(HintEntry)
+            && header.EntryCount == uint32_t(Entries.size())
+            && header.OccluderCount == occluderCount
+            && header.OccluderHash == occluderHash
+            && fread(Entries.data(), sizeof(HintEntry), Entries.size(), file) == Entries.size();
+        fclose(file);
+        // Occluder indices from a corrupt file must not escape the table.
+        for (size_t e = 0; ok && e < Entries.size(); e++)
+        {
+            ok = Entries[e].Key == 0 || Entries[e].Occluder < occluderCount;
+        }
+        if (!ok)
+        {
+            Clear();
+        }
+        return ok;
+    }
+
+    // Writes the table if it changed since it was loaded or saved.
+    // Returns false on a write error.
+    bool Save(const char* fileName, uint64_t occluderHash, uint32_t occluderCount)
+    {
+        if (!Changed || Entries.empty())
+        {
+            return true;
+        }
+        FILE* file = fopen(fileName, "wb");
+        if (file == NULL)
+        {
+            return false;
+        }
+        OcclusionHintsHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.Magic, OCCLUSION_HINTS_MAGIC, sizeof(header.Magic));
+        header.Version = OCCLUSION_HINTS_VERSION;
+        header.EntrySize = sizeof(HintEntry);
+        header.EntryCount = uint32_t(Entries.size());
+        header.OccluderCount = occluderCount;
+        header.OccluderHash = occluderHash;
+        bool ok =
+            fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(Entries.data(), sizeof(HintEntry), Entries.size(), file) == Entries.size();
+        ok = (fclose(file) == 0) && ok;
+        Changed = Changed && !ok;
+        return ok;
+    }
+};
@@ -0,0 +1,340 @@
+#pragma once
+#include "GeometricPrimitives.h"
+#include "CompiledMap.h"
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Width and height in pixels of each face of a viewer's depth cube.
+// Must be a multiple of 8, as corners are evaluated 8 at a time.
+constexpr int RASTER_RESOLUTION = 32;
+constexpr int RASTER_FACES = 6;
+constexpr int RASTER_CORNERS = RASTER_RESOLUTION + 1;
+static_assert(RASTER_RESOLUTION % 8 == 0, "Rows of corners are evaluated 8 at a time");
+// Depth of the near plane that hulls are clipped to before projecting.
+// Nothing nearer can be hidden, as the viewpoints span more than this.
+constexpr float NEAR_DEPTH = 1;
+
+/**
+ *  Low-resolution depth cube around one viewer, for testing many enemies
+ *  against every nearby occluder at once, so that occluders that only
+ *  block an enemy together can still cull it.
+ *  Conservative for every viewpoint within Radius of Center: occluders
+ *  are shrunk by Radius before rasterizing, and whatever the shrunk
+ *  occluders hide from Center, the full ones hide from anywhere within
+ *  Radius of it. A pixel only takes an occluder's depth if the occluder
+ *  covers the whole pixel, and then the farthest depth of the occluder's
+ *  front within the pixel, found at one of the pixel's corners.
+ *  Face f looks along axis f / 2, toward negative coordinates if f is odd.
+ *  Each face only holds occluders nearer along its axis than its Range,
+ *  the depth of the farthest hull it is built to test.
+ */
+class alignas(32) OcclusionRaster
+{
+    // Farthest depth along the face's axis at which some shrunk occluder
+    // covers each pixel, or infinity.
+    float Depths[RASTER_FACES][RASTER_RESOLUTION * RASTER_RESOLUTION];
+    vec3 Center = vec3(0);
+    float Radius = 0;
+    // Depth along each face's axis beyond which the face holds no
+    // occluders.
+    float Ranges[RASTER_FACES] = {0};
+    bool Built = false;
+
+    static float Sign(int Face) { return (Face & 1) ? -1.0f : 1.0f; }
+
+    // Gets the depth and screen coordinates of a point relative to
+    // Center on a face. Coordinates are only valid if Depth is positive.
+    static void Project(int Face, const vec3& Point, float& Depth, float& U, float& V)
+    {
+        const int a = Face / 2;
+        Depth = Sign(Face) * Point[a];
+        U = Point[(a + 1) % 3] / Depth;
+        V = Point[(a + 2) % 3] / Depth;
+    }
+
+    // Gets the range of pixels along one screen axis that overlap
+    // [Min, Max], or returns false if none do.
+    static bool PixelRange(float Min, float Max, int& First, int& Last)
+    {
+        if (Max < -1 || Min > 1)
+        {
+            return false;
+        }
+        First = std::max(0, int(std::floor((Min + 1) * 0.5f * RASTER_RESOLUTION)));
+        Last = std::min(
+            RASTER_RESOLUTION - 1,
+            int(std::floor((Max + 1) * 0.5f * RASTER_RESOLUTION)));
+        return First <= Last;
+    }
+
+    // Gets the pixels of a face that the convex hull of Points, relative
+    // to Center, may cover. Returns false if it covers none.
+    static bool ScreenBounds(
+        int Face,
+        const vec3* Points,
+        int Count,
+        int& X0,
+        int& X1,
+        int& Y0,
+        int& Y1,
+        float& MinDepth)
+    {
+        const int a = Face / 2;
+        float UMin = std::numeric_limits<float>::infinity();
+        float VMin = UMin;
+        float UMax = -UMin;
+        float VMax = -UMin;
+        MinDepth = UMin;
+        float Depths[2 * CHARACTER_HALF_V];
+        for (int p = 0; p < Count; p++)
+        {
+            float U, V;
+            Project(Face, Points[p], Depths[p], U, V);
+            MinDepth = std::min(MinDepth, Depths[p]);
+            if (Depths[p] >= NEAR_DEPTH)
+            {
+                UMin = std::min(UMin, U);
+                UMax = std::max(UMax, U);
+                VMin = std::min(VMin, V);
+                VMax = std::max(VMax, V);
+            }
+        }
+        // The hull, clipped to the near plane, also has corners where
+        // segments between points cross the near plane. Those project far
+        // out in the direction they lie, rather than anywhere on the face.
+        for (int p = 0; p < Count; p++)
+        {
+            for (int q = p + 1; q < Count; q++)
+            {
+                if ((Depths[p] < NEAR_DEPTH) == (Depths[q] < NEAR_DEPTH))
+                {
+                    continue;
+                }
+                const float t = (NEAR_DEPTH - Depths[p]) / (Depths[q] - Depths[p]);
+                const vec3 Crossing = Points[p] + t * (Points[q] - Points[p]);
+                const float U = Crossing[(a + 1) % 3] / NEAR_DEPTH;
+                const float V = Crossing[(a + 2) % 3] / NEAR_DEPTH;
+                UMin = std::min(UMin, U);
+                UMax = std::max(UMax, U);
+                VMin = std::min(VMin, V);
+                VMax = std::max(VMax, V);
+            }
+        }
+        return PixelRange(UMin, UMax, X0, X1) && PixelRange(VMin, VMax, Y0, Y1);
+    }
+
+    static void GetBoxCorners(const vec3& Min, const vec3& Max, vec3 (&Corners)[8])
+    {
+        for (int c = 0; c < 8; c++)
+        {
+            Corners[c] = vec3(
+                (c & 1) ? Max.x : Min.x,
+                (c & 2) ? Max.y : Min.y,
+                (c & 4) ? Max.z : Min.z);
+        }
+    }
+
+    // Rasterizes one occluder, shrunk by Radius, into a face.
+    void RasterizeFace(
+        int Face,
+        const CuboidPlanes& C,
+        const float (&Offsets)[CUBOID_F],
+        const vec3 (&Corners)[8],
+        float (&CornerDepths)[RASTER_CORNERS][RASTER_CORNERS])
+    {
+        int X0, X1, Y0, Y1;
+        float MinDepth;
+        if (!ScreenBounds(Face, Corners, 8, X0, X1, Y0, Y1, MinDepth))
+        {
+            return;
+        }
+        const int a = Face / 2;
+        const float* Normals[3] = { C.NormalXs, C.NormalYs, C.NormalZs };
+        const float* AxisNormals = Normals[a];
+        const float* UNormals = Normals[(a + 1) % 3];
+        const float* VNormals = Normals[(a + 2) % 3];
+        const float Step = 2.0f / RASTER_RESOLUTION;
+        const __m256 Zero = _mm256_setzero_ps();
+        const __m256 Infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+        // Corners of the pixels in the bounds, 8 at a time along u.
+        const int CX0 = X0 & ~7;
+        const int CX1 = X1 + 1;
+        for (int cy = Y0; cy <= Y1 + 1; cy++)
+        {
+            const float V = -1 + cy * Step;
+            for (int cx = CX0; cx <= CX1; cx += 8)
+            {
+                const __m256 U = _mm256_add_ps(
+                    _mm256_set1_ps(-1 + cx * Step),
+                    _mm256_mul_ps(
+                        _mm256_set1_ps(Step),
+                        _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0)));
+                // The ray through the corner is Center + Depth * w, where
+                // w is 1 along the face's axis, and inside a plane where
+                // Depth * dot(Normal, w) <= Offset.
+                __m256 Entry = Zero;
+                __m256 Exit = Infinity;
+                __m256 Miss = _mm256_setzero_ps();
+                for (int k = 0; k < CUBOID_F; k++)
+                {
+                    const __m256 Slope = _mm256_add_ps(
+                        _mm256_set1_ps(Sign(Face) * AxisNormals[k] + V * VNormals[k]),
+                        _mm256_mul_ps(U, _mm256_set1_ps(UNormals[k])));
+                    const __m256 Offset = _mm256_set1_ps(Offsets[k]);
+                    const __m256 Depth = _mm256_div_ps(Offset, Slope);
+                    const __m256 Entering = _mm256_cmp_ps(Slope, Zero, _CMP_LT_OQ);
+                    const __m256 Exiting = _mm256_cmp_ps(Slope, Zero, _CMP_GT_OQ);
+                    Entry = _mm256_blendv_ps(Entry, _mm256_max_ps(Entry, Depth), Entering);
+                    Exit = _mm256_blendv_ps(Exit, _mm256_min_ps(Exit, Depth), Exiting);
+                    // Rays along a plane that Center is outside of miss.
+                    Miss = _mm256_or_ps(
+                        Miss,
+                        _mm256_and_ps(
+                            _mm256_cmp_ps(Slope, Zero, _CMP_EQ_OQ),
+                            _mm256_cmp_ps(Offset, Zero, _CMP_LT_OQ)));
+                }
+                Miss = _mm256_or_ps(Miss, _mm256_cmp_ps(Entry, Exit, _CMP_GT_OQ));
+                alignas(32) float Depths8[8];
+                _mm256_store_ps(Depths8, _mm256_blendv_ps(Entry, Infinity, Miss));
+                const int Count = std::min(8, CX1 + 1 - cx);
+                std::copy(Depths8, Depths8 + Count, &CornerDepths[cy][cx]);
+            }
+        }
+        float* FaceDepths = Depths[Face];
+        for (int y = Y0; y <= Y1; y++)
+        {
+            for (int x = X0; x <= X1; x++)
+            {
+                const float Farthest = std::max(
+                    std::max(CornerDepths[y][x], CornerDepths[y][x + 1]),
+                    std::max(CornerDepths[y + 1][x], CornerDepths[y + 1][x + 1]));
+                float& Pixel = FaceDepths[y * RASTER_RESOLUTION + x];
+                Pixel = std::min(Pixel, Farthest);
+            }
+        }
+    }
+
+public:
+    // Whether the cube is conservative for every viewpoint within
+    // Distance of Eye, and holds every occluder nearer than Extents,
+    // the depths from Eye along each face's axis.
+    bool Covers(const vec3& Eye, float Distance, const float (&Extents)[RASTER_FACES]) const
+    {
+        if (!Built || glm::length(Eye - Center) + Distance > Radius)
+        {
+            return false;
+        }
+        for (int f = 0; f < RASTER_FACES; f++)
+        {
+            if (Extents[f] + Sign(f) * (Eye - Center)[f / 2] > Ranges[f])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Rasterizes every occluder of a map around a viewer that is nearer
+    // than Extents along some face's axis.
+    void Build(
+        const vec3& Eye,
+        float Distance,
+        const float (&Extents)[RASTER_FACES],
+        const CuboidPlanes* Planes,
+        const OccluderBounds* Bounds,
+        uint32_t Count)
+    {
+        Center = Eye;
+        Radius = Distance;
+        std::copy(Extents, Extents + RASTER_FACES, Ranges);
+        Built = true;
+        std::fill(
+            &Depths[0][0],
+            &Depths[0][0] + RASTER_FACES * RASTER_RESOLUTION * RASTER_RESOLUTION,
+            std::numeric_limits<float>::infinity());
+        float CornerDepths[RASTER_CORNERS][RASTER_CORNERS];
+        for (uint32_t o = 0; o < Count; o++)
+        {
+            // Shrinking empties occluders thinner than the viewpoints' span.
+            const vec3 Min = Bounds[o].Min + vec3(Radius) - Eye;
+            const vec3 Max = Bounds[o].Max - vec3(Radius) - Eye;
+            if (glm::any(glm::greaterThan(Min, Max)))
+            {
+                continue;
+            }
+            // Planes moved inward by Radius, relative to Eye.
+            const CuboidPlanes& C = Planes[o];
+            float Offsets[CUBOID_F];
+            bool Inside = true;
+            for (int k = 0; k < CUBOID_F; k++)
+            {
+                Offsets[k] = C.Offsets[k] - Radius
+                    - (C.NormalXs[k] * Eye.x + C.NormalYs[k] * Eye.y + C.NormalZs[k] * Eye.z);
+                Inside = Inside && Offsets[k] > 0;
+            }
+            // A viewer inside an occluder is not hidden by it.
+            if (Inside)
+            {
+                continue;
+            }
+            vec3 Corners[8];
+            GetBoxCorners(Min, Max, Corners);
+            for (int f = 0; f < RASTER_FACES; f++)
+            {
+                const float Near = (f & 1) ? -Max[f / 2] : Min[f / 2];
+                if (Near <= Ranges[f])
+                {
+                    RasterizeFace(f, C, Offsets, Corners, CornerDepths);
+                }
+            }
+        }
+    }
+
+    // Whether the convex hull of Vertices is hidden from every viewpoint
+    // the cube covers.
+    bool IsOccluded(const vec3* Vertices, int Count) const
+    {
+        vec3 Relative[2 * CHARACTER_HALF_V];
+        Count = std::min(Count, 2 * CHARACTER_HALF_V);
+        vec3 Min = Vertices[0] - Center;
+        vec3 Max = Min;
+        for (int v = 0; v < Count; v++)
+        {
+            Relative[v] = Vertices[v] - Center;
+            Min = glm::min(Min, Relative[v]);
+            Max = glm::max(Max, Relative[v]);
+        }
+        // Every point of the hull is at least this far from Center.
+        const float Distance = glm::length(glm::max(glm::max(Min, -Max), vec3(0)));
+        if (Distance <= Radius)
+        {
+            return false;
+        }
+        for (int f = 0; f < RASTER_FACES; f++)
+        {
+            int X0, X1, Y0, Y1;
+            float MinDepth;
+            if (!ScreenBounds(f, Relative, Count, X0, X1, Y0, Y1, MinDepth))
+            {
+                continue;
+            }
+            // Points that project onto a face are at least 1 / sqrt(3) of
+            // their distance deep along its axis.
+            MinDepth = std::max(MinDepth, Distance * 0.57735f);
+            const float* FaceDepths = Depths[f];
+            for (int y = Y0; y <= Y1; y++)
+            {
+                for (int x = X0; x <= X1; x++)
+                {
+                    if (!(FaceDepths[y * RASTER_RESOLUTION + x] < MinDepth))
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+};
@@ -0,0 +1,410 @@
+#pragma once
+#include "GeometricPrimitives.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Cells and portals of a map, written by hand next to culling_<map>.txt
+// as culling_<map>.portals:
+// Cell <name>              An axis-aligned box of the named cell, given
+// x1 y1 z1                 by two opposite corners. A cell may have
+// x2 y2 z2                 several boxes, and need not be convex.
+// Portal <name> <name>     An opening between two cells, such as a
+// x1 y1 z1                 doorway, as a box that is thinnest across
+// x2 y2 z2                 the opening.
+// The author promises that every line of sight that leaves a cell passes
+// through one of its portals, and that cells cover everywhere characters
+// and their peeks can reach. Lines may not cross walls between cells, or
+// pass through space outside every cell.
+// Maximum number of cells, so that the visibility matrix stays small.
+constexpr int MAX_PORTAL_CELLS = 4096;
+// Maximum number of cells that a character's reach may overlap. Characters
+// that overlap more are never rejected.
+constexpr int MAX_CHARACTER_PORTAL_CELLS = 4;
+// Portals that the search from each cell may step through before giving
+// up and treating every connected cell as visible.
+constexpr int MAX_PORTAL_STEPS = 1 << 16;
+
+struct PortalBox
+{
+    vec3 Min;
+    vec3 Max;
+};
+
+/**
+ *  Cell-to-cell visibility through a map's portals, for rejecting pairs
+ *  of characters that no sequence of portals connects before any
+ *  geometry is tested. Lookups are read-only, so culling threads can
+ *  share it.
+ */
+class PortalGraph
+{
+    struct Portal
+    {
+        PortalBox Bounds;
+        int Cells[2];
+        // Axis across the opening.
+        int Axis;
+    };
+    struct CellBox
+    {
+        PortalBox Bounds;
+        int Cell;
+    };
+    std::vector<CellBox> CellBoxes;
+    // Bounds of all boxes of each cell.
+    std::vector<PortalBox> CellBounds;
+    std::vector<Portal> Portals;
+    // Portals of each cell.
+    std::vector<std::vector<int>> CellPortals;
+    int RowWords = 0;
+    // Bit b of row a is set if cell b may be visible from cell a.
+    std::vector<uint64_t> Bits;
+
+    // State of the search from one cell.
+    struct Search
+    {
+        int Source;
+        uint64_t* Row;
+        std::vector<bool> UsedPortals;
+        int Steps;
+    };
+
+    static bool ReadBox(std::ifstream& input, PortalBox& Box)
+    {
+        std::string line;
+        vec3 a, b;
+        if (!std::getline(input, line)
+            || !(std::istringstream{ line } >> a.x >> a.y >> a.z)
+            || !std::getline(input, line)
+            || !(std::istringstream{ line } >> b.x >> b.y >> b.z))
+        {
+            return false;
+        }
+        Box.Min = glm::min(a, b);
+        Box.Max = glm::max(a, b);
+        return true;
+    }
+
+    static bool Overlap(const PortalBox& A, const PortalBox& B)
+    {
+        return glm::all(glm::lessThanEqual(A.Min, B.Max))
+            && glm::all(glm::lessThanEqual(B.Min, A.Max));
+    }
+
+    void SetVisible(uint64_t* Row, int Cell)
+    {
+        Row[Cell >> 6] |= uint64_t(1) << (Cell & 63);
+    }
+
+    // Clips a portal, thinnest along Axis, to where lines from Source
+    // through the box Through may cross it. Returns false if no line
+    // crosses it. Interval arithmetic keeps the bounds conservative.
+    static bool ClipPortal(
+        const PortalBox& Source,
+        const PortalBox& Through,
+        int Axis,
+        PortalBox& Clipped)
+    {
+        const int a = Axis;
+        // Lines are s + (q - s) * t, for s in Source and q in Through,
+        // and cross Next's plane where t = (r - s) / (q - s) on its axis.
+        const float DenMin = Through.Min[a] - Source.Max[a];
+        const float DenMax = Through.Max[a] - Source.Min[a];
+        if (DenMin <= 0 && DenMax >= 0)
+        {
+            // Some lines run along the plane, so nothing is clipped.
+            return true;
+        }
+        const float NumMin = Clipped.Min[a] - Source.Max[a];
+        const float NumMax = Clipped.Max[a] - Source.Min[a];
+        const float Quotients[4] = {
+            NumMin / DenMin, NumMin / DenMax, NumMax / DenMin, NumMax / DenMax };
+        const float TMin = *std::min_element(Quotients, Quotients + 4);
+        const float TMax = *std::max_element(Quotients, Quotients + 4);
+        for (int b = 0; b < 3; b++)
+        {
+            if (b == a)
+            {
+                continue;
+            }
+            const float DeltaMin = Through.Min[b] - Source.Max[b];
+            const float DeltaMax = Through.Max[b] - Source.Min[b];
+            const float Products[4] = {
+                DeltaMin * TMin, DeltaMin * TMax, DeltaMax * TMin, DeltaMax * TMax };
+            // Half a unit absorbs rounding.
+            const float Lo = Source.Min[b] + *std::min_element(Products, Products + 4) - 0.5f;
+            const float Hi = Source.Max[b] + *std::max_element(Products, Products + 4) + 0.5f;
+            Clipped.Min[b] = std::max(Clipped.Min[b], Lo);
+            Clipped.Max[b] = std::min(Clipped.Max[b], Hi);
+            if (Clipped.Min[b] > Clipped.Max[b])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Marks the cells that lines from the source cell, after passing
+    // through the clipped portals First and then Through into Cell, may
+    // reach. First is NULL in the source cell. Lines must pass through
+    // both the source cell and the first portal, which matters when the
+    // source cell touches the first portal, and so sees it at any angle.
+    // Returns false if the search ran out of steps.
+    bool Visit(Search& S, int Cell, const PortalBox* First, const PortalBox& Through)
+    {
+        SetVisible(S.Row, Cell);
+        for (int p : CellPortals[Cell])
+        {
+            if (S.UsedPortals[p])
+            {
+                continue;
+            }
+            if (++S.Steps > MAX_PORTAL_STEPS)
+            {
+                return false;
+            }
+            PortalBox Clipped = Portals[p].Bounds;
+            if (!ClipPortal(CellBounds[S.Source], Through, Portals[p].Axis, Clipped)
+                || (First != NULL
+                    && !ClipPortal(*First, Through, Portals[p].Axis, Clipped)))
+            {
+                continue;
+            }
+            const int Next = Portals[p].Cells[0] == Cell ? Portals[p].Cells[1] : Portals[p].Cells[0];
+            // A straight line crosses a portal at most once, but may
+            // come back to a cell that is not convex.
+            S.UsedPortals[p] = true;
+            const bool Finished = Visit(S, Next, First != NULL ? First : &Clipped, Clipped);
+            S.UsedPortals[p] = false;
+            if (!Finished)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Marks every cell connected to Cell by any portals.
+    void VisitConnected(uint64_t* Row, int Cell)
+    {
+        std::vector<int> Stack(1, Cell);
+        SetVisible(Row, Cell);
+        while (!Stack.empty())
+        {
+            const int Current = Stack.back();
+            Stack.pop_back();
+            for (int p : CellPortals[Current])
+            {
+                for (int Next : Portals[p].Cells)
+                {
+                    if (!((Row[Next >> 6] >> (Next & 63)) & 1))
+                    {
+                        SetVisible(Row, Next);
+                        Stack.push_back(Next);
+                    }
+                }
+            }
+        }
+    }
+
+    void ComputeVisibility()
+    {
+        const int Cells = GetCellCount();
+        RowWords = (Cells + 63) / 64;
+        Bits.assign(size_t(Cells) * RowWords, 0);
+        Search S;
+        S.UsedPortals.assign(Portals.size(), false);
+        for (int A = 0; A < Cells; A++)
+        {
+            S.Source = A;
+            S.Row = &Bits[size_t(A) * RowWords];
+            S.Steps = 0;
+            if (!Visit(S, A, NULL, CellBounds[A]))
+            {
+                std::fill(S.UsedPortals.begin(), S.UsedPortals.end(), false);
+                std::fill(S.Row, S.Row + RowWords, 0);
+                VisitConnected(S.Row, A);
+            }
+        }
+        // Light travels both ways, so keep a pair if either search found it.
+        for (int A = 0; A < Cells; A++)
+        {
+            for (int B = A + 1; B < Cells; B++)
+            {
+                if (MayCellsSee(A, B) || MayCellsSee(B, A))
+                {
+                    SetVisible(&Bits[size_t(A) * RowWords], B);
+                    SetVisible(&Bits[size_t(B) * RowWords], A);
+                }
+            }
+        }
+    }
+
+public:
+    PortalGraph() {}
+    PortalGraph(const PortalGraph&) = delete;
+    PortalGraph& operator=(const PortalGraph&) = delete;
+
+    bool IsLoaded() const { return !CellBounds.empty(); }
+    int GetCellCount() const { return int(CellBounds.size()); }
+    int GetPortalCount() const { return int(Portals.size()); }
+
+    void Clear()
+    {
+        std::vector<CellBox>().swap(CellBoxes);
+        std::vector<PortalBox>().swap(CellBounds);
+        std::vector<Portal>().swap(Portals);
+        std::vector<std::vector<int>>().swap(CellPortals);
+        std::vector<uint64_t>().swap(Bits);
+        RowWords = 0;
+    }
+
+    // Loads a portal file and computes which cells may see each other,
+    // or clears the graph. Returns false if the file is missing or
+    // malformed, printing why if it is malformed.
+    bool Load(const char* fileName)
+    {
+        Clear();
+        std::ifstream in(fileName);
+        if (!in)
+        {
+            return false;
+        }
+        std::map<std::string, int> CellIndices;
+        std::string line;
+        int LineNumber = 0;
+        bool ok = true;
+        while (ok && std::getline(in, line))
+        {
+            LineNumber++;
+            std::string token, First, Second;
+            std::istringstream{ line } >> token >> First >> Second;
+            PortalBox Box;
+            if (token == "Cell" && !First.empty())
+            {
+                ok = ReadBox(in, Box);
+                const auto Inserted = CellIndices.emplace(First, int(CellBounds.size()));
+                if (Inserted.second)
+                {
+                    CellBounds.push_back(Box);
+                }
+                PortalBox& Bounds = CellBounds[Inserted.first->second];
+                Bounds.Min = glm::min(Bounds.Min, Box.Min);
+                Bounds.Max = glm::max(Bounds.Max, Box.Max);
+                CellBoxes.push_back(CellBox{ Box, Inserted.first->second });
+            }
+            else if (token == "Portal" && !Second.empty())
+            {
+                ok = ReadBox(in, Box);
+                const auto A = CellIndices.find(First);
+                const auto B = CellIndices.find(Second);
+                ok = ok && A != CellIndices.end() && B != CellIndices.end() && A != B;
+                if (ok)
+                {
+                    const vec3 Size = Box.Max - Box.Min;
+                    const int Axis = (Size.x <= Size.y && Size.x <= Size.z)
+                        ? 0 : (Size.y <= Size.z ? 1 : 2);
+                    Portals.push_back(Portal{ Box, { A->second, B->second }, Axis });
+                }
+            }
+            else if (token == "Cell" || token == "Portal")
+            {
+                ok = false;
+            }
+            if (!ok)
+            {
+                printf("%s:%d: bad %s, portals ignored\n", fileName, LineNumber, token.c_str());
+            }
+            // Skip the box's two lines.
+            LineNumber += ok && (token == "Cell" || token == "Portal") ? 2 : 0;
+        }
+        if (ok && GetCellCount() > MAX_PORTAL_CELLS)
+        {
+            printf("%s has over %d cells, portals ignored\n", fileName, MAX_PORTAL_CELLS);
+            ok = false;
+        }
+        if (!ok)
+        {
+            Clear();
+            return false;
+        }
+        CellPortals.resize(CellBounds.size());
+        for (int p = 0; p < int(Portals.size()); p++)
+        {
+            CellPortals[Portals[p].Cells[0]].push_back(p);
+            CellPortals[Portals[p].Cells[1]].push_back(p);
+        }
+        ComputeVisibility();
+        return true;
+    }
+
+    // Gets the cells that a character's reach overlaps. Returns how many,
+    // or -1 if the eye is outside every cell or the reach overlaps more
+    // than MAX_CHARACTER_PORTAL_CELLS.
+    int CellsOf(
+        const vec3& Eye,
+        const vec3& ReachMin,
+        const vec3& ReachMax,
+        int (&Cells)[MAX_CHARACTER_PORTAL_CELLS]) const
+    {
+        const PortalBox Reach{ ReachMin, ReachMax };
+        const PortalBox EyeBox{ Eye, Eye };
+        bool EyeInside = false;
+        int Count = 0;
+        for (const CellBox& C : CellBoxes)
+        {
+            if (!Overlap(C.Bounds, Reach))
+            {
+                continue;
+            }
+            EyeInside = EyeInside || Overlap(C.Bounds, EyeBox);
+            if (std::find(Cells, Cells + Count, C.Cell) != Cells + Count)
+            {
+                continue;
+            }
+            if (Count == MAX_CHARACTER_PORTAL_CELLS)
+            {
+                return -1;
+            }
+            Cells[Count++] = C.Cell;
+        }
+        return EyeInside ? Count : -1;
+    }
+
+    // Whether lines of sight may join cells A and B.
+    bool MayCellsSee(int A, int B) const
+    {
+        return ((Bits[size_t(A) * RowWords + (B >> 6)] >> (B & 63)) & 1) != 0;
+    }
+
+    // Whether characters whose reaches overlap the given cells may see
+    // each other. Counts of -1 may see everything.
+    bool MayBeVisible(
+        const int (&CellsA)[MAX_CHARACTER_PORTAL_CELLS],
+        int CountA,
+        const int (&CellsB)[MAX_CHARACTER_PORTAL_CELLS],
+        int CountB) const
+    {
+        if (CountA < 0 || CountB < 0)
+        {
+            return true;
+        }
+        for (int a = 0; a < CountA; a++)
+        {
+            for (int b = 0; b < CountB; b++)
+            {
+                if (MayCellsSee(CellsA[a], CellsB[b]))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
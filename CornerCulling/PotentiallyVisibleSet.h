@@ -0,0 +1,335 @@
+#pragma once
+#include "GeometricPrimitives.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Potentially visible set of a map, written next to culling_<map>.txt as
+// culling_<map>.pvs by the culling_compile_pvs tool.
+// The map's bounds are split into a grid of cubic cells, and each pair of
+// cells is marked invisible if occluders block every line of sight
+// between the reaches of the two cells: the cells grown by the
+// PVS_HULL_EXTENTs and by Margin, which covers the peeks culling makes,
+// then clipped to the grid. Only characters whose whole reach lies in the
+// grid are given a cell, as maps have no floors, and lines of sight
+// under every wall would otherwise spoil most pairs.
+// Rows of the cell matrix are XORed with the previous row, and stored as
+// alternating varint counts of zero words and of literal words, each
+// literal run followed by its 64-bit words.
+// Invisibility only holds for the occluders it was computed from,
+// so OccluderHash rejects files made for other occluders.
+constexpr uint32_t PVS_VERSION = 1;
+const char PVS_MAGIC[8] = "CULLPVS";
+// Farthest a character's bounds reach from their eye: the gun barrel
+// and legs sideways and above, and the feet below.
+constexpr float PVS_HULL_EXTENT_HORIZONTAL = 40;
+constexpr float PVS_HULL_EXTENT_UP = 40;
+constexpr float PVS_HULL_EXTENT_DOWN = 72;
+// Limits the in-memory matrix to 128 MB.
+constexpr uint32_t MAX_PVS_CELLS = 32768;
+
+struct PvsHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    // Cells along x, y and z.
+    uint32_t Dims[3];
+    // Minimum corner of the grid.
+    float Origin[3];
+    float CellSize;
+    // How far peeks and swept hulls may reach past a character's bounds.
+    float Margin;
+    uint32_t OccluderCount;
+    // Hash of the map's occluder table.
+    uint64_t OccluderHash;
+    uint32_t PayloadSize;
+    uint32_t Padding;
+};
+
+namespace PvsImpl
+{
+    inline void WriteVarint(std::vector<uint8_t>& Out, uint32_t Value)
+    {
+        while (Value >= 0x80)
+        {
+            Out.push_back(uint8_t(Value | 0x80));
+            Value >>= 7;
+        }
+        Out.push_back(uint8_t(Value));
+    }
+
+    inline bool ReadVarint(const uint8_t*& In, const uint8_t* End, uint32_t& Value)
+    {
+        Value = 0;
+        for (int Shift = 0; Shift < 35 && In < End; Shift += 7)
+        {
+            const uint8_t Byte = *In++;
+            Value |= uint32_t(Byte & 0x7F) << Shift;
+            if (Byte < 0x80)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+/**
+ *  Cell-to-cell visibility of a map, for rejecting pairs of characters
+ *  that cannot see each other before any geometry is tested.
+ *  Lookups are read-only, so culling threads can share it.
+ */
+class PotentiallyVisibleSet
+{
+    PvsHeader Header;
+    int CellCount = 0;
+    int RowWords = 0;
+    // Bit b of row a is set if cell b may be visible from cell a.
+    std::vector<uint64_t> Bits;
+
+public:
+    PotentiallyVisibleSet() { Clear(); }
+    PotentiallyVisibleSet(const PotentiallyVisibleSet&) = delete;
+    PotentiallyVisibleSet& operator=(const PotentiallyVisibleSet&) = delete;
+
+    bool IsLoaded() const { return CellCount > 0; }
+    int GetCellCount() const { return CellCount; }
+    float GetMargin() const { return Header.Margin; }
+
+    // Drops the matrix, releasing its memory.
+    void Clear()
+    {
+        memset(&Header, 0, sizeof(Header));
+        CellCount = 0;
+        RowWords = 0;
+        std::vector<uint64_t>().swap(Bits);
+    }
+
+    // Starts a matrix with every pair of cells potentially visible.
+    // Returns false if the grid has too many cells.
+    bool Reset(const vec3& Origin, const uint32_t (&Dims)[3], float CellSize, float Margin)
+    {
+        Clear();
+        const uint64_t Cells = uint64_t(Dims[0]) * Dims[1] * Dims[2];
+        if (Cells == 0 || Cells > MAX_PVS_CELLS || CellSize <= 0)
+        {
+            return false;
+        }
+        memcpy(Header.Magic, PVS_MAGIC, sizeof(Header.Magic));
+        Header.Version = PVS_VERSION;
+        memcpy(Header.Dims, Dims, sizeof(Header.Dims));
+        Header.Origin[0] = Origin.x;
+        Header.Origin[1] = Origin.y;
+        Header.Origin[2] = Origin.z;
+        Header.CellSize = CellSize;
+        Header.Margin = Margin;
+        CellCount = int(Cells);
+        RowWords = (CellCount + 63) / 64;
+        Bits.assign(size_t(CellCount) * RowWords, ~uint64_t(0));
+        return true;
+    }
+
+    // Returns the cell holding a character's eye, or -1 if any of the
+    // character's reach lies outside the grid.
+    int CellOf(const vec3& Eye) const
+    {
+        vec3 Min, Max;
+        GetReach(Eye, Eye, Min, Max);
+        int Cell = 0;
+        for (int a = 2; a >= 0; a--)
+        {
+            const float GridMax = Header.Origin[a] + float(Header.Dims[a]) * Header.CellSize;
+            if (!(Min[a] >= Header.Origin[a] && Max[a] <= GridMax))
+            {
+                return -1;
+            }
+            const int Index = int((Eye[a] - Header.Origin[a]) / Header.CellSize);
+            Cell = Cell * int(Header.Dims[a]) + std::min(Index, int(Header.Dims[a]) - 1);
+        }
+        return Cell;
+    }
+
+    // Gets the bounds of everything that characters with eyes in a cell
+    // could see from or be seen at, clipped to the grid.
+    void GetCellReach(int Cell, vec3& Min, vec3& Max) const
+    {
+        vec3 CellMin, CellMax;
+        for (int a = 0; a < 3; a++)
+        {
+            CellMin[a] = Header.Origin[a] + float(Cell % int(Header.Dims[a])) * Header.CellSize;
+            CellMax[a] = CellMin[a] + Header.CellSize;
+            Cell /= int(Header.Dims[a]);
+        }
+        GetReach(CellMin, CellMax, Min, Max);
+        for (int a = 0; a < 3; a++)
+        {
+            Min[a] = std::max(Min[a], Header.Origin[a]);
+            Max[a] = std::min(Max[a], Header.Origin[a] + float(Header.Dims[a]) * Header.CellSize);
+        }
+    }
+
+    // Whether characters with eyes in cells A and B may see each other.
+    // Cells outside the grid may see everything.
+    bool MayBeVisible(int A, int B) const
+    {
+        return A < 0
+            || B < 0
+            || ((Bits[size_t(A) * RowWords + (B >> 6)] >> (B & 63)) & 1) != 0;
+    }
+
+    // Marks cells A and B as unable to see each other.
+    // Rows of different cells may be written concurrently,
+    // so each call only writes row A.
+    void SetInvisible(int A, int B)
+    {
+        Bits[size_t(A) * RowWords + (B >> 6)] &= ~(uint64_t(1) << (B & 63));
+    }
+
+    // Loads a matrix saved for the same occluders, or clears it.
+    // Returns false if the file is missing, malformed or stale.
+    bool Load(const char* fileName, uint64_t occluderHash, uint32_t occluderCount)
+    {
+        Clear();
+        FILE* file = fopen(fileName, "rb");
+        if (file == NULL)
+        {
+            return false;
+        }
+        PvsHeader Loaded;
+        std::vector<uint8_t> Payload;
+        bool ok =
+            fread(&Loaded, sizeof(Loaded), 1, file) == 1
+            && memcmp(Loaded.Magic, PVS_MAGIC, sizeof(Loaded.Magic)) == 0
+            && Loaded.Version == PVS_VERSION
+            && Loaded.OccluderCount == occluderCount
+            && Loaded.OccluderHash == occluderHash
+            && Reset(
+                vec3(Loaded.Origin[0], Loaded.Origin[1], Loaded.Origin[2]),
+                Loaded.Dims,
+                Loaded.CellSize,
+                Loaded.Margin);
+        if (ok)
+        {
+            Header = Loaded;
+            Payload.resize(Loaded.PayloadSize);
+            ok = fread(Payload.data(), 1, Payload.size(), file) == Payload.size();
+        }
+        fclose(file);
+        ok = ok && Decode(Payload);
+        if (!ok)
+        {
+            Clear();
+        }
+        return ok;
+    }
+
+    // Writes the matrix. Returns false on any write error.
+    bool Save(const char* fileName, uint64_t occluderHash, uint32_t occluderCount)
+    {
+        std::vector<uint8_t> Payload;
+        Encode(Payload);
+        Header.OccluderCount = occluderCount;
+        Header.OccluderHash = occluderHash;
+        Header.PayloadSize = uint32_t(Payload.size());
+        FILE* file = fopen(fileName, "wb");
+        if (file == NULL)
+        {
+            return false;
+        }
+        bool ok =
+            fwrite(&Header, sizeof(Header), 1, file) == 1
+            && fwrite(Payload.data(), 1, Payload.size(), file) == Payload.size();
+        ok = (fclose(file) == 0) && ok;
+        return ok;
+    }
+
+private:
+    // Grows the bounds of possible eyes into the bounds of the characters'
+    // hulls and peeks.
+    void GetReach(const vec3& EyeMin, const vec3& EyeMax, vec3& Min, vec3& Max) const
+    {
+        const float Horizontal = PVS_HULL_EXTENT_HORIZONTAL + Header.Margin;
+        Min = EyeMin - vec3(Horizontal, Horizontal, PVS_HULL_EXTENT_DOWN + Header.Margin);
+        Max = EyeMax + vec3(Horizontal, Horizontal, PVS_HULL_EXTENT_UP + Header.Margin);
+    }
+
+    void Encode(std::vector<uint8_t>& Out) const
+    {
+        using namespace PvsImpl;
+        const uint64_t* Previous = NULL;
+        std::vector<uint64_t> Delta(RowWords);
+        for (int Row = 0; Row < CellCount; Row++)
+        {
+            const uint64_t* Current = &Bits[size_t(Row) * RowWords];
+            for (int w = 0; w < RowWords; w++)
+            {
+                Delta[w] = Current[w] ^ (Previous ? Previous[w] : ~uint64_t(0));
+            }
+            Previous = Current;
+            int w = 0;
+            while (w < RowWords)
+            {
+                const int ZerosStart = w;
+                while (w < RowWords && Delta[w] == 0)
+                {
+                    w++;
+                }
+                const int LiteralsStart = w;
+                while (w < RowWords && Delta[w] != 0)
+                {
+                    w++;
+                }
+                WriteVarint(Out, uint32_t(LiteralsStart - ZerosStart));
+                WriteVarint(Out, uint32_t(w - LiteralsStart));
+                const uint8_t* Bytes = reinterpret_cast<const uint8_t*>(&Delta[LiteralsStart]);
+                Out.insert(Out.end(), Bytes, Bytes + 8 * (w - LiteralsStart));
+            }
+        }
+    }
+
+    // Decodes a payload into the matrix, which Reset filled with ones.
+    bool Decode(const std::vector<uint8_t>& In)
+    {
+        using namespace PvsImpl;
+        const uint8_t* P = In.data();
+        const uint8_t* End = P + In.size();
+        for (int Row = 0; Row < CellCount; Row++)
+        {
+            uint64_t* Current = &Bits[size_t(Row) * RowWords];
+            if (Row > 0)
+            {
+                memcpy(Current, Current - RowWords, RowWords * sizeof(uint64_t));
+            }
+            uint32_t w = 0;
+            while (w < uint32_t(RowWords))
+            {
+                uint32_t Zeros, Literals;
+                if (!ReadVarint(P, End, Zeros) || !ReadVarint(P, End, Literals))
+                {
+                    return false;
+                }
+                // Compared against the words left, as sums of corrupt
+                // counts could wrap.
+                if (Zeros > uint32_t(RowWords) - w)
+                {
+                    return false;
+                }
+                w += Zeros;
+                if (Literals > uint32_t(RowWords) - w || uint64_t(End - P) < 8ull * Literals)
+                {
+                    return false;
+                }
+                for (uint32_t l = 0; l < Literals; l++, w++, P += 8)
+                {
+                    uint64_t Delta;
+                    memcpy(&Delta, P, 8);
+                    Current[w] ^= Delta;
+                }
+            }
+        }
+        return P == End;
+    }
+};
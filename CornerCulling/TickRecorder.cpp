@@ -0,0 +1,256 @@
+#include "TickRecorder.h"
+#include <chrono>
+#include <cstring>
+
+namespace
+{
+    void WriteVarint(std::vector<uint8_t>& Out, uint32_t Value)
+    {
+        while (Value >= 0x80)
+        {
+            Out.push_back(uint8_t(Value | 0x80));
+            Value >>= 7;
+        }
+        Out.push_back(uint8_t(Value));
+    }
+
+    bool ReadVarint(const uint8_t*& In, const uint8_t* End, uint32_t& Value)
+    {
+        Value = 0;
+        for (int Shift = 0; Shift < 35 && In < End; Shift += 7)
+        {
+            const uint8_t Byte = *In++;
+            Value |= uint32_t(Byte & 0x7F) << Shift;
+            if (Byte < 0x80)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Encodes Current as runs of words that differ from Previous.
+    void EncodeDelta(const uint32_t* Previous, const uint32_t* Current, std::vector<uint8_t>& Out)
+    {
+        Out.clear();
+        int w = 0;
+        while (w < TICK_RECORD_WORDS)
+        {
+            const int ZerosStart = w;
+            while (w < TICK_RECORD_WORDS && Previous[w] == Current[w])
+            {
+                w++;
+            }
+            const int LiteralsStart = w;
+            while (w < TICK_RECORD_WORDS && Previous[w] != Current[w])
+            {
+                w++;
+            }
+            WriteVarint(Out, uint32_t(LiteralsStart - ZerosStart));
+            WriteVarint(Out, uint32_t(w - LiteralsStart));
+            for (int l = LiteralsStart; l < w; l++)
+            {
+                const uint32_t Delta = Previous[l] ^ Current[l];
+                uint8_t Bytes[4];
+                memcpy(Bytes, &Delta, 4);
+                Out.insert(Out.end(), Bytes, Bytes + 4);
+            }
+        }
+    }
+
+    // Applies an encoded delta to Words in place.
+    bool DecodeDelta(const std::vector<uint8_t>& In, uint32_t* Words)
+    {
+        const uint8_t* P = In.data();
+        const uint8_t* End = P + In.size();
+        uint32_t w = 0;
+        while (P < End)
+        {
+            uint32_t Zeros, Literals;
+            if (!ReadVarint(P, End, Zeros) || !ReadVarint(P, End, Literals))
+            {
+                return false;
+            }
+            // Compared against what is left, as sums of corrupt counts
+            // could wrap or point past the payload.
+            if (Zeros > uint32_t(TICK_RECORD_WORDS) - w)
+            {
+                return false;
+            }
+            w += Zeros;
+            if (Literals > uint32_t(TICK_RECORD_WORDS) - w || Literals > uint32_t((End - P) / 4))
+            {
+                return false;
+            }
+            for (uint32_t l = 0; l < Literals; l++, w++, P += 4)
+            {
+                uint32_t Delta;
+                memcpy(&Delta, P, 4);
+                Words[w] ^= Delta;
+            }
+        }
+        return true;
+    }
+}
+
+bool TickRecorder::Start(const char* fileName, const char* mapName, int tickRate)
+{
+    Stop();
+    File = fopen(fileName, "wb");
+    if (File == NULL)
+    {
+        printf("Could not create culling recording %s\n", fileName);
+        return false;
+    }
+    TickLogHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    memcpy(Header.Magic, TICK_LOG_MAGIC, sizeof(Header.Magic));
+    Header.Version = TICK_LOG_VERSION;
+    Header.MaxCharacters = MAX_CHARACTERS;
+    Header.RecordWords = TICK_RECORD_WORDS;
+    Header.TickRate = uint32_t(tickRate);
+    strncpy(Header.MapName, mapName, sizeof(Header.MapName) - 1);
+    if (fwrite(&Header, sizeof(Header), 1, File) != 1)
+    {
+        printf("Could not write culling recording %s\n", fileName);
+        fclose(File);
+        File = NULL;
+        return false;
+    }
+
+    if (!Ring)
+    {
+        Ring.reset(new TickRecord[RING_SIZE]);
+    }
+    Head.store(0);
+    Tail.store(0);
+    NextTick = 0;
+    DroppedTicks.store(0);
+    Running.store(true);
+    Writer = std::thread(&TickRecorder::WriterLoop, this);
+    return true;
+}
+
+void TickRecorder::Stop()
+{
+    if (!Running.exchange(false))
+    {
+        return;
+    }
+    Wake.notify_one();
+    Writer.join();
+    fclose(File);
+    File = NULL;
+    if (DroppedTicks.load() > 0)
+    {
+        printf("Culling recording dropped %lld ticks\n", DroppedTicks.load());
+    }
+}
+
+TickRecord* TickRecorder::BeginTick()
+{
+    if (!Running.load(std::memory_order_relaxed))
+    {
+        return NULL;
+    }
+    const uint32_t Tick = NextTick++;
+    const uint32_t H = Head.load(std::memory_order_relaxed);
+    if (H - Tail.load(std::memory_order_acquire) >= RING_SIZE)
+    {
+        DroppedTicks.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    TickRecord* Record = &Ring[H % RING_SIZE];
+    Record->Tick = Tick;
+    memset(Record->Visibility, 0, sizeof(Record->Visibility));
+    return Record;
+}
+
+void TickRecorder::EndTick()
+{
+    // No wakeup: the writer drains the ring in batches when it polls,
+    // which keeps futex calls and context switches off the game thread.
+    Head.store(Head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void TickRecorder::WriterLoop()
+{
+    // Allocated here, off the game thread. Starts zeroed.
+    std::unique_ptr<TickRecord> Previous(new TickRecord());
+    std::vector<uint8_t> Payload;
+    Payload.reserve(sizeof(TickRecord) * 2);
+
+    while (true)
+    {
+        const uint32_t T = Tail.load(std::memory_order_relaxed);
+        if (T == Head.load(std::memory_order_acquire))
+        {
+            if (!Running.load())
+            {
+                break;
+            }
+            std::unique_lock<std::mutex> Lock(WakeMutex);
+            Wake.wait_for(Lock, std::chrono::milliseconds(WRITER_POLL_MS));
+            continue;
+        }
+        const TickRecord& Current = Ring[T % RING_SIZE];
+        EncodeDelta(
+            reinterpret_cast<const uint32_t*>(Previous.get()),
+            reinterpret_cast<const uint32_t*>(&Current),
+            Payload);
+        const uint32_t Size = uint32_t(Payload.size());
+        fwrite(&Size, sizeof(Size), 1, File);
+        fwrite(Payload.data(), 1, Payload.size(), File);
+        memcpy(Previous.get(), &Current, sizeof(TickRecord));
+        Tail.store(T + 1, std::memory_order_release);
+    }
+    fflush(File);
+}
+
+bool TickLogReader::Open(const char* fileName)
+{
+    Close();
+    File = fopen(fileName, "rb");
+    if (File == NULL)
+    {
+        return false;
+    }
+    if (fread(&Header, sizeof(Header), 1, File) != 1
+        || memcmp(Header.Magic, TICK_LOG_MAGIC, sizeof(Header.Magic)) != 0
+        || Header.Version != TICK_LOG_VERSION
+        || Header.MaxCharacters != uint32_t(MAX_CHARACTERS)
+        || Header.RecordWords != uint32_t(TICK_RECORD_WORDS))
+    {
+        Close();
+        return false;
+    }
+    Header.MapName[sizeof(Header.MapName) - 1] = '\0';
+    Previous = TickRecord();
+    return true;
+}
+
+void TickLogReader::Close()
+{
+    if (File != NULL)
+    {
+        fclose(File);
+        File = NULL;
+    }
+}
+
+bool TickLogReader::Next(TickRecord& Record)
+{
+    uint32_t Size;
+    if (File == NULL || fread(&Size, sizeof(Size), 1, File) != 1)
+    {
+        return false;
+    }
+    Payload.resize(Size);
+    if (fread(Payload.data(), 1, Size, File) != Size
+        || !DecodeDelta(Payload, reinterpret_cast<uint32_t*>(&Previous)))
+    {
+        return false;
+    }
+    Record = Previous;
+    return true;
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include "CullingController.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of 32-bit words in a visibility matrix packed one bit per pair.
+constexpr int VISIBILITY_WORDS =
+    ((MAX_CHARACTERS + 1) * (MAX_CHARACTERS + 1) + 31) / 32;
+
+// One recorded tick: the culling inputs and the visibility they produced.
+struct TickRecord
+{
+    uint32_t Tick = 0;
+    TickInputs Inputs;
+    // Bit i * (MAX_CHARACTERS + 1) + j is set if player i could see j.
+    uint32_t Visibility[VISIBILITY_WORDS] = {0};
+
+    bool IsVisible(int i, int j) const
+    {
+        const int Bit = i * (MAX_CHARACTERS + 1) + j;
+        return (Visibility[Bit >> 5] >> (Bit & 31)) & 1;
+    }
+    void SetVisible(int i, int j)
+    {
+        const int Bit = i * (MAX_CHARACTERS + 1) + j;
+        Visibility[Bit >> 5] |= 1u << (Bit & 31);
+    }
+};
+
+// Records are delta encoded as whole 32-bit words.
+static_assert(sizeof(TickRecord) % 4 == 0, "TickRecord must be made of 32-bit words");
+constexpr int TICK_RECORD_WORDS = int(sizeof(TickRecord) / 4);
+
+// Recording file layout:
+// A TickLogHeader, then for each tick a 32-bit payload size and a payload.
+// A payload XORs the tick's record with the previous one (zeros before
+// the first), and stores the result as alternating varint counts of zero
+// words and of literal words, each literal run followed by its words.
+// Players that stand still or are absent XOR to long runs of zeros.
+constexpr uint32_t TICK_LOG_VERSION = 1;
+const char TICK_LOG_MAGIC[8] = "CULLREC";
+
+struct TickLogHeader
+{
+    char Magic[8];
+    uint32_t Version;
+    // Guards against recordings from builds with a different TickRecord.
+    uint32_t MaxCharacters;
+    uint32_t RecordWords;
+    uint32_t TickRate;
+    char MapName[64];
+};
+
+/**
+ *  Records culling inputs and results to a file without stalling ticks.
+ *  The game thread copies each tick into a ring buffer, and a background
+ *  thread encodes and writes it. If the writer falls behind, ticks are
+ *  dropped rather than blocking the game thread.
+ */
+class TickRecorder
+{
+    // Number of ticks the ring buffer holds, two seconds at 128 tick.
+    static constexpr uint32_t RING_SIZE = 256;
+    // How often the writer drains the ring, well within its capacity.
+    static constexpr int WRITER_POLL_MS = 50;
+    std::unique_ptr<TickRecord[]> Ring;
+    // Next slot the game thread fills, and next slot the writer encodes.
+    // Each is written by only one thread.
+    std::atomic<uint32_t> Head{0};
+    std::atomic<uint32_t> Tail{0};
+    std::atomic<bool> Running{false};
+    std::atomic<long long> DroppedTicks{0};
+    // Tick number of the next BeginTick, counting dropped ticks.
+    uint32_t NextTick = 0;
+    std::thread Writer;
+    // Only signalled by Stop, so that it need not wait for a poll.
+    std::mutex WakeMutex;
+    std::condition_variable Wake;
+    FILE* File = NULL;
+
+    void WriterLoop();
+
+public:
+    TickRecorder() {}
+    ~TickRecorder() { Stop(); }
+    TickRecorder(const TickRecorder&) = delete;
+    TickRecorder& operator=(const TickRecorder&) = delete;
+
+    // Starts recording to fileName, stopping any current recording.
+    // Returns false if the file cannot be created.
+    bool Start(const char* fileName, const char* mapName, int tickRate);
+    // Writes out every queued tick and closes the file.
+    void Stop();
+    bool IsRecording() const { return Running.load(std::memory_order_relaxed); }
+    // Returns the slot to fill with the current tick, or NULL if not
+    // recording or if the ring is full. Only call from the game thread.
+    // The slot's Visibility is cleared, but Inputs must be overwritten.
+    TickRecord* BeginTick();
+    // Hands the slot from BeginTick to the writer.
+    void EndTick();
+    // Returns how many ticks were dropped because the writer fell behind.
+    long long GetDroppedTicks() const { return DroppedTicks.load(); }
+};
+
+/**
+ *  Reads ticks back from a recording, such as for offline benchmarks.
+ */
+class TickLogReader
+{
+    FILE* File = NULL;
+    TickLogHeader Header;
+    TickRecord Previous;
+    std::vector<uint8_t> Payload;
+
+public:
+    TickLogReader() {}
+    ~TickLogReader() { Close(); }
+    TickLogReader(const TickLogReader&) = delete;
+    TickLogReader& operator=(const TickLogReader&) = delete;
+
+    // Opens a recording. Returns false if it is missing or was
+    // written by an incompatible build.
+    bool Open(const char* fileName);
+    void Close();
+    const TickLogHeader& GetHeader() const { return Header; }
+    // Decodes the next tick into Record. Returns false at the end of the
+    // recording or if it is truncated.
+    bool Next(TickRecord& Record);
+};
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+
+/**
+ *  Lock-free handoff of the latest value from one writer thread to one
+ *  reader thread. The writer fills its back buffer and publishes it by
+ *  swapping it with the middle buffer, and the reader takes the middle
+ *  buffer by swapping it with its front buffer. Neither thread ever waits
+ *  on the other, and the reader always gets the newest published value,
+ *  skipping any it was too slow to take.
+ */
+template <typename T>
+class TripleBuffer
+{
+    // Set on the middle index while it holds a value the reader has not taken.
+    static constexpr int FRESH_BIT = 4;
+    static constexpr int INDEX_MASK = 3;
+    T Buffers[3];
+    // Owned by the writer.
+    int Back = 0;
+    // Shared, and only ever swapped.
+    std::atomic<int> Middle{1};
+    // Owned by the reader.
+    int Front = 2;
+
+public:
+    TripleBuffer() {}
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // Buffer for the writer to fill before calling Publish.
+    T& WriteBuffer() { return Buffers[Back]; }
+    // Hands the write buffer to the reader.
+    void Publish()
+    {
+        Back = Middle.exchange(Back | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+    // Whether a published value is waiting for the reader.
+    bool HasFresh() const
+    {
+        return (Middle.load(std::memory_order_acquire) & FRESH_BIT) != 0;
+    }
+    // Takes the newest published value into the read buffer, if there is one.
+    // Returns whether the read buffer changed.
+    bool Update()
+    {
+        if (!HasFresh())
+        {
+            return false;
+        }
+        Front = Middle.exchange(Front, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+    // Value most recently taken by Update.
+    const T& ReadBuffer() const { return Buffers[Front]; }
+    // Sets every buffer and drops any unread value.
+    // Only call while neither thread is using the buffer.
+    void Fill(const T& Value)
+    {
+        Buffers[0] = Buffers[1] = Buffers[2] = Value;
+        Middle.store(Middle.load() & INDEX_MASK);
+    }
+};
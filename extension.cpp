@@ -5,8 +5,92 @@
 #include <string>
 #include <math.h>
 #include "CornerCulling/CullingIO.h"
+#include "CornerCulling/TickRecorder.h"
 
-CullingController cullingController = CullingController();
+CullingController cullingController;
+TickRecorder tickRecorder;
+// Copy of the current map name, which outlives the plugin's string.
+char currentMapName[128] = "";
+
+// Settings of the controller that plugins can change, in the order that
+// SetCullingMap takes them after maxLookahead.
+// The CullingSetting enum in culling.inc must match.
+enum CullingSetting
+{
+    CULLING_SETTING_WORKER_THREADS,
+    CULLING_SETTING_ASYNC,
+    CULLING_SETTING_BUDGET,
+    CULLING_SETTING_MAX_INTERVAL,
+    CULLING_SETTING_REUSE_PROOFS,
+    CULLING_SETTING_PERIOD,
+    CULLING_SETTING_SWEPT_HULLS,
+    CULLING_SETTING_OCCLUSION_HINTS,
+    CULLING_SETTING_ENGINE,
+    CULLING_SETTING_HOT_OCCLUDERS,
+    NUM_CULLING_SETTINGS
+};
+static_assert(NUM_CULLING_SETTINGS == 10, "Update CullingSetting in culling.inc");
+
+// Settings given since the extension loaded. They are applied by the
+// next SetCullingMap, as most only take effect on BeginPlay, and the
+// culling thread may be reading them until then.
+cell_t settingValues[NUM_CULLING_SETTINGS] = {0};
+bool settingGiven[NUM_CULLING_SETTINGS] = {false};
+
+static void ApplyCullingSetting(CullingSetting setting, cell_t value)
+{
+    switch (setting)
+    {
+        case CULLING_SETTING_WORKER_THREADS:
+            cullingController.workerThreads = value;
+            break;
+        case CULLING_SETTING_ASYNC:
+            cullingController.asyncCulling = value != 0;
+            break;
+        case CULLING_SETTING_BUDGET:
+            cullingController.cullBudgetMicroseconds = value;
+            break;
+        case CULLING_SETTING_MAX_INTERVAL:
+            cullingController.maxCullInterval = value;
+            break;
+        case CULLING_SETTING_REUSE_PROOFS:
+            cullingController.reuseProofs = value != 0;
+            break;
+        case CULLING_SETTING_PERIOD:
+            cullingController.cullingPeriod = value;
+            break;
+        case CULLING_SETTING_SWEPT_HULLS:
+            cullingController.sweptHulls = value != 0;
+            break;
+        case CULLING_SETTING_OCCLUSION_HINTS:
+            cullingController.occlusionHints = value != 0;
+            break;
+        case CULLING_SETTING_ENGINE:
+            cullingController.cullingEngine = (value >= 0 && value < NUM_CULLING_ENGINES)
+                ? CullingEngine(value)
+                : CULLING_ENGINE_BVH;
+            break;
+        case CULLING_SETTING_HOT_OCCLUDERS:
+            cullingController.hotOccluders = value != 0;
+            break;
+        default:
+            break;
+    }
+}
+
+// Changes a setting, which takes effect on the next SetCullingMap.
+// Returns false if the setting is unknown.
+cell_t SetCullingSetting(IPluginContext *pContext, const cell_t *params)
+{
+    const cell_t setting = params[1];
+    if (setting < 0 || setting >= NUM_CULLING_SETTINGS)
+    {
+        return 0;
+    }
+    settingValues[setting] = params[2];
+    settingGiven[setting] = true;
+    return 1;
+}
 
 // Initializes the C++ code.
 cell_t SetCullingMap(IPluginContext *pContext, const cell_t *params)
@@ -15,10 +99,56 @@ cell_t SetCullingMap(IPluginContext *pContext, const cell_t *params)
 	pContext->LocalToString(params[1], &mapName);
     cullingController.tickRate = params[2];
     cullingController.maxLookahead = params[3];
-    cullingController.BeginPlay(mapName);
+    // Plugins built against older includes may pass settings after
+    // maxLookahead, as many as their include had.
+    for (int setting = 0; setting < NUM_CULLING_SETTINGS; setting++)
+    {
+        if (params[0] >= 4 + setting)
+        {
+            settingValues[setting] = params[4 + setting];
+            settingGiven[setting] = true;
+        }
+    }
+    for (int setting = 0; setting < NUM_CULLING_SETTINGS; setting++)
+    {
+        if (settingGiven[setting])
+        {
+            ApplyCullingSetting(CullingSetting(setting), settingValues[setting]);
+        }
+    }
+    // A recording covers a single map.
+    tickRecorder.Stop();
+    strncpy(currentMapName, mapName, sizeof(currentMapName) - 1);
+    cullingController.BeginPlay(currentMapName);
     return 1;
 }
 
+// Copies the inputs of a tick into a recording slot.
+static void RecordInputs(
+    TickRecord* record,
+    const cell_t* teams,
+    const float* eyesFlat,
+    const float* basesFlat,
+    const float* yaws,
+    const float* pitches,
+    const float* speeds)
+{
+    TickInputs& inputs = record->Inputs;
+    inputs = TickInputs();
+    for (int i = 1; i <= MAX_CHARACTERS; i++)
+    {
+        inputs.Teams[i] = teams[i];
+        inputs.Yaws[i] = yaws[i];
+        inputs.Pitches[i] = pitches[i];
+        inputs.Speeds[i] = speeds[i];
+        for (int k = i * 3; k < i * 3 + 3; k++)
+        {
+            inputs.Eyes[k] = eyesFlat[k];
+            inputs.Bases[k] = basesFlat[k];
+        }
+    }
+}
+
 // Interface between SM plugin and C++ occlusion culling code.
 cell_t UpdateVisibility(IPluginContext *pContext, const cell_t *params)
 {
@@ -58,6 +188,8 @@ cell_t UpdateVisibility(IPluginContext *pContext, const cell_t *params)
     cullingController.UpdateCharacters(
         teams, eyesFlat, basesFlat, yaws, pitches, speeds);
     cullingController.Tick();
+    // NULL unless a recording is running.
+    TickRecord* record = tickRecorder.BeginTick();
     for (int i = 1; i <= MAX_CHARACTERS; i++)
     {
         if (teams[i] != 0)
@@ -66,12 +198,73 @@ cell_t UpdateVisibility(IPluginContext *pContext, const cell_t *params)
             {
                 if (teams[j] != 0)
                 {
-                    visibility[i * (MAX_CHARACTERS + 1) + j] =
-                        cullingController.IsVisible(i, j);
+                    bool visible = cullingController.IsVisible(i, j);
+                    visibility[i * (MAX_CHARACTERS + 1) + j] = visible;
+                    if (record && visible)
+                    {
+                        record->SetVisible(i, j);
+                    }
                 }
             }
         }
     }
+    if (record)
+    {
+        RecordInputs(record, teams, eyesFlat, basesFlat, yaws, pitches, speeds);
+        tickRecorder.EndTick();
+    }
+    return 1;
+}
+
+// Starts recording each tick's inputs and visibility to a file,
+// relative to the game directory.
+cell_t StartCullingRecording(IPluginContext* pContext, const cell_t* params)
+{
+    char* fileName;
+    pContext->LocalToString(params[1], &fileName);
+    return tickRecorder.Start(fileName, currentMapName, cullingController.tickRate);
+}
+
+// Stops the current recording, if any.
+cell_t StopCullingRecording(IPluginContext* pContext, const cell_t* params)
+{
+    tickRecorder.Stop();
+    return 1;
+}
+
+// The CullingStat enum in culling.inc must match CullingStatIndex.
+static_assert(
+    STAT_BUNDLES_PER_TICK == 26 && STAT_CUBOID_CULL_RATE == 31 && NUM_CULLING_STATS == 44,
+    "Update CullingStat in culling.inc");
+
+// Copies culling metrics, indexed by CullingStat, into a float array.
+// Returns the number of values written.
+cell_t GetCullingStats(IPluginContext* pContext, const cell_t* params)
+{
+    cell_t* stats;
+    pContext->LocalToPhysAddr(params[1], &stats);
+    float values[NUM_CULLING_STATS];
+    int count = cullingController.GetMetrics().Snapshot(values, params[2]);
+    for (int i = 0; i < count; i++)
+    {
+        stats[i] = sp_ftoc(values[i]);
+    }
+    return count;
+}
+
+// Writes a human-readable summary of culling metrics, one line per stage.
+cell_t GetCullingStatsText(IPluginContext* pContext, const cell_t* params)
+{
+    char text[1024];
+    cullingController.GetMetrics().Format(text, sizeof(text));
+    pContext->StringToLocalUTF8(params[1], params[2], text, NULL);
+    return 1;
+}
+
+// Clears culling metrics, starting a new measurement window.
+cell_t ResetCullingStats(IPluginContext* pContext, const cell_t* params)
+{
+    cullingController.ResetMetrics();
     return 1;
 }
 
@@ -107,8 +300,14 @@ cell_t GetRenderedCuboid(IPluginContext* pContext, const cell_t* params)
 const sp_nativeinfo_t MyNatives[] = 
 {
 	{"SetCullingMap",	    SetCullingMap},
+	{"SetCullingSetting",	SetCullingSetting},
 	{"UpdateVisibility",	UpdateVisibility},
 	{"GetRenderedCuboid",	GetRenderedCuboid},
+	{"StartCullingRecording",	StartCullingRecording},
+	{"StopCullingRecording",	StopCullingRecording},
+	{"GetCullingStats",	GetCullingStats},
+	{"GetCullingStatsText",	GetCullingStatsText},
+	{"ResetCullingStats",	ResetCullingStats},
 	{NULL, NULL},
 };
 
@@ -0,0 +1,595 @@
+/**
+    Replays character inputs through CullingController, tick by tick,
+    and reports how long each culling stage takes.
+    Runs without SourceMod, so builds can be compared on any Linux box.
+
+    Usage: culling_benchmark [options] [map name...]
+    With no map names, every culling_*.txt in the maps directory is run.
+    Options:
+      --maps <dir>       Directory of culling maps (default InstallThis/maps)
+      --replay <file>    Replay a recording from culling_record instead of
+                         synthetic players, on the map it was recorded on
+      --ticks <n>        Ticks to time per map (default 2048)
+      --warmup <n>       Untimed ticks before timing (default 128)
+      --players <n>      Synthetic players, up to 64 (default 20)
+      --seed <n>         Seed of the synthetic movement (default 1)
+      --clustered        Keep each team of synthetic players together, as in
+                         executes and retakes
+      --threads <n>      Culling worker threads (default 0)
+      --tickrate <n>     Server tick rate (default 128)
+      --budget <us>      Time budget of each cull (default 0, no limit)
+      --interval <ms>    Longest re-cull interval of hidden pairs (default 0)
+      --reuse-proofs     Reuse occlusion proofs of pairs that barely move
+      --period <n>       Ticks between culls of each pair (default 2),
+                         above 2 only with --swept
+      --swept            Grow hulls and peeks by the travel in a period
+      --hot-occluders    Try each player's recent blockers before the BVH
+      --hints            Load, use and save culling_<map>.hints
+      --no-pvs           Ignore culling_<map>.pvs
+      --no-portals       Ignore culling_<map>.portals
+      --engine <name>    Cull with "bvh" (default) or "raster"
+      --count-allocations
+                         Fail if any timed tick allocates. Only works in
+                         culling_benchmark_allocs, which counts operator new
+
+    The visibility checksum only depends on the culling results,
+    so it must match between builds that should behave the same.
+    Replays also count pairs whose visibility differs from the recording.
+    A few differ near the start, since the recording server's caches and
+    visibility timers were already warm.
+*/
+
+#include "CornerCulling/CullingController.h"
+#include "CornerCulling/TickRecorder.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    // Supplies the inputs of each tick.
+    class TickSource
+    {
+    public:
+        virtual ~TickSource() {}
+        // Fills the next tick, returning false when there are no more.
+        virtual bool Next(TickRecord& Record) = 0;
+        // Whether records carry the visibility that culling produced.
+        virtual bool HasVisibility() const = 0;
+    };
+
+    // Players that wander around the map's bounds, alternating teams.
+    // Each keeps a heading that drifts, and switches between running,
+    // walking and standing, so caches see both stable and changing pairs.
+    // Clustered players also turn back toward their team's leader, a point
+    // that wanders at walking speed, whenever they stray too far from it.
+    class SyntheticPlayers final : public TickSource
+    {
+        // Farthest clustered players stray from their team's leader.
+        static constexpr float CLUSTER_RADIUS = 400;
+        static constexpr float LEADER_SPEED = 130;
+
+        std::mt19937 Rng;
+        int NumPlayers;
+        float TickRate;
+        bool Clustered;
+        vec3 Min;
+        vec3 Max;
+        float Headings[MAX_CHARACTERS + 1] = {0};
+        // Position and heading of each team's leader, indexed by team - 2.
+        glm::vec2 Leaders[2];
+        float LeaderHeadings[2] = {0};
+        TickInputs Inputs;
+
+        // Moves a point along a heading, turning around at the map's edge.
+        void Step(float* Position, float& Heading, float Distance) const
+        {
+            const float Radians = Heading * PI / 180;
+            Position[0] += Distance * cosf(Radians);
+            Position[1] += Distance * sinf(Radians);
+            if (Position[0] < Min.x || Position[0] > Max.x || Position[1] < Min.y || Position[1] > Max.y)
+            {
+                Position[0] = std::min(std::max(Position[0], Min.x), Max.x);
+                Position[1] = std::min(std::max(Position[1], Min.y), Max.y);
+                Heading = fmodf(Heading + 180, 360);
+            }
+        }
+
+    public:
+        SyntheticPlayers(
+            int Players, unsigned Seed, int TickRate, bool Clustered, vec3 MapMin, vec3 MapMax)
+            : Rng(Seed),
+              NumPlayers(Players),
+              TickRate(float(TickRate)),
+              Clustered(Clustered),
+              Min(MapMin),
+              Max(MapMax)
+        {
+            // Keep players near the floor of the map, where they walk.
+            Max.z = Min.z + std::max(1.0f, 0.25f * (Max.z - Min.z));
+            std::uniform_real_distribution<float> X(Min.x, Max.x), Y(Min.y, Max.y), Z(Min.z, Max.z);
+            std::uniform_real_distribution<float> Angle(0, 360);
+            std::uniform_real_distribution<float> Spread(-CLUSTER_RADIUS / 2, CLUSTER_RADIUS / 2);
+            if (Clustered)
+            {
+                for (int t = 0; t < 2; t++)
+                {
+                    Leaders[t] = glm::vec2(X(Rng), Y(Rng));
+                    LeaderHeadings[t] = Angle(Rng);
+                }
+            }
+            for (int i = 1; i <= NumPlayers; i++)
+            {
+                Inputs.Teams[i] = 2 + (i % 2);
+                Inputs.Bases[i * 3] = X(Rng);
+                Inputs.Bases[i * 3 + 1] = Y(Rng);
+                Inputs.Bases[i * 3 + 2] = Z(Rng);
+                Inputs.Speeds[i] = MAX_PLAYER_SPEED;
+                Headings[i] = Angle(Rng);
+                if (Clustered)
+                {
+                    const glm::vec2& Leader = Leaders[Inputs.Teams[i] - 2];
+                    Inputs.Bases[i * 3] = std::min(std::max(Leader.x + Spread(Rng), Min.x), Max.x);
+                    Inputs.Bases[i * 3 + 1] = std::min(std::max(Leader.y + Spread(Rng), Min.y), Max.y);
+                }
+            }
+        }
+
+        bool HasVisibility() const override { return false; }
+
+        bool Next(TickRecord& Record) override
+        {
+            std::uniform_real_distribution<float> Turn(-4, 4), Chance(0, 1);
+            std::uniform_real_distribution<float> Pitch(-30, 30);
+            if (Clustered)
+            {
+                for (int t = 0; t < 2; t++)
+                {
+                    LeaderHeadings[t] = fmodf(LeaderHeadings[t] + Turn(Rng) + 360, 360);
+                    Step(&Leaders[t].x, LeaderHeadings[t], LEADER_SPEED / TickRate);
+                }
+            }
+            for (int i = 1; i <= NumPlayers; i++)
+            {
+                Headings[i] = fmodf(Headings[i] + Turn(Rng) + 360, 360);
+                if (Chance(Rng) < 0.01f)
+                {
+                    const float Gaits[3] = { MAX_PLAYER_SPEED, 130, 0 };
+                    Inputs.Speeds[i] = Gaits[Rng() % 3];
+                }
+                float* Base = &Inputs.Bases[i * 3];
+                if (Clustered)
+                {
+                    const glm::vec2 ToLeader = Leaders[Inputs.Teams[i] - 2] - glm::vec2(Base[0], Base[1]);
+                    if (glm::length(ToLeader) > CLUSTER_RADIUS)
+                    {
+                        Headings[i] = fmodf(atan2f(ToLeader.y, ToLeader.x) * 180 / PI + 360, 360);
+                    }
+                }
+                Step(Base, Headings[i], Inputs.Speeds[i] / TickRate);
+                Inputs.Eyes[i * 3] = Base[0];
+                Inputs.Eyes[i * 3 + 1] = Base[1];
+                Inputs.Eyes[i * 3 + 2] = Base[2] + 64;
+                Inputs.Yaws[i] = Headings[i];
+                Inputs.Pitches[i] = Pitch(Rng);
+            }
+            Record.Inputs = Inputs;
+            return true;
+        }
+    };
+
+    // Ticks read back from a recording.
+    class RecordedTicks final : public TickSource
+    {
+        TickLogReader& Reader;
+
+    public:
+        explicit RecordedTicks(TickLogReader& Reader) : Reader(Reader) {}
+        bool HasVisibility() const override { return true; }
+        bool Next(TickRecord& Record) override { return Reader.Next(Record); }
+    };
+
+    struct Options
+    {
+        std::string MapDirectory = "InstallThis/maps/";
+        std::string ReplayFile;
+        int Ticks = 2048;
+        int Warmup = 128;
+        int Players = 20;
+        unsigned Seed = 1;
+        bool Clustered = false;
+        int Threads = 0;
+        int TickRate = 128;
+        int BudgetMicroseconds = 0;
+        int MaxInterval = 0;
+        bool ReuseProofs = false;
+        int Period = 2;
+        bool Swept = false;
+        bool HotOccluders = false;
+        bool Hints = false;
+        bool UsePvs = true;
+        bool UsePortals = true;
+        CullingEngine Engine = CULLING_ENGINE_BVH;
+        bool CountAllocations = false;
+    };
+
+    // Returns the p-th percentile of sorted samples.
+    double Percentile(const std::vector<long long>& Sorted, double P)
+    {
+        if (Sorted.empty())
+        {
+            return 0;
+        }
+        size_t Index = std::min(Sorted.size() - 1, size_t(P / 100 * Sorted.size()));
+        return double(Sorted[Index]);
+    }
+
+    void PrintTimes(const char* Name, std::vector<long long>& Nanoseconds)
+    {
+        std::sort(Nanoseconds.begin(), Nanoseconds.end());
+        double Total = 0;
+        for (long long T : Nanoseconds)
+        {
+            Total += double(T);
+        }
+        printf(
+            "  %-11s mean %9.1f  p50 %9.1f  p99 %9.1f  max %9.1f us\n",
+            Name,
+            Total / std::max<size_t>(1, Nanoseconds.size()) / 1000,
+            Percentile(Nanoseconds, 50) / 1000,
+            Percentile(Nanoseconds, 99) / 1000,
+            double(Nanoseconds.back()) / 1000);
+    }
+
+    // Returns false if the map could not be run, or if a timed tick
+    // allocated while counting allocations.
+    bool RunMap(const Options& Opts, const std::string& MapName)
+    {
+        // The controller is too large for the stack.
+        auto Controller = std::make_unique<CullingController>();
+        Controller->mapDirectory = Opts.MapDirectory.c_str();
+        Controller->workerThreads = Opts.Threads;
+        Controller->tickRate = Opts.TickRate;
+        Controller->cullBudgetMicroseconds = Opts.BudgetMicroseconds;
+        Controller->maxCullInterval = Opts.MaxInterval;
+        Controller->reuseProofs = Opts.ReuseProofs;
+        Controller->cullingPeriod = Opts.Period;
+        Controller->sweptHulls = Opts.Swept;
+        Controller->hotOccluders = Opts.HotOccluders;
+        Controller->occlusionHints = Opts.Hints;
+        Controller->usePvs = Opts.UsePvs;
+        Controller->usePortals = Opts.UsePortals;
+        Controller->cullingEngine = Opts.Engine;
+        std::vector<char> Name(MapName.begin(), MapName.end());
+        Name.push_back('\0');
+        Controller->BeginPlay(Name.data());
+
+        std::unique_ptr<TickSource> Source;
+        TickLogReader Reader;
+        if (!Opts.ReplayFile.empty())
+        {
+            if (!Reader.Open(Opts.ReplayFile.c_str()))
+            {
+                printf("Could not read recording %s\n", Opts.ReplayFile.c_str());
+                return false;
+            }
+            Controller->tickRate = int(Reader.GetHeader().TickRate);
+            Source = std::make_unique<RecordedTicks>(Reader);
+        }
+        else
+        {
+            vec3 Min, Max;
+            Controller->GetMapBounds(Min, Max);
+            Source = std::make_unique<SyntheticPlayers>(
+                Opts.Players, Opts.Seed, Opts.TickRate, Opts.Clustered, Min, Max);
+        }
+        // Large, so reused for every tick.
+        auto Record = std::make_unique<TickRecord>();
+        TickInputs& Inputs = Record->Inputs;
+
+        for (int t = 0; t < Opts.Warmup && Source->Next(*Record); t++)
+        {
+            Controller->UpdateCharacters(
+                Inputs.Teams, Inputs.Eyes, Inputs.Bases, Inputs.Yaws, Inputs.Pitches, Inputs.Speeds);
+            Controller->Tick();
+        }
+
+        Controller->ResetMetrics();
+
+        std::vector<long long> Stages[NUM_CULLING_STAGES];
+        std::vector<long long> Ticks;
+        long long Culled[4] = {0};
+        long long Queued = 0;
+        long long Mismatches = 0;
+        long long Allocations = 0;
+        int AllocatingTicks = 0;
+        int MaxPlayers = 0;
+        unsigned long long Checksum = 14695981039346656037ull;
+        for (auto& S : Stages)
+        {
+            S.reserve(Opts.Ticks);
+        }
+        Ticks.reserve(Opts.Ticks);
+
+        for (int t = 0; t < Opts.Ticks && Source->Next(*Record); t++)
+        {
+            Controller->UpdateCharacters(
+                Inputs.Teams, Inputs.Eyes, Inputs.Bases, Inputs.Yaws, Inputs.Pitches, Inputs.Speeds);
+            const auto Start = std::chrono::steady_clock::now();
+            Controller->Tick();
+            const auto Stop = std::chrono::steady_clock::now();
+            Ticks.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Stop - Start).count());
+            Allocations += Controller->GetTickAllocations();
+            AllocatingTicks += Controller->GetTickAllocations() > 0;
+
+            const CullingTickStats& Stats = Controller->GetLastTickStats();
+            for (int s = 0; s < NUM_CULLING_STAGES; s++)
+            {
+                Stages[s].push_back(Stats.StageNanoseconds[s]);
+            }
+            Queued += Stats.BundlesQueued;
+            Culled[0] += Stats.BundlesCulledByCache;
+            Culled[1] += Stats.BundlesCulledByCuboids;
+            Culled[2] += Stats.BundlesRevealed;
+            Culled[3] += Stats.BundlesDeferred;
+
+            // Checks the same pairs that the extension reports.
+            int Players = 0;
+            for (int i = 1; i <= MAX_CHARACTERS; i++)
+            {
+                if (Inputs.Teams[i] == 0)
+                {
+                    continue;
+                }
+                Players++;
+                for (int j = 1; j <= MAX_CHARACTERS; j++)
+                {
+                    if (Inputs.Teams[j] == 0)
+                    {
+                        continue;
+                    }
+                    const bool Visible = Controller->IsVisible(i, j);
+                    Checksum = (Checksum ^ Visible) * 1099511628211ull;
+                    if (Source->HasVisibility() && Visible != Record->IsVisible(i, j))
+                    {
+                        Mismatches++;
+                    }
+                }
+            }
+            MaxPlayers = std::max(MaxPlayers, Players);
+        }
+
+        const int NumTicks = int(Ticks.size());
+        if (NumTicks == 0)
+        {
+            printf("%s: no ticks to run\n", MapName.c_str());
+            return false;
+        }
+        long long TotalNanoseconds = 0;
+        for (long long T : Ticks)
+        {
+            TotalNanoseconds += T;
+        }
+        const double PerTick = 1.0 / NumTicks;
+        printf("%s: %d players, %d ticks, %d threads\n",
+            MapName.c_str(), MaxPlayers, NumTicks, Opts.Threads);
+        PrintTimes("tick", Ticks);
+        const char* StageNames[NUM_CULLING_STAGES] = { "populate", "cache", "cuboids", "visibility" };
+        for (int s = 0; s < NUM_CULLING_STAGES; s++)
+        {
+            PrintTimes(StageNames[s], Stages[s]);
+        }
+        printf(
+            "  bundles/tick: %.1f queued, %.1f culled by cache, %.1f culled by cuboids, "
+            "%.1f revealed, %.1f deferred\n",
+            Queued * PerTick,
+            Culled[0] * PerTick,
+            Culled[1] * PerTick,
+            Culled[2] * PerTick,
+            Culled[3] * PerTick);
+        printf(
+            "  throughput: %.0f pairs/sec\n",
+            TotalNanoseconds > 0 ? Queued * 1e9 / TotalNanoseconds : 0.0);
+        printf("  visibility checksum: %016llx\n", Checksum);
+        if (Source->HasVisibility())
+        {
+            printf("  pairs differing from the recording: %lld\n", Mismatches);
+        }
+        char Summary[2048];
+        Controller->GetMetrics().Format(Summary, sizeof(Summary));
+        printf("%s", Summary);
+        if (Opts.CountAllocations)
+        {
+            printf("  allocations: %lld in %d of %d ticks\n", Allocations, AllocatingTicks, NumTicks);
+            if (AllocatingTicks > 0)
+            {
+                printf("%s: steady-state ticks allocated\n", MapName.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Lists the map names of every culling_<map>.txt in Directory.
+    std::vector<std::string> FindMaps(const std::string& Directory)
+    {
+        std::vector<std::string> Maps;
+        DIR* Dir = opendir(Directory.c_str());
+        if (Dir == NULL)
+        {
+            return Maps;
+        }
+        const std::string Prefix = "culling_";
+        const std::string Suffix = ".txt";
+        while (dirent* Entry = readdir(Dir))
+        {
+            std::string File = Entry->d_name;
+            if (File.size() > Prefix.size() + Suffix.size()
+                && File.compare(0, Prefix.size(), Prefix) == 0
+                && File.compare(File.size() - Suffix.size(), Suffix.size(), Suffix) == 0)
+            {
+                std::string Map = File.substr(Prefix.size(), File.size() - Prefix.size() - Suffix.size());
+                // Skip the template for new maps.
+                if (Map != "MAPNAME")
+                {
+                    Maps.push_back(Map);
+                }
+            }
+        }
+        closedir(Dir);
+        std::sort(Maps.begin(), Maps.end());
+        return Maps;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options Opts;
+    std::vector<std::string> Maps;
+    for (int i = 1; i < argc; i++)
+    {
+        const bool HasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--maps") && HasValue)
+        {
+            Opts.MapDirectory = argv[++i];
+            if (Opts.MapDirectory.back() != '/')
+            {
+                Opts.MapDirectory += '/';
+            }
+        }
+        else if (!strcmp(argv[i], "--replay") && HasValue)
+        {
+            Opts.ReplayFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--ticks") && HasValue)
+        {
+            Opts.Ticks = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--warmup") && HasValue)
+        {
+            Opts.Warmup = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--players") && HasValue)
+        {
+            Opts.Players = std::min(std::max(atoi(argv[++i]), 2), MAX_CHARACTERS - 1);
+        }
+        else if (!strcmp(argv[i], "--seed") && HasValue)
+        {
+            Opts.Seed = unsigned(atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--clustered"))
+        {
+            Opts.Clustered = true;
+        }
+        else if (!strcmp(argv[i], "--threads") && HasValue)
+        {
+            Opts.Threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--tickrate") && HasValue)
+        {
+            Opts.TickRate = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--budget") && HasValue)
+        {
+            Opts.BudgetMicroseconds = std::max(0, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--interval") && HasValue)
+        {
+            Opts.MaxInterval = std::max(0, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--reuse-proofs"))
+        {
+            Opts.ReuseProofs = true;
+        }
+        else if (!strcmp(argv[i], "--period") && HasValue)
+        {
+            Opts.Period = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--swept"))
+        {
+            Opts.Swept = true;
+        }
+        else if (!strcmp(argv[i], "--hot-occluders"))
+        {
+            Opts.HotOccluders = true;
+        }
+        else if (!strcmp(argv[i], "--hints"))
+        {
+            Opts.Hints = true;
+        }
+        else if (!strcmp(argv[i], "--no-pvs"))
+        {
+            Opts.UsePvs = false;
+        }
+        else if (!strcmp(argv[i], "--no-portals"))
+        {
+            Opts.UsePortals = false;
+        }
+        else if (!strcmp(argv[i], "--engine") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "raster"))
+            {
+                Opts.Engine = CULLING_ENGINE_RASTER;
+            }
+            else if (strcmp(argv[i], "bvh"))
+            {
+                printf("Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--count-allocations"))
+        {
+#ifdef CULLING_COUNT_ALLOCATIONS
+            Opts.CountAllocations = true;
+#else
+            printf("--count-allocations needs culling_benchmark_allocs\n");
+            return 1;
+#endif
+        }
+        else if (argv[i][0] == '-')
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+        else
+        {
+            Maps.push_back(argv[i]);
+        }
+    }
+    if (Maps.empty() && !Opts.ReplayFile.empty())
+    {
+        // Replays run on the map they were recorded on.
+        TickLogReader Reader;
+        if (!Reader.Open(Opts.ReplayFile.c_str()))
+        {
+            printf("Could not read recording %s\n", Opts.ReplayFile.c_str());
+            return 1;
+        }
+        Maps.push_back(Reader.GetHeader().MapName);
+    }
+    if (Maps.empty())
+    {
+        Maps = FindMaps(Opts.MapDirectory);
+        if (Maps.empty())
+        {
+            printf("No culling maps found in %s\n", Opts.MapDirectory.c_str());
+            return 1;
+        }
+    }
+    int Failures = 0;
+    for (const std::string& Map : Maps)
+    {
+        Failures += !RunMap(Opts, Map);
+    }
+    return Failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+/**
+    Compiles culling maps from text into the binary format that
+    CullingController::BeginPlay maps directly, skipping the text parse
+    and BVH build on map change.
+
+    Usage: culling_compile_map <maps directory> <map name>...
+    Example: culling_compile_map csgo/maps de_dust2 de_mirage
+    reads csgo/maps/culling_de_dust2.txt and writes
+    csgo/maps/culling_de_dust2.bin, and likewise for de_mirage.
+
+    Recompile after editing a text map. BeginPlay falls back to the text
+    map whenever the compiled map does not match it.
+*/
+
+#include "CornerCulling/CullingController.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <maps directory> <map name>...\n", argv[0]);
+        return 1;
+    }
+    std::string Directory = argv[1];
+    if (Directory.back() != '/' && Directory.back() != '\\')
+    {
+        Directory += '/';
+    }
+
+    int Failures = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        // The controller is too large for the stack.
+        auto Controller = std::make_unique<CullingController>();
+        Controller->mapDirectory = Directory.c_str();
+        Controller->useCompiledMaps = false;
+        Controller->BeginPlay(argv[i]);
+        if (Controller->SaveCompiledMap())
+        {
+            printf("Compiled %sculling_%s.bin\n", Directory.c_str(), argv[i]);
+        }
+        else
+        {
+            printf("Failed to compile %s\n", argv[i]);
+            Failures++;
+        }
+    }
+    return Failures == 0 ? 0 : 1;
+}
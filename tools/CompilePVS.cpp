@@ -0,0 +1,304 @@
+/**
+    Computes the potentially visible sets of culling maps, which let
+    CullingController skip pairs of characters that cannot see each other
+    before testing any geometry.
+
+    Usage: culling_compile_pvs [options] <maps directory> <map name>...
+    Example: culling_compile_pvs csgo/maps de_dust2 de_mirage
+    reads csgo/maps/culling_de_dust2.txt (or its up-to-date .bin) and
+    writes csgo/maps/culling_de_dust2.pvs, and likewise for de_mirage.
+
+    Options:
+      --cell <units>     Width of each grid cell (default 128)
+      --margin <units>   Furthest that peeks reach past a character's eye,
+                         and that swept hulls grow (default 64). Culling
+                         ignores the PVS if its lookahead and sweep need more.
+      --splits <n>       Times each pair of cells may be halved to find
+                         occluders that block it together (default 6)
+      --threads <n>      Worker threads (default: one per core)
+
+    Recompute after editing a map. BeginPlay ignores a PVS computed for
+    other occluders.
+*/
+
+#include "CornerCulling/CullingController.h"
+#include "CornerCulling/CullingIO.h"
+#include <glm/gtx/component_wise.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace
+{
+    // Depth that the middles of blocked segments must reach inside an
+    // occluder, which absorbs the error of approximate reciprocals.
+    constexpr float MIN_BLOCKED_DEPTH = 1;
+    // Rows of the cell matrix that each worker claims at a time.
+    constexpr int ROW_GRAIN = 4;
+    // Times a pair of boxes may be halved while searching for occluders
+    // that together block it.
+    constexpr int MAX_SPLITS = 6;
+
+    struct Options
+    {
+        float CellSize = 128;
+        float Margin = 64;
+        int Splits = MAX_SPLITS;
+        int Threads = std::max(1, int(std::thread::hardware_concurrency())) - 1;
+    };
+
+    void GetCorners(const vec3& Min, const vec3& Max, vec3 (&Corners)[8])
+    {
+        for (int c = 0; c < 8; c++)
+        {
+            Corners[c] = vec3(
+                (c & 1) ? Max.x : Min.x,
+                (c & 2) ? Max.y : Min.y,
+                (c & 4) ? Max.z : Min.z);
+        }
+    }
+
+    // Whether an occluder blocks every segment between two boxes. As the
+    // occluder is convex, it does if it blocks every segment between
+    // their corners.
+    bool BlocksBoxes(const CuboidPlanes* C, const vec3 (&From)[8], const vec3 (&To)[8])
+    {
+        const __m256 EndXs = _mm256_set_ps(
+            To[7].x, To[6].x, To[5].x, To[4].x, To[3].x, To[2].x, To[1].x, To[0].x);
+        const __m256 EndYs = _mm256_set_ps(
+            To[7].y, To[6].y, To[5].y, To[4].y, To[3].y, To[2].y, To[1].y, To[0].y);
+        const __m256 EndZs = _mm256_set_ps(
+            To[7].z, To[6].z, To[5].z, To[4].z, To[3].z, To[2].z, To[1].z, To[0].z);
+        for (int f = 0; f < 8; f++)
+        {
+            if (
+                MinMiddleDepth(
+                    C,
+                    _mm256_set1_ps(From[f].x),
+                    _mm256_set1_ps(From[f].y),
+                    _mm256_set1_ps(From[f].z),
+                    EndXs,
+                    EndYs,
+                    EndZs) < MIN_BLOCKED_DEPTH)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Overlap(const vec3& MinA, const vec3& MaxA, const vec3& MinB, const vec3& MaxB)
+    {
+        return glm::all(glm::lessThanEqual(MinA, MaxB))
+            && glm::all(glm::lessThanEqual(MinB, MaxA));
+    }
+
+    // Whether every segment between two boxes is blocked. Boxes that no
+    // single occluder blocks are halved, as each part may be blocked by a
+    // different occluder. Conservative: false may just mean that the
+    // search gave up.
+    template <typename TraverserType>
+    bool BoxesBlocked(
+        const TraverserType& Traverser,
+        const vec3& MinA,
+        const vec3& MaxA,
+        const vec3& MinB,
+        const vec3& MaxB,
+        int Splits)
+    {
+        if (Overlap(MinA, MaxA, MinB, MaxB))
+        {
+            return false;
+        }
+        vec3 CornersA[8];
+        vec3 CornersB[8];
+        GetCorners(MinA, MaxA, CornersA);
+        GetCorners(MinB, MaxB, CornersB);
+        // A blocker crosses every segment between the boxes, including the
+        // one between their centers. If nothing crosses it, it is a clear
+        // line of sight, and halving cannot help.
+        const OptSegment Segment(0.5f * (MinA + MaxA), 0.5f * (MinB + MaxB));
+        bool Crossed = false;
+        FastBVH::TraversalStats Stats;
+        const bool Blocked = Traverser.forEachCandidate(
+            Segment,
+            [&](const CuboidPlanes& C)
+            {
+                if (!Traverser.getIntersector()(C, Segment))
+                {
+                    return false;
+                }
+                Crossed = true;
+                return BlocksBoxes(&C, CornersA, CornersB);
+            },
+            Stats);
+        if (Blocked)
+        {
+            return true;
+        }
+        if (!Crossed || Splits == 0)
+        {
+            return false;
+        }
+        // Halve the longest side of either box.
+        const vec3 SizeA = MaxA - MinA;
+        const vec3 SizeB = MaxB - MinB;
+        const bool SplitA = glm::compMax(SizeA) >= glm::compMax(SizeB);
+        const vec3 Size = SplitA ? SizeA : SizeB;
+        const int Axis = (Size.x >= Size.y && Size.x >= Size.z) ? 0 : (Size.y >= Size.z ? 1 : 2);
+        vec3 Min = SplitA ? MinA : MinB;
+        vec3 Max = SplitA ? MaxA : MaxB;
+        const float Middle = 0.5f * (Min[Axis] + Max[Axis]);
+        vec3 LowMax = Max;
+        vec3 HighMin = Min;
+        LowMax[Axis] = Middle;
+        HighMin[Axis] = Middle;
+        return SplitA
+            ? BoxesBlocked(Traverser, Min, LowMax, MinB, MaxB, Splits - 1)
+                && BoxesBlocked(Traverser, HighMin, Max, MinB, MaxB, Splits - 1)
+            : BoxesBlocked(Traverser, MinA, MaxA, Min, LowMax, Splits - 1)
+                && BoxesBlocked(Traverser, MinA, MaxA, HighMin, Max, Splits - 1);
+    }
+
+    template <typename TraverserType>
+    bool CompilePvs(const Options& Opts, CullingController& Controller, const char* FileName)
+    {
+        const CompiledMapView<BVH_WIDTH>& Map = Controller.GetMap();
+        if (Map.OccluderCount == 0)
+        {
+            return false;
+        }
+        vec3 Min, Max;
+        Controller.GetMapBounds(Min, Max);
+        uint32_t Dims[3];
+        for (int a = 0; a < 3; a++)
+        {
+            Dims[a] = std::max(1u, uint32_t(std::ceil((Max[a] - Min[a]) / Opts.CellSize)));
+        }
+        PotentiallyVisibleSet Pvs;
+        if (!Pvs.Reset(Min, Dims, Opts.CellSize, Opts.Margin))
+        {
+            printf(
+                "%u x %u x %u cells is over the limit of %u, use larger cells\n",
+                Dims[0], Dims[1], Dims[2], MAX_PVS_CELLS);
+            return false;
+        }
+        const int Cells = Pvs.GetCellCount();
+        const TraverserType Traverser(
+            Map.WideNodes, Map.WideNodeCount, CuboidIntersector(), Map.Planes);
+
+        CullingThreadPool Pool;
+        Pool.Resize(Opts.Threads);
+        const auto Start = std::chrono::steady_clock::now();
+        // Each worker only writes the rows it claims, for the cells after
+        // the row's own. The other half is mirrored afterwards.
+        Pool.ParallelFor(
+            Cells,
+            ROW_GRAIN,
+            [&](int Begin, int End)
+            {
+                for (int A = Begin; A < End; A++)
+                {
+                    vec3 MinA, MaxA;
+                    Pvs.GetCellReach(A, MinA, MaxA);
+                    for (int B = A + 1; B < Cells; B++)
+                    {
+                        vec3 MinB, MaxB;
+                        Pvs.GetCellReach(B, MinB, MaxB);
+                        if (BoxesBlocked(Traverser, MinA, MaxA, MinB, MaxB, Opts.Splits))
+                        {
+                            Pvs.SetInvisible(A, B);
+                        }
+                    }
+                }
+            });
+        long long Invisible = 0;
+        for (int A = 0; A < Cells; A++)
+        {
+            for (int B = A + 1; B < Cells; B++)
+            {
+                if (!Pvs.MayBeVisible(A, B))
+                {
+                    Pvs.SetInvisible(B, A);
+                    Invisible++;
+                }
+            }
+        }
+        const double Seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - Start).count();
+        printf(
+            "%u x %u x %u cells, %.1f%% of pairs invisible, in %.1f s\n",
+            Dims[0], Dims[1], Dims[2],
+            100.0 * double(Invisible) / std::max(1.0, 0.5 * double(Cells) * double(Cells - 1)),
+            Seconds);
+        return Pvs.Save(FileName, Controller.GetOccluderHash(), Map.OccluderCount);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options Opts;
+    int First = 1;
+    for (; First < argc && argv[First][0] == '-'; First++)
+    {
+        const bool HasValue = First + 1 < argc;
+        if (!strcmp(argv[First], "--cell") && HasValue)
+        {
+            Opts.CellSize = std::max(1.0f, float(atof(argv[++First])));
+        }
+        else if (!strcmp(argv[First], "--margin") && HasValue)
+        {
+            Opts.Margin = std::max(0.0f, float(atof(argv[++First])));
+        }
+        else if (!strcmp(argv[First], "--splits") && HasValue)
+        {
+            Opts.Splits = std::max(0, atoi(argv[++First]));
+        }
+        else if (!strcmp(argv[First], "--threads") && HasValue)
+        {
+            Opts.Threads = std::max(0, atoi(argv[++First]));
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[First]);
+            return 1;
+        }
+    }
+    if (argc - First < 2)
+    {
+        printf("Usage: %s [options] <maps directory> <map name>...\n", argv[0]);
+        return 1;
+    }
+    std::string Directory = argv[First];
+    if (Directory.back() != '/' && Directory.back() != '\\')
+    {
+        Directory += '/';
+    }
+
+    int Failures = 0;
+    for (int i = First + 1; i < argc; i++)
+    {
+        // The controller is too large for the stack.
+        auto Controller = std::make_unique<CullingController>();
+        Controller->mapDirectory = Directory.c_str();
+        Controller->usePvs = false;
+        Controller->BeginPlay(argv[i]);
+        char FileName[256];
+        MapFileName(FileName, Directory.c_str(), argv[i], ".pvs");
+        if (CompilePvs<Traverser<float, CuboidIntersector, BVH_WIDTH>>(Opts, *Controller, FileName))
+        {
+            printf("Compiled %s\n", FileName);
+        }
+        else
+        {
+            printf("Failed to compile the PVS of %s\n", argv[i]);
+            Failures++;
+        }
+    }
+    return Failures == 0 ? 0 : 1;
+}